@@ -23,8 +23,10 @@ if is_linux then
 		links {
 			"GLEW",
 			"GL",
+			"EGL",
 			"glut",
-			"m"
+			"m",
+			"pthread"
 		}
 
 else
@@ -59,7 +61,9 @@ else
 		
 		links {
 			"glew32.lib",
-			"freeglut.lib"
+			"freeglut.lib",
+			"winmm.lib",
+			"psapi.lib"
 		}
 
 end
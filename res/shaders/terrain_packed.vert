@@ -0,0 +1,72 @@
+#version 430 core
+
+layout (std140, binding = 0) uniform ubModelViewProj
+{
+	mat4	g_ModelViewProjectionMatrix;
+	mat4	g_ModelViewMatrix;
+};
+
+layout (std140, binding = 4) uniform ubMorph
+{
+	vec4	g_CameraPos;
+	vec4	g_MorphInfo;			// max level, edge length, height field width, height
+	vec4	g_ActiveDistance[4];	// per quad tree level
+};
+
+layout (binding = 2) uniform sampler2D g_TexHeight;
+
+// x:13, y:13, direction to the parent vert node:4, see PackGridVertex
+layout (location = 0) in  uint vs_in_packed;
+layout (location = 0) out vec3 vs_out_pos_view;
+layout (location = 1) out vec2 vs_out_texcoord;
+
+const uint GRID_BITS = 13u;
+const uint GRID_MASK = (1u << GRID_BITS) - 1u;
+const uint PARENT_NONE = 4u;
+
+float ActiveDistance(int level) {
+	return g_ActiveDistance[level >> 2][level & 3];
+}
+
+vec3 GridPos(ivec2 xy) {
+	return vec3(vec2(xy), texelFetch(g_TexHeight, xy, 0).r);
+}
+
+void main() {
+	ivec2 xy = ivec2(vs_in_packed & GRID_MASK, (vs_in_packed >> GRID_BITS) & GRID_MASK);
+	uint dir = vs_in_packed >> (GRID_BITS * 2u);
+
+	vec3 pos = GridPos(xy);
+
+	// geomorph toward the parent vert node, the same as QuadCollapseMesh::UpdateVertNode
+	if (dir != PARENT_NONE) {
+		int shift = findLSB(xy.x | xy.y);
+		int level = int(g_MorphInfo.x) - shift;
+		ivec2 parent_dir = ivec2(int(dir % 3u) - 1, int(dir / 3u) - 1);
+		vec3 parent_pos = GridPos(xy + (parent_dir << shift));
+
+		float dist = length(g_CameraPos.xyz - pos);
+		float active_distance = ActiveDistance(level);
+
+		if (dist >= active_distance) {
+			vec3 o_minus_c = pos - parent_pos;
+			vec3 l = normalize(g_CameraPos.xyz - pos);
+			float l_dot_o_minus_c = dot(l, o_minus_c);
+			float r = ActiveDistance(level - 1);
+			float temp = l_dot_o_minus_c * l_dot_o_minus_c - dot(o_minus_c, o_minus_c) + r * r;
+
+			// outside the parent's sphere while a merge is deferred, t is 0 there
+			float t = 0.0;
+			if (temp > 0.0) {
+				float d = -l_dot_o_minus_c + sqrt(temp);
+				t = clamp((d - dist) / (d - active_distance), 0.0, 1.0);
+			}
+			pos = mix(parent_pos, pos, t);
+		}
+	}
+
+	vec4 v4 = vec4(pos, 1.0);
+	gl_Position = g_ModelViewProjectionMatrix * v4;
+	vs_out_pos_view = (g_ModelViewMatrix * v4).xyz;
+	vs_out_texcoord = pos.xy / g_MorphInfo.y;
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+#version 430 core
+
+layout (std140, binding = 0) uniform ubModelViewProj
+{
+	mat4	g_ModelViewProjectionMatrix;
+	mat4	g_ModelViewMatrix;
+};
+
+layout (std140, binding = 4) uniform ubQuantization
+{
+	vec4	g_QuantOffset;		// w: height field edge length
+	vec4	g_QuantScale;
+};
+
+// unorm16 over the terrain bounds, already morphed on the CPU
+layout (location = 0) in  vec3 vs_in_pos_normalized;
+layout (location = 0) out vec3 vs_out_pos_view;
+layout (location = 1) out vec2 vs_out_texcoord;
+
+void main() {
+	vec3 pos = g_QuantOffset.xyz + g_QuantScale.xyz * vs_in_pos_normalized;
+
+	vec4 v4 = vec4(pos, 1.0);
+	gl_Position = g_ModelViewProjectionMatrix * v4;
+	vs_out_pos_view = (g_ModelViewMatrix * v4).xyz;
+	vs_out_texcoord = pos.xy / g_QuantOffset.w;
+}
\ No newline at end of file
@@ -0,0 +1,8 @@
+#version 430 core
+
+layout (location = 0) in  vec2 vs_in_pos_local;
+layout (location = 0) out vec2 vs_out_pos_local;
+
+void main() {
+	vs_out_pos_local = vs_in_pos_local;
+}
@@ -11,6 +11,11 @@ layout (location = 0) in  vec2	vs_out_texcoord;
 layout (location = 0) out vec4	ps_out_color;
 
 void main() {
+	if (vs_out_texcoord.s < 0.0) { // solid quad
+		ps_out_color = vec4(g_FontColor.rgb, 0.75);
+		return;
+	}
+
 	vec4	tex_color = texture(g_Tex, vs_out_texcoord);
 	ps_out_color = g_FontColor * tex_color;
 	ps_out_color.a = tex_color.r;
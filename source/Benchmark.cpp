@@ -0,0 +1,237 @@
+/*
+headless render benchmark
+*/
+
+#include "Precompiled.h"
+#include <algorithm>
+
+static const float BENCHMARK_FRAME_TIME = 1.0f / 60.0f;
+
+static float Percentile(const float *values, int count, float percentile) {
+	if (count <= 0) {
+		return 0.0f;
+	}
+
+	float * sorted = (float*)malloc(sizeof(float) * count);
+	memcpy(sorted, values, sizeof(float) * count);
+	std::sort(sorted, sorted + count);
+
+	int index = glm::clamp((int)ceilf(percentile * count) - 1, 0, count - 1);
+	float v = sorted[index];
+
+	free(sorted);
+	return v;
+}
+
+static float Average(const float *values, int count) {
+	double sum = 0.0;
+	for (int i = 0; i < count; ++i) {
+		sum += values[i];
+	}
+	return count > 0 ? (float)(sum / count) : 0.0f;
+}
+
+Benchmark::Benchmark():
+	mCenter(0.0f),
+	mPitch(0.0f)
+{
+}
+
+Benchmark::~Benchmark() {
+}
+
+bool Benchmark::Init(const config_s &cfg, const benchmark_s &opts) {
+	mOpts = opts;
+	mOpts.mFrames = max(1, mOpts.mFrames);
+	mCenter = cfg.mCameraPos;
+	mPitch = cfg.mCameraPitch;
+
+	if (mOpts.mPathFile && !LoadPath(mOpts.mPathFile)) {
+		printf("could not load camera path \"%s\"\n", mOpts.mPathFile);
+		return false;
+	}
+
+	return true;
+}
+
+int Benchmark::Run(DemoApp &app, const Offscreen &offscreen, uint32_t draw_flags) {
+	int frames = mOpts.mFrames;
+	float * submit_ms = (float*)malloc(sizeof(float) * frames);
+	float * frame_ms = (float*)malloc(sizeof(float) * frames);
+	float * lod_ms = (float*)malloc(sizeof(float) * frames);
+	double phase_ms[PP_COUNT] = { 0.0 };
+	double triangles = 0.0;
+	double uniform_calls = 0.0;
+	double upload_bytes = 0.0;
+	double upload_chunks = 0.0;
+	double drawn_chunks = 0.0;
+	double occluded_quads = 0.0;
+	double occluder_triangles = 0.0;
+	double pvs_culled_quads = 0.0;
+	int idle_frames = 0;
+
+	image32_s image;
+	char filename[MAX_PATH];
+
+	frame_pacing_t pacing = mOpts.mPacing == FP_VSYNC ? FP_FIXED : mOpts.mPacing;
+	FrameScheduler scheduler;
+	scheduler.Init(pacing, mOpts.mFrameRate, 1.0f / BENCHMARK_FRAME_TIME);
+
+	printf("benchmark: %d frames, %s pacing%s\n", frames, FramePacing_GetName(pacing),
+		(mOpts.mHashFrames || mOpts.mDumpDir) ? ", frame readback enabled (timing includes GPU sync)" : "");
+
+	double start = Sys_GetRelativeTime();
+	double prior = start;
+
+	for (int i = 0; i < frames; ++i) {
+		scheduler.WaitForFrame();
+		scheduler.BeginFrame(); // the path advances one key per frame, ticks are not used
+
+		vec3 pos, prior_pos;
+		float yaw, pitch, prior_yaw, prior_pitch;
+		GetPose(i, pos, yaw, pitch);
+		GetPose(glm::max(i - 1, 0), prior_pos, prior_yaw, prior_pitch);
+
+		// the pose is set directly, there is no input to simulate
+		app.SetCameraPose(pos, (pos - prior_pos) / BENCHMARK_FRAME_TIME, yaw, pitch);
+
+		double t0 = Sys_GetRelativeTime();
+		if (!app.UpdateFrame()) {
+			idle_frames++;
+		}
+		app.UpdateScreen(draw_flags);
+		double t1 = Sys_GetRelativeTime();
+
+		submit_ms[i] = (float)((t1 - t0) * 1000.0);
+
+		if (mOpts.mHashFrames || mOpts.mDumpDir) {
+			offscreen.ReadPixels(image);
+
+			if (mOpts.mHashFrames) {
+				uint64_t h = HashFNV1a(image.mData, (size_t)image.mWidth * image.mHeight * 4);
+				printf("frame %4d: %016llx\n", i, (unsigned long long)h);
+			}
+
+			if (mOpts.mDumpDir) {
+				sprintf_(filename, "%s" PATH_SEPERATOR "frame_%04d.bmp", mOpts.mDumpDir, i);
+				if (!File_SaveBMP(filename, image)) {
+					printf("could not write \"%s\"\n", filename);
+				}
+			}
+		}
+
+		const PerfStats & perf_stats = app.GetPerfStats();
+		for (int p = 0; p < PP_COUNT; ++p) {
+			phase_ms[p] += perf_stats.GetPhaseTime((perf_phase_t)p);
+		}
+		lod_ms[i] = perf_stats.GetPhaseTime(PP_LOD_UPDATE);
+		triangles += app.GetDrawTriangleCount();
+		uniform_calls += perf_stats.GetUniformCalls();
+		upload_bytes += (double)perf_stats.GetUploadBytes();
+		upload_chunks += perf_stats.GetUploadChunks();
+		drawn_chunks += perf_stats.GetDrawnChunks();
+		occluded_quads += perf_stats.GetLodStats().mOccludedQuads;
+		occluder_triangles += perf_stats.GetLodStats().mOccluderTriangles;
+		pvs_culled_quads += perf_stats.GetLodStats().mPvsCulledQuads;
+
+		double t2 = Sys_GetRelativeTime();
+		frame_ms[i] = (float)((t2 - prior) * 1000.0);
+		prior = t2;
+	}
+
+	// drain frames still in flight
+	glFinish();
+	double total = Sys_GetRelativeTime() - start;
+	frame_pacing_stats_s pacing_stats = scheduler.GetTotalStats();
+
+	printf("---------- benchmark result ----------\n");
+	printf("frames: %d, total: %.3f s, %.1f fps\n", frames, total, frames / total);
+	printf("cpu submit: avg %.3f ms, p50 %.3f ms, p99 %.3f ms\n",
+		Average(submit_ms, frames), Percentile(submit_ms, frames, 0.5f), Percentile(submit_ms, frames, 0.99f));
+	printf("frame time: avg %.3f ms, p50 %.3f ms, p99 %.3f ms\n",
+		Average(frame_ms, frames), Percentile(frame_ms, frames, 0.5f), Percentile(frame_ms, frames, 0.99f));
+	printf("lod update: %.3f ms, upload: %.3f ms, draw submit: %.3f ms, fence wait: %.3f ms (avg)\n",
+		phase_ms[PP_LOD_UPDATE] / frames, phase_ms[PP_UPLOAD] / frames,
+		phase_ms[PP_DRAW_SUBMIT] / frames, phase_ms[PP_FENCE_WAIT] / frames);
+	printf("lod update: p99 %.3f ms, max %.3f ms\n", Percentile(lod_ms, frames, 0.99f), Percentile(lod_ms, frames, 1.0f));
+	printf("triangles: %.0f, uniform GL calls: %.1f, terrain upload: %.1f KB (avg)\n",
+		triangles / frames, uniform_calls / frames, upload_bytes / frames / 1024.0);
+	if (app.GetPerfStats().GetChunkCount()) {
+		printf("terrain chunks: %.1f uploaded, %.1f drawn of %d (avg)\n",
+			upload_chunks / frames, drawn_chunks / frames, app.GetPerfStats().GetChunkCount());
+	}
+	if (occluder_triangles > 0.0) {
+		printf("occlusion: %.0f quads culled, %.0f occluder triangles rasterized (avg)\n",
+			occluded_quads / frames, occluder_triangles / frames);
+	}
+	if (pvs_culled_quads > 0.0) {
+		printf("visibility: %.0f quad nodes culled (avg)\n", pvs_culled_quads / frames);
+	}
+	printf("idle frames: %d (LOD update and upload skipped)\n", idle_frames);
+	printf("pacing: %s, %.1f fps, cpu: %.1f%%, jitter: %.3f ms rms, %.3f ms max\n", FramePacing_GetName(pacing),
+		pacing_stats.mFrameRate, pacing_stats.mCpuUtilization * 100.0f, pacing_stats.mJitter, pacing_stats.mMaxJitter);
+
+	free(lod_ms);
+	free(frame_ms);
+	free(submit_ms);
+
+	return 0;
+}
+
+bool Benchmark::LoadPath(const char *filename) {
+	int size = File_GetSize(filename);
+	if (size <= 0) {
+		return false;
+	}
+
+	char * text = (char*)malloc(size + 1);
+	int len = File_LoadText(filename, text, size + 1);
+	text[max(0, len)] = 0;
+
+	mKeyFrames.Reset();
+
+	const char * line = text;
+	while (*line) {
+		key_frame_s kf;
+		if (sscanf(line, "%f %f %f %f %f", &kf.mPos.x, &kf.mPos.y, &kf.mPos.z, &kf.mYaw, &kf.mPitch) == 5) {
+			mKeyFrames.Add(kf);
+		}
+
+		const char * next = strchr(line, '\n');
+		if (!next) {
+			break;
+		}
+		line = next + 1;
+	}
+
+	free(text);
+
+	return mKeyFrames.GetCount() > 0;
+}
+
+void Benchmark::GetPose(int frame, vec3 &pos, float &yaw, float &pitch) const {
+	float t = mOpts.mFrames > 1 ? (float)frame / (mOpts.mFrames - 1) : 0.0f;
+
+	int count = mKeyFrames.GetCount();
+	if (count > 0) {
+		// piecewise linear through the key frames
+		float f = t * (count - 1);
+		int k = glm::min((int)f, count - 1);
+		int k1 = glm::min(k + 1, count - 1);
+		float s = f - k;
+
+		const key_frame_s & a = mKeyFrames.GetItems()[k];
+		const key_frame_s & b = mKeyFrames.GetItems()[k1];
+
+		pos = mix(a.mPos, b.mPos, s);
+		yaw = mix(a.mYaw, b.mYaw, s);
+		pitch = mix(a.mPitch, b.mPitch, s);
+	}
+	else {
+		// one orbit around the configured camera position, looking along the path
+		float angle = t * 2.0f * PI;
+		pos = mCenter + vec3(cosf(angle), sinf(angle), 0.0f) * mOpts.mOrbitRadius;
+		yaw = t * 360.0f;
+		pitch = mPitch;
+	}
+}
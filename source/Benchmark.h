@@ -0,0 +1,51 @@
+/*
+headless render benchmark
+*/
+
+#pragma once
+
+struct benchmark_s {
+	int							mFrames;
+	const char *				mPathFile;		// keyframes "x y z yaw pitch" per line, nullptr: orbit
+	float						mOrbitRadius;
+	bool						mHashFrames;	// print a hash of every rendered frame
+	const char *				mDumpDir;		// save every frame as BMP, nullptr: no dump
+	frame_pacing_t				mPacing;		// no swap chain offscreen, v-sync runs as fixed
+	float						mFrameRate;
+
+	benchmark_s() {
+		mFrames = 600;
+		mPathFile = nullptr;
+		mOrbitRadius = 256.0f;
+		mHashFrames = false;
+		mDumpDir = nullptr;
+		mPacing = FP_UNCAPPED;
+		mFrameRate = 60.0f;
+	}
+};
+
+// replays a camera path through the full render path, reports timing
+class Benchmark {
+public:
+	Benchmark();
+	~Benchmark();
+
+	bool						Init(const config_s &cfg, const benchmark_s &opts);
+	int							Run(DemoApp &app, const Offscreen &offscreen, uint32_t draw_flags);
+
+private:
+
+	struct key_frame_s {
+		vec3					mPos;
+		float					mYaw;
+		float					mPitch;
+	};
+
+	benchmark_s					mOpts;
+	vec3						mCenter;
+	float						mPitch;
+	ItemArray<key_frame_s, 64>	mKeyFrames;
+
+	bool						LoadPath(const char *filename);
+	void						GetPose(int frame, vec3 &pos, float &yaw, float &pitch) const;
+};
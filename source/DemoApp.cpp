@@ -9,7 +9,17 @@ DemoApp::DemoApp():
 	mTerrain(nullptr),
 	mYaw(0.0f),
 	mPitch(0.0f),
-	mMoveSpeed(10.0f)
+	mMoveSpeed(10.0f),
+	mTerrainBackend(TB_QUAD_COLLAPSE),
+	mSkipIdleFrames(false),
+	mFrameDirty(true),
+	mPriorPos(0.0f),
+	mPriorYaw(0.0f),
+	mPriorPitch(0.0f),
+	mTerrainReady(false),
+	mRendererTime(0.0),
+	mTerrainWait(0.0),
+	mFirstFrame(true)
 {
 }
 
@@ -17,20 +27,50 @@ DemoApp::~DemoApp() {
 	Shutdown();
 }
 
-bool DemoApp::Init(const config_s &cfg) {
-	mRenderer = NEW__ Renderer();
+void DemoApp::StartInit(const config_s &cfg) {
+	mTerrainConfig = cfg;
+	mTerrainReady = false;
 	mTerrain = NEW__ Terrain();
 
+	Sys_StartTask(mTerrainTask, InitTerrainProc, this);
+}
+
+void DemoApp::InitTerrainProc(void *context) {
+	DemoApp * app = (DemoApp*)context;
+	app->mTerrainReady = app->mTerrain->Init(app->mTerrainConfig);
+}
+
+bool DemoApp::Init(const config_s &cfg) {
+	if (!mTerrain) {
+		StartInit(cfg);
+	}
+
+	// programs and textures while the terrain is built, then the terrain goes to the GPU
+	double t1 = Sys_GetRelativeTime();
+
+	mRenderer = NEW__ Renderer();
 	if (!mRenderer->Init(cfg)) {
 		printf("init renderer error\n");
 		return false;
 	}
 
-	if (!mTerrain->Init(cfg)) {
+	mRendererTime = Sys_GetRelativeTime() - t1;
+	mTerrainWait = Sys_WaitTask(mTerrainTask);
+
+	if (!mTerrainReady) {
 		return false;
 	}
 
 	mRenderer->SetHeightFieldSize(mTerrain->GetSize()); // edge length
+	mRenderer->SetHeightField(mTerrain->GetVertices(), mTerrain->GetWidth(), mTerrain->GetHeight());
+	mRenderer->SetTerrainLodLevels(mTerrain->GetActiveDistances(), mTerrain->GetMaxLevel());
+	mRenderer->SetTerrainQuantization(mTerrain->GetQuantization());
+
+	// chunks culled on the GPU, the mesh no longer depends on the view direction
+	mTerrain->SetFrustumCulling(!mRenderer->IsTerrainGpuCulling());
+	mTerrainBackend = cfg.mTerrainBackend;
+	mSkipIdleFrames = cfg.mSkipIdleFrames;
+	mFrameDirty = true;
 	
 	mCamera.mPos = cfg.mCameraPos;
 	mCamera.mTarget = mCamera.mPos + START_FORWARD;
@@ -48,6 +88,8 @@ bool DemoApp::Init(const config_s &cfg) {
 }
 
 void DemoApp::Shutdown() {
+	Sys_WaitTask(mTerrainTask);
+
 	if (mTerrain) {
 		delete mTerrain;
 		mTerrain = nullptr;
@@ -82,53 +124,138 @@ void DemoApp::UpdateCameraOrientation() {
 
 void DemoApp::ResizeViewport(int width, int height) {
 	mRenderer->ResizeViewport(width, height);
+	mFrameDirty = true;
+}
+
+void DemoApp::Invalidate() {
+	mFrameDirty = true;
+}
+
+bool DemoApp::ProcessInput(float frame_time, const input_s &input) {
+	Simulate(frame_time, input);
+	return UpdateFrame();
 }
 
-void DemoApp::ProcessInput(float frame_time, const input_s &input) {
+void DemoApp::Simulate(float tick_time, const input_s &input) {
 	mYaw += input.mMouseDeltaX * -0.1f;
 	mPitch += input.mMouseDeltaY * -0.1f;
 
 	UpdateCameraOrientation();
 	
 	// check movement
+	vec3 velocity(0.0f);
 	if (input.mMovementKey == MK_FORWARD) {
-		mCamera.mPos += mCameraForward * mMoveSpeed * frame_time;
+		velocity = mCameraForward * mMoveSpeed;
 	}
 	else if (input.mMovementKey == MK_BACKWARD) {
-		mCamera.mPos -= mCameraForward * mMoveSpeed * frame_time;
+		velocity = -mCameraForward * mMoveSpeed;
 	}
 	else if (input.mMovementKey == MK_LEFT) {
-		mCamera.mPos -= mCameraRight * mMoveSpeed * frame_time;
+		velocity = -mCameraRight * mMoveSpeed;
 	}
 	else if (input.mMovementKey == MK_RIGHT) {
-		mCamera.mPos += mCameraRight * mMoveSpeed * frame_time;
+		velocity = mCameraRight * mMoveSpeed;
 	}
 	else if (input.mMovementKey == MK_STRAIGHT_UP) {
-		mCamera.mPos += START_UP * mMoveSpeed * frame_time;
+		velocity = START_UP * mMoveSpeed;
 	}
 	else if (input.mMovementKey == MK_STRAIGHT_DOWN) {
-		mCamera.mPos -= START_UP * mMoveSpeed * frame_time;
+		velocity = -START_UP * mMoveSpeed;
 	}
 
+	mCamera.mPos += velocity * tick_time;
+	mCamera.mVelocity = velocity;
+
 	mCamera.mTarget = mCamera.mPos + mCameraForward;
+}
+
+bool DemoApp::UpdateFrame() {
+	// nothing changed since the last update, the terrain mesh on the GPU is still valid
+	bool changed = mFrameDirty || mCamera.mPos != mPriorPos || mYaw != mPriorYaw || mPitch != mPriorPitch
+		|| (mTerrainBackend == TB_QUAD_COLLAPSE && mTerrain->IsRefinePending()); // still converging
+	if (mSkipIdleFrames && !changed) {
+		mPerfStats.SetChunkStats(0, mRenderer->GetTerrainDrawnChunkCount(), mRenderer->GetTerrainChunkCount());
+		return false;
+	}
+
+	mFrameDirty = false;
+	mPriorPos = mCamera.mPos;
+	mPriorYaw = mYaw;
+	mPriorPitch = mPitch;
 
 	int view_width, view_height;
 	mRenderer->GetViewport(view_width, view_height);
 	mFrumstumPlane.Setup(view_width, view_height, mCamera);
 
-	// update terrain
-	mTerrain->Update(mCamera, mFrumstumPlane);
+	// the mesh of an older frame may still be read by the GPU
+	mPerfStats.BeginPhase(PP_FENCE_WAIT);
+	mRenderer->BeginFrame();
+	mPerfStats.EndPhase(PP_FENCE_WAIT);
+
+	// update terrain, the tessellation backend refines on the GPU
+	if (mTerrainBackend == TB_QUAD_COLLAPSE) {
+		mPerfStats.BeginPhase(PP_LOD_UPDATE);
+		mTerrain->Update(mCamera, mFrumstumPlane, mRenderer->GetTerrainMeshSink());
+		mPerfStats.EndPhase(PP_LOD_UPDATE);
+
+		const triangle_mesh_s & tm = mTerrain->GetMesh();
+
+		mPerfStats.BeginPhase(PP_UPLOAD);
+		mRenderer->UpdateTerrainMesh(tm);
+		mPerfStats.EndPhase(PP_UPLOAD);
+
+		mPerfStats.AddUploadBytes(mRenderer->GetTerrainUploadBytes());
+		mPerfStats.SetChunkStats(mRenderer->GetTerrainUploadChunkCount(), mRenderer->GetTerrainDrawnChunkCount(), mRenderer->GetTerrainChunkCount());
+		mPerfStats.SetLodStats(mTerrain->GetStats());
+	}
 
-	const triangle_mesh_s & tm = mTerrain->GetMesh();
-	mRenderer->UpdateTerrainMesh(tm);
-	mRenderer->Printf("draw triangle count: %d, camera pos: %d, %d, %d, move speed: %f\n", tm.mNumTriangles,
+	mPerfStats.SetLodMemory(mTerrain->GetMemoryUsage());
+	mRenderer->Printf("draw triangle count: %d, camera pos: %d, %d, %d, move speed: %f\n", GetDrawTriangleCount(),
 		(int)mCamera.mPos.x, (int)mCamera.mPos.y, (int)mCamera.mPos.z, mMoveSpeed);
+
+	return true;
 }
 
 void DemoApp::SetMoveSpeed(float move_speed) {
 	mMoveSpeed = move_speed;
+	mFrameDirty = true;	// shown in the status text
 }
 
 void DemoApp::UpdateScreen(uint32_t draw_flags) {
-	mRenderer->Draw(mCamera, draw_flags);
+	mPerfStats.BeginPhase(PP_DRAW_SUBMIT);
+	mRenderer->Draw(mCamera, draw_flags, mPerfStats);
+	mPerfStats.EndPhase(PP_DRAW_SUBMIT);
+
+	mPerfStats.SetUniformCalls(mRenderer->GetUniformCallCount());
+
+	mPerfStats.EndFrame();
+
+	if (mFirstFrame) {
+		mFirstFrame = false;
+		printf("startup: first frame at %.1f ms, terrain %.1f ms on a task thread, renderer %.1f ms, %.1f ms waited for the terrain\n",
+			Sys_GetRelativeTime() * 1000.0, (mTerrainTask.mEndTime - mTerrainTask.mStartTime) * 1000.0,
+			mRendererTime * 1000.0, mTerrainWait * 1000.0);
+	}
+}
+
+void DemoApp::SetPacingStats(frame_pacing_t pacing, const frame_pacing_stats_s &pacing_stats) {
+	mPerfStats.SetPacingStats(pacing, pacing_stats);
+}
+
+void DemoApp::SetCameraPose(const vec3 &pos, const vec3 &velocity, float yaw, float pitch) {
+	mCamera.mPos = pos;
+	mCamera.mVelocity = velocity;
+	mYaw = yaw;
+	mPitch = pitch;
+
+	UpdateCameraOrientation();
+	mCamera.mTarget = mCamera.mPos + mCameraForward;
+}
+
+int DemoApp::GetDrawTriangleCount() const {
+	return mRenderer->GetTerrainTriangleCount();
+}
+
+const PerfStats & DemoApp::GetPerfStats() const {
+	return mPerfStats;
 }
@@ -10,14 +10,23 @@ public:
 	DemoApp();
 	~DemoApp();
 
-	bool						Init(const config_s &cfg);
+	void						StartInit(const config_s &cfg);	// loads and builds the terrain on a task thread, no GL context needed
+	bool						Init(const config_s &cfg);	// GL side, then waits for StartInit
 	void						Shutdown();
 
 	void						ResizeViewport(int width, int height);
-	void						ProcessInput(float frame_time, const input_s &input);
+	bool						ProcessInput(float frame_time, const input_s &input); // Simulate and UpdateFrame
+	void						Simulate(float tick_time, const input_s &input);	// move the camera
+	bool						UpdateFrame();	// level of detail and upload, false if the frame is unchanged
+	void						Invalidate();	// terrain edited, force the next frame to update
 	void						SetMoveSpeed(float move_speed);
 	void						UpdateScreen(uint32_t draw_flags);
 
+	void						SetCameraPose(const vec3 &pos, const vec3 &velocity, float yaw, float pitch);
+	void						SetPacingStats(frame_pacing_t pacing, const frame_pacing_stats_s &pacing_stats);
+	int							GetDrawTriangleCount() const;
+	const PerfStats &			GetPerfStats() const;
+
 private:
 
 	camera_s					mCamera;
@@ -25,6 +34,14 @@ private:
 	float						mYaw;
 	float						mPitch;
 	float						mMoveSpeed;
+	terrain_backend_t			mTerrainBackend;
+	bool						mSkipIdleFrames;
+
+	// state of the last updated frame
+	bool						mFrameDirty;
+	vec3						mPriorPos;
+	float						mPriorYaw;
+	float						mPriorPitch;
 
 	vec3						mCameraForward;
 	vec3						mCameraRight;
@@ -33,5 +50,16 @@ private:
 	Renderer *					mRenderer;
 	Terrain	*					mTerrain;
 
+	// startup
+	config_s					mTerrainConfig;
+	sys_task_s					mTerrainTask;
+	bool						mTerrainReady;
+	double						mRendererTime;	// seconds
+	double						mTerrainWait;
+	bool						mFirstFrame;
+
+	PerfStats					mPerfStats;
+
 	void						UpdateCameraOrientation();
+	static void					InitTerrainProc(void *context);
 };
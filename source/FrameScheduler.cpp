@@ -0,0 +1,162 @@
+/*
+frame pacing and simulation tick
+*/
+
+#include "Precompiled.h"
+
+static const double STATS_WINDOW = 1.0; // seconds
+
+const char * FramePacing_GetName(frame_pacing_t pacing) {
+	switch (pacing) {
+	case FP_VSYNC: return "vsync";
+	case FP_FIXED: return "fixed";
+	default: return "uncapped";
+	}
+}
+
+frame_pacing_t FramePacing_FromName(const char *name) {
+	if (!strcmp(name, "vsync")) {
+		return FP_VSYNC;
+	}
+
+	if (!strcmp(name, "uncapped")) {
+		return FP_UNCAPPED;
+	}
+
+	return FP_FIXED;
+}
+
+void FrameScheduler::pacing_window_s::Reset(double wall, double cpu) {
+	mWallStart = wall;
+	mCpuStart = cpu;
+	mCount = 0;
+	mSum = 0.0;
+	mSumSq = 0.0;
+	mMin = DBL_MAX;
+	mMax = 0.0;
+}
+
+void FrameScheduler::pacing_window_s::Add(double interval) {
+	mCount++;
+	mSum += interval;
+	mSumSq += interval * interval;
+	mMin = glm::min(mMin, interval);
+	mMax = glm::max(mMax, interval);
+}
+
+FrameScheduler::FrameScheduler():
+	mPacing(FP_FIXED),
+	mFrameTime(1.0 / 60.0),
+	mTickTime(1.0 / 60.0),
+	mDeadline(0.0),
+	mPriorFrameStart(-1.0),
+	mTickAccum(0.0)
+{
+	mWindow.Reset(0.0, 0.0);
+	mTotal.Reset(0.0, 0.0);
+}
+
+FrameScheduler::~FrameScheduler() {
+}
+
+void FrameScheduler::Init(frame_pacing_t pacing, float frame_rate, float tick_rate) {
+	mPacing = pacing;
+	mTickTime = 1.0 / glm::max(tick_rate, 1.0f);
+
+	// v-sync is paced by the display, the rate is only the jitter target
+	mFrameTime = pacing == FP_UNCAPPED ? 0.0 : 1.0 / glm::max(frame_rate, 1.0f);
+
+	double wall = Sys_GetRelativeTime();
+	double cpu = Sys_GetProcessTime();
+	mWindow.Reset(wall, cpu);
+	mTotal.Reset(wall, cpu);
+	mStats = frame_pacing_stats_s();
+
+	Reset();
+}
+
+void FrameScheduler::Reset() {
+	mDeadline = Sys_GetRelativeTime();
+	mPriorFrameStart = -1.0;
+	mTickAccum = mTickTime; // one tick on the next frame
+}
+
+void FrameScheduler::WaitForFrame() {
+	if (mPacing != FP_FIXED) {
+		return;
+	}
+
+	double t = Sys_GetRelativeTime();
+	if (t > mDeadline + mFrameTime) {
+		mDeadline = t; // fell behind, do not rush frames to catch up
+	}
+
+	Sys_SleepUntil(mDeadline);
+	mDeadline += mFrameTime;
+}
+
+int FrameScheduler::BeginFrame() {
+	double t = Sys_GetRelativeTime();
+
+	if (mPriorFrameStart >= 0.0) {
+		double interval = t - mPriorFrameStart;
+		mTickAccum += interval;
+		mWindow.Add(interval);
+		mTotal.Add(interval);
+	}
+	mPriorFrameStart = t;
+
+	if (t - mWindow.mWallStart >= STATS_WINDOW) {
+		double cpu = Sys_GetProcessTime();
+		mStats = ComputeStats(mWindow, t, cpu);
+		mWindow.Reset(t, cpu);
+	}
+
+	int ticks = (int)(mTickAccum / mTickTime);
+	mTickAccum -= ticks * mTickTime;
+
+	if (ticks > MAX_TICKS_PER_FRAME) {
+		ticks = MAX_TICKS_PER_FRAME;
+	}
+
+	return ticks;
+}
+
+frame_pacing_t FrameScheduler::GetPacing() const {
+	return mPacing;
+}
+
+float FrameScheduler::GetTickTime() const {
+	return (float)mTickTime;
+}
+
+const frame_pacing_stats_s & FrameScheduler::GetStats() const {
+	return mStats;
+}
+
+frame_pacing_stats_s FrameScheduler::GetTotalStats() const {
+	return ComputeStats(mTotal, Sys_GetRelativeTime(), Sys_GetProcessTime());
+}
+
+frame_pacing_stats_s FrameScheduler::ComputeStats(const pacing_window_s &w, double wall, double cpu) const {
+	frame_pacing_stats_s stats;
+
+	double elapsed = wall - w.mWallStart;
+	if (elapsed > 0.0) {
+		stats.mCpuUtilization = (float)((cpu - w.mCpuStart) / elapsed);
+	}
+
+	if (w.mCount) {
+		double mean = w.mSum / w.mCount;
+		double target = mFrameTime > 0.0 ? mFrameTime : mean; // uncapped: deviation from the mean
+
+		// sum of (interval - target)^2 from the running sums
+		double var = w.mSumSq / w.mCount - 2.0 * target * mean + target * target;
+
+		stats.mFrameRate = (float)(1.0 / mean);
+		stats.mJitter = (float)(sqrt(glm::max(var, 0.0)) * 1000.0);
+		stats.mMaxJitter = (float)(glm::max(w.mMax - target, target - w.mMin) * 1000.0);
+	}
+
+	return stats;
+}
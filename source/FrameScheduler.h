@@ -0,0 +1,70 @@
+/*
+frame pacing and simulation tick
+*/
+
+#pragma once
+
+#define	MAX_TICKS_PER_FRAME		8		// simulation catch-up limit after a hitch
+
+struct frame_pacing_stats_s {
+	float						mFrameRate;		// frames per second
+	float						mCpuUtilization;	// process CPU time / wall time, 1.0 is one core
+	float						mJitter;		// RMS deviation of the frame interval from the target, ms
+	float						mMaxJitter;		// ms
+
+	frame_pacing_stats_s() {
+		mFrameRate = 0.0f;
+		mCpuUtilization = 0.0f;
+		mJitter = 0.0f;
+		mMaxJitter = 0.0f;
+	}
+};
+
+const char *	FramePacing_GetName(frame_pacing_t pacing);
+frame_pacing_t	FramePacing_FromName(const char *name);	// fixed if unknown
+
+// waits for frame deadlines and hands out fixed simulation ticks
+class FrameScheduler {
+public:
+
+	FrameScheduler();
+	~FrameScheduler();
+
+	void						Init(frame_pacing_t pacing, float frame_rate, float tick_rate);
+	void						Reset();		// resume after a sleep, no catch-up
+	void						WaitForFrame();	// blocks until the deadline, fixed pacing only
+	int							BeginFrame();	// simulation ticks due since the prior frame
+
+	frame_pacing_t				GetPacing() const;
+	float						GetTickTime() const;	// seconds
+	const frame_pacing_stats_s &GetStats() const;		// last full second
+	frame_pacing_stats_s		GetTotalStats() const;	// since Init
+
+private:
+
+	struct pacing_window_s {
+		double					mWallStart;
+		double					mCpuStart;
+		int						mCount;
+		double					mSum;		// frame intervals, seconds
+		double					mSumSq;
+		double					mMin;
+		double					mMax;
+
+		void					Reset(double wall, double cpu);
+		void					Add(double interval);
+	};
+
+	frame_pacing_t				mPacing;
+	double						mFrameTime;		// target interval, 0: uncapped
+	double						mTickTime;
+	double						mDeadline;
+	double						mPriorFrameStart;	// < 0: skip the next interval
+	double						mTickAccum;
+
+	pacing_window_s				mWindow;
+	pacing_window_s				mTotal;
+	frame_pacing_stats_s		mStats;
+
+	frame_pacing_stats_s		ComputeStats(const pacing_window_s &w, double wall, double cpu) const;
+};
@@ -33,7 +33,8 @@ struct mouse_state_s {
 };
 
 struct frame_s {
-	double						mPriorTime;
+	bool						mIdleRunning;	// OnIdle registered
+	bool						mRedrawIdle;
 };
 
 static window_state_s			gWindowState;
@@ -43,6 +44,37 @@ static DemoApp					gDemoApp;
 static input_s					gInput;
 static uint32_t					gDrawFlags;
 static float					gMoveSpeed;
+static FrameScheduler			gScheduler;
+
+static void OnIdle();
+
+// resume the frame loop after it went to sleep on an idle frame
+static void WakeUp() {
+	if (!gFrame.mIdleRunning) {
+		gFrame.mIdleRunning = true;
+		gScheduler.Reset(); // do not move the camera by the sleep time
+		glutIdleFunc(OnIdle);
+	}
+}
+
+static void SetSwapInterval(int interval) {
+#if defined(_WIN32)
+	if (wglSwapIntervalEXT) {
+		wglSwapIntervalEXT(interval);
+	}
+#endif
+
+#if defined(__linux__)
+	typedef int (*swap_interval_proc_t)(int);
+	swap_interval_proc_t swap_interval = (swap_interval_proc_t)glutGetProcAddress("glXSwapIntervalMESA");
+	if (!swap_interval) {
+		swap_interval = (swap_interval_proc_t)glutGetProcAddress("glXSwapIntervalSGI");
+	}
+	if (swap_interval) {
+		swap_interval(interval);
+	}
+#endif
+}
 
 // GLUT callback
 static void OnReshape(int width, int height) {
@@ -56,9 +88,12 @@ static void OnReshape(int width, int height) {
 	}
 
 	gDemoApp.ResizeViewport(gWindowState.mViewportWidth, gWindowState.mViewportHeight);
+	WakeUp();
 }
 
 static void OnMouse(int button, int state, int x, int y) {
+	WakeUp();
+
 	if (button == GLUT_LEFT_BUTTON) {
 		if (GLUT_DOWN == state) {
 			gMouseState.mLeftButtonDown = true;
@@ -77,10 +112,13 @@ static void OnMouse(int button, int state, int x, int y) {
 }
 
 static void OnMouseMove(int x, int y) {
+	WakeUp();
+
 	if (gWindowState.mCursorVisible) {
 		if (gMouseState.mLeftButtonDown) {
-			gInput.mMouseDeltaX = x - gMouseState.mPriorX;
-			gInput.mMouseDeltaY = y - gMouseState.mPriorY;
+			// accumulated until the next simulation tick
+			gInput.mMouseDeltaX += x - gMouseState.mPriorX;
+			gInput.mMouseDeltaY += y - gMouseState.mPriorY;
 
 			gMouseState.mPriorX = x;
 			gMouseState.mPriorY = y;
@@ -113,16 +151,25 @@ static void OnMouseMove(int x, int y) {
 static void OnSpecial(int key, int x, int y) {
 	if (key == GLUT_KEY_F2) {
 		gDrawFlags = ToggleFlags(gDrawFlags, DF_SKYBOX);
+		glutPostRedisplay();
 		return;
 	}
 
 	if (key == GLUT_KEY_F3) {
 		gDrawFlags = ToggleFlags(gDrawFlags, DF_SOLID_TERRAIN);
+		glutPostRedisplay();
 		return;
 	}
 
 	if (key == GLUT_KEY_F4) {
 		gDrawFlags = ToggleFlags(gDrawFlags, DF_WIREFRAME_TERRAIN);
+		glutPostRedisplay();
+		return;
+	}
+
+	if (key == GLUT_KEY_F5) {
+		gDrawFlags = ToggleFlags(gDrawFlags, DF_PERF_HUD);
+		glutPostRedisplay();
 		return;
 	}
 
@@ -132,6 +179,7 @@ static void OnSpecial(int key, int x, int y) {
 			gMoveSpeed = 1024.0f;
 		}
 		gDemoApp.SetMoveSpeed(gMoveSpeed);
+		WakeUp();
 		return;
 	}
 
@@ -141,6 +189,7 @@ static void OnSpecial(int key, int x, int y) {
 			gMoveSpeed = 0.0f;
 		}
 		gDemoApp.SetMoveSpeed(gMoveSpeed);
+		WakeUp();
 		return;
 	}
 }
@@ -194,6 +243,7 @@ static void OnKeyboard(unsigned char key, int x, int y) {
 		const movement_key_s & mk = MOVEMENT_KEYS[i];
 		if (key == mk.mLowerCase || key == mk.mUpperCase) {
 			gInput.mMovementKey = mk.mKeyFlag;
+			WakeUp();
 			return;
 		}
 	}
@@ -204,6 +254,7 @@ static void OnKeyboardUp(unsigned char key, int x, int y) {
 		const movement_key_s & mk = MOVEMENT_KEYS[i];
 		if (key == mk.mLowerCase || key == mk.mUpperCase) {
 			gInput.mMovementKey = MK_NONE;
+			WakeUp();
 			return;
 		}
 	}
@@ -211,38 +262,37 @@ static void OnKeyboardUp(unsigned char key, int x, int y) {
 
 static void OnDisplay() {
 	gDemoApp.UpdateScreen(gDrawFlags);
-
-#if defined(_WIN32)
-	// v-sync
-	if (wglSwapIntervalEXT) {
-		wglSwapIntervalEXT(1);
-	}
-#endif
-
 	glutSwapBuffers();
 }
 
-static const int	FPS = 60;
-static const double FRAME_TIME = 1.0 / FPS;
-
 static void OnIdle() {
-	// run frame
-	double t = Sys_GetRelativeTime();
-	double delta = t - gFrame.mPriorTime;
+	gScheduler.WaitForFrame();
 
-	if (delta >= FRAME_TIME) {
-		gDemoApp.ProcessInput((float)delta, gInput);
+	// fixed rate simulation, independent of the render rate
+	int ticks = gScheduler.BeginFrame();
+	for (int i = 0; i < ticks; ++i) {
+		gDemoApp.Simulate(gScheduler.GetTickTime(), gInput);
 
 		gInput.mMouseDeltaX = 0;
 		gInput.mMouseDeltaY = 0;
+	}
 
+	bool changed = gDemoApp.UpdateFrame();
+	gDemoApp.SetPacingStats(gScheduler.GetPacing(), gScheduler.GetStats());
+
+	if (changed || gFrame.mRedrawIdle) {
 		glutPostRedisplay();
-		gFrame.mPriorTime = t;
+	}
+	else if (gInput.mMovementKey == MK_NONE) {
+		// sleep in the GLUT event loop until the next input event
+		gFrame.mIdleRunning = false;
+		glutIdleFunc(nullptr);
 	}
 }
 
 static void OnClose() {
 	gDemoApp.Shutdown();
+	Sys_ShutdownThreads();
 }
 
 static void ErrorOutput(const char *text) {
@@ -255,6 +305,69 @@ static void ErrorOutput(const char *text) {
 #endif
 }
 
+static int RunHeadless(const config_s &cfg, const benchmark_s &opts) {
+	gDemoApp.StartInit(cfg); // the terrain is built while the context is created
+
+	Offscreen offscreen;
+	if (!offscreen.Init(cfg.mViewWidth, cfg.mViewHeight)) {
+		gDemoApp.Shutdown(); // waits for the terrain task, it reads the config strings
+		return 1;
+	}
+
+	Benchmark benchmark;
+	if (!benchmark.Init(cfg, opts)) {
+		gDemoApp.Shutdown();
+		return 1;
+	}
+
+	if (!gDemoApp.Init(cfg)) {
+		gDemoApp.Shutdown();
+		return 1;
+	}
+
+	gDemoApp.SetMoveSpeed(gMoveSpeed);
+	gDemoApp.ResizeViewport(cfg.mViewWidth, cfg.mViewHeight);
+
+	int r = benchmark.Run(gDemoApp, offscreen, gDrawFlags);
+
+	gDemoApp.Shutdown();
+	offscreen.Shutdown();
+	Sys_ShutdownThreads();
+
+	return r;
+}
+
+static int RunPvsBake(config_s cfg, const char *filename, int level, float clearance) {
+	cfg.mTerrainPvs = ""; // the file is about to be replaced
+
+	Terrain terrain;
+	if (!terrain.Init(cfg)) {
+		return 1;
+	}
+
+	int r = terrain.BakeVisibility(filename, level, clearance) ? 0 : 1;
+
+	terrain.Shutdown();
+	Sys_ShutdownThreads();
+
+	return r;
+}
+
+static int RunHeightConvert(const char *src, const char *dst, height_format_t format) {
+	double t1 = Sys_GetRelativeTime();
+
+	height_field_s hf;
+	bool ok = File_LoadHeightField(src, hf) && File_SaveHeightField(dst, hf, format);
+	if (ok) {
+		printf("height field: %dx%d %s to %s in %.1f ms\n", hf.mWidth, hf.mHeight,
+			HeightFormat_GetName(hf.mFormat), HeightFormat_GetName(format), (Sys_GetRelativeTime() - t1) * 1000.0);
+	}
+
+	Sys_ShutdownThreads();
+
+	return ok ? 0 : 1;
+}
+
 int main(int argc, char **argv) {
 
 #if defined(_WIN32)
@@ -305,21 +418,122 @@ int main(int argc, char **argv) {
 	cfg.mTerrainZScale = config_file.GetAsFloat("TerrainZScale", 1.0f);
 	cfg.mTerrainBase = config_file.GetAsString("TerrainBase", "terrain" PATH_SEPERATOR "gcanyon_color_2k2k.bmp");
 	cfg.mTerrainDetail = config_file.GetAsString("TerrainDetail", "terrain" PATH_SEPERATOR "detail.bmp");
+	cfg.mTerrainPvs = config_file.GetAsString("TerrainPvs", "");
+	cfg.mTextureCache = config_file.GetAsString("TextureCache", "");
+	cfg.mTextureCompression = config_file.GetAsInteger("TextureCompression", 0) != 0;
 	cfg.mBackgroundColor = config_file.GetAsVec3("BackgroundColor", vec3(0.0f));
 	cfg.mWireframeColor = config_file.GetAsVec3("WireframeColor", vec3(0.0f));
 	cfg.mFogColor = config_file.GetAsVec3("FogColor", vec3(0.0f));
 	cfg.mFogDensity = config_file.GetAsFloat("FogDensity", 0.005f);
 	cfg.mFontColor = config_file.GetAsVec3("FontColor", vec3(0.0f));
+	cfg.mPersistentMeshBuffer = config_file.GetAsInteger("PersistentMeshBuffer", 1) != 0;
+	cfg.mMaxFramesInFlight = glm::clamp(config_file.GetAsInteger("MaxFramesInFlight", 2), 0, MAX_FRAMES_IN_FLIGHT);
+	cfg.mPersistentUniformBuffer = config_file.GetAsInteger("PersistentUniformBuffer", 1) != 0;
+	cfg.mTerrainBackend = strcmp(config_file.GetAsString("TerrainBackend", "collapse"), "tessellation") ? TB_QUAD_COLLAPSE : TB_TESSELLATION;
+	cfg.mTessPixelsPerEdge = glm::max(config_file.GetAsFloat("TessPixelsPerEdge", 8.0f), 1.0f);
+	const char * vertex_format = config_file.GetAsString("TerrainVertexFormat", "float3");
+	if (!strcmp(vertex_format, "packed")) {
+		cfg.mTerrainVertexFormat = VF_PACKED_GRID;
+	}
+	else if (!strcmp(vertex_format, "quantized")) {
+		cfg.mTerrainVertexFormat = VF_QUANTIZED;
+	}
+	else {
+		cfg.mTerrainVertexFormat = VF_FLOAT3;
+	}
+	cfg.mTerrainChunkLevel = glm::clamp(config_file.GetAsInteger("TerrainChunkLevel", 0), 0, MAX_CHUNK_LEVEL);
+	cfg.mTerrainGpuCulling = config_file.GetAsInteger("TerrainGpuCulling", 0) != 0;
+	cfg.mTerrainRefineChanges = glm::max(config_file.GetAsInteger("TerrainRefineChanges", 0), 0);
+	cfg.mTerrainRefineTime = glm::max(config_file.GetAsFloat("TerrainRefineTime", 0.0f), 0.0f);
+	cfg.mTerrainPredictHorizon = glm::max(config_file.GetAsFloat("TerrainPredictHorizon", 0.0f), 0.0f);
+	cfg.mTerrainMaxError = glm::max(config_file.GetAsFloat("TerrainMaxError", 0.0f), 0.0f);
+	cfg.mTerrainOcclusionWidth = glm::clamp(config_file.GetAsInteger("TerrainOcclusionWidth", 0), 0, cfg.mViewWidth);
+	cfg.mWorkerThreads = glm::max(config_file.GetAsInteger("WorkerThreads", 0), 0);
+	cfg.mSkipIdleFrames = config_file.GetAsInteger("SkipIdleFrames", 1) != 0;
+	cfg.mRedrawIdleFrames = config_file.GetAsInteger("RedrawIdleFrames", 0) != 0;
+	cfg.mFramePacing = FramePacing_FromName(config_file.GetAsString("FramePacing", "fixed"));
+	cfg.mFrameRate = glm::max(config_file.GetAsFloat("FrameRate", 60.0f), 1.0f);
+	cfg.mTickRate = glm::max(config_file.GetAsFloat("TickRate", 60.0f), 1.0f);
 	gMoveSpeed = config_file.GetAsFloat("MoveSpeed", 10.0f);
 
+	Sys_InitThreads(cfg.mWorkerThreads);
+
 	int draw_skybox = config_file.GetAsInteger("DrawSkyBox", 0);
 	int draw_solid_terrain = config_file.GetAsInteger("DrawSolidTerrain", 0);
 	int draw_wireframe_terrain = config_file.GetAsInteger("DrawWireframeTerrain", 0);
+	int draw_perf_hud = config_file.GetAsInteger("DrawPerfHud", 0);
 
 	gDrawFlags = 0;
 	if (draw_skybox) gDrawFlags |= DF_SKYBOX;
 	if (draw_solid_terrain) gDrawFlags |= DF_SOLID_TERRAIN;
 	if (draw_wireframe_terrain) gDrawFlags |= DF_WIREFRAME_TERRAIN;
+	if (draw_perf_hud) gDrawFlags |= DF_PERF_HUD;
+
+	// headless benchmark: -headless [-frames N] [-path file] [-hash] [-dump dir] [-pacing fixed|uncapped]
+	// visibility bake: -bakepvs file [-pvslevel N] [-pvsclearance height]
+	// height field conversion: -convertheight src dst [-heightformat unorm16|float32]
+	bool headless = false;
+	const char * pvs_file = nullptr;
+	const char * convert_src = nullptr;
+	const char * convert_dst = nullptr;
+	height_format_t convert_format = HF_UNORM16;
+	int pvs_level = 5;
+	float pvs_clearance = 32.0f;
+	benchmark_s bench_opts;
+	bench_opts.mFrames = config_file.GetAsInteger("BenchmarkFrames", 600);
+	bench_opts.mOrbitRadius = config_file.GetAsFloat("BenchmarkOrbitRadius", 256.0f);
+	bench_opts.mFrameRate = cfg.mFrameRate;
+
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-headless")) {
+			headless = true;
+		}
+		else if (!strcmp(argv[i], "-frames") && i + 1 < argc) {
+			bench_opts.mFrames = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-path") && i + 1 < argc) {
+			bench_opts.mPathFile = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-hash")) {
+			bench_opts.mHashFrames = true;
+		}
+		else if (!strcmp(argv[i], "-dump") && i + 1 < argc) {
+			bench_opts.mDumpDir = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-pacing") && i + 1 < argc) {
+			bench_opts.mPacing = FramePacing_FromName(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-bakepvs") && i + 1 < argc) {
+			pvs_file = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-pvslevel") && i + 1 < argc) {
+			pvs_level = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-pvsclearance") && i + 1 < argc) {
+			pvs_clearance = (float)atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-convertheight") && i + 2 < argc) {
+			convert_src = argv[++i];
+			convert_dst = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-heightformat") && i + 1 < argc) {
+			convert_format = HeightFormat_FromName(argv[++i]);
+		}
+	}
+
+	if (convert_src) {
+		return RunHeightConvert(convert_src, convert_dst, convert_format);
+	}
+
+	if (pvs_file) {
+		return RunPvsBake(cfg, pvs_file, pvs_level, pvs_clearance);
+	}
+
+	if (headless) {
+		return RunHeadless(cfg, bench_opts);
+	}
+
+	gDemoApp.StartInit(cfg); // the terrain is built while the window and the context are created
 
 	glutInit(&argc, argv);
 	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
@@ -332,6 +546,7 @@ int main(int argc, char **argv) {
 	glutCreateWindow("QuadCollapseLOD");
 
 	if (!GL_Init()) {
+		gDemoApp.Shutdown(); // waits for the terrain task, it reads the config strings
 		return 1;
 	}
 	
@@ -361,6 +576,7 @@ int main(int argc, char **argv) {
 		"\"F2\" to toggle draw skybox\n"
 		"\"F3\" to toggle draw solid terrain\n"
 		"\"F4\" to toggle draw wireframe terrain\n"
+		"\"F5\" to toggle performance HUD\n"
 		"\"ALT + ENTER\" to toggle fullscreen mode\n"
 		"\"space\" to hide/show cursor\n"
 		"\"W,S,A,D,Q,Z\" to move around\n"
@@ -370,7 +586,10 @@ int main(int argc, char **argv) {
 
 	printf("%s", HINT);
 
-	gFrame.mPriorTime = Sys_GetRelativeTime();
+	SetSwapInterval(cfg.mFramePacing == FP_VSYNC ? 1 : 0);
+	gScheduler.Init(cfg.mFramePacing, cfg.mFrameRate, cfg.mTickRate);
+	gFrame.mIdleRunning = true;
+	gFrame.mRedrawIdle = cfg.mRedrawIdleFrames;
 
 	// enter main loop
 	glutMainLoop();
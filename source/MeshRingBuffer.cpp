@@ -0,0 +1,155 @@
+/*
+persistently mapped mesh ring buffer
+*/
+
+#include "Precompiled.h"
+
+static const GLbitfield MESH_RING_FLAGS = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+MeshRingBuffer::MeshRingBuffer():
+	mBuffer(0),
+	mMapped(nullptr),
+	mSegmentVertices(0),
+	mVertexSize(0),
+	mCurrentSegment(0),
+	mNumVertices(0),
+	mStallCount(0),
+	mGeneration(0)
+{
+	memset(mFences, 0, sizeof(mFences));
+}
+
+MeshRingBuffer::~MeshRingBuffer() {
+	Destroy();
+}
+
+bool MeshRingBuffer::IsSupported() {
+	return GLEW_ARB_buffer_storage ? true : false;
+}
+
+bool MeshRingBuffer::Init(int segment_vertices, int vertex_size) {
+	return Recreate(segment_vertices, vertex_size);
+}
+
+void * MeshRingBuffer::BeginMesh(int max_vertices, int vertex_size) {
+	if (vertex_size != mVertexSize) {
+		if (!Recreate(max(max_vertices, mSegmentVertices), vertex_size)) {
+			return nullptr;
+		}
+	}
+	else if (max_vertices > mSegmentVertices) {
+		if (!Recreate(max_vertices + (max_vertices >> 1), vertex_size)) {
+			return nullptr;
+		}
+	}
+
+	if (!mMapped) {
+		return nullptr; // Recreate failed, the caller uploads this frame
+	}
+
+	mCurrentSegment = (mCurrentSegment + 1) % MESH_RING_SEGMENTS;
+	mNumVertices = 0;
+
+	// the GPU may still read this segment from an earlier frame
+	WaitSegment(mCurrentSegment);
+
+	return mMapped + (size_t)mVertexSize * mSegmentVertices * mCurrentSegment;
+}
+
+void MeshRingBuffer::EndMesh(int num_vertices) {
+	// coherent mapping, no explicit flush required
+	mNumVertices = num_vertices;
+}
+
+void MeshRingBuffer::Fence() {
+	if (mFences[mCurrentSegment]) {
+		glDeleteSync(mFences[mCurrentSegment]);
+	}
+
+	mFences[mCurrentSegment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+GLuint MeshRingBuffer::GetBuffer() const {
+	return mBuffer;
+}
+
+int MeshRingBuffer::GetGeneration() const {
+	return mGeneration;
+}
+
+int MeshRingBuffer::GetFirstVertex() const {
+	return mSegmentVertices * mCurrentSegment;
+}
+
+int MeshRingBuffer::GetNumVertices() const {
+	return mNumVertices;
+}
+
+int MeshRingBuffer::GetStallCount() const {
+	return mStallCount;
+}
+
+bool MeshRingBuffer::Recreate(int segment_vertices, int vertex_size) {
+	Destroy();
+
+	GLsizeiptr size = (GLsizeiptr)vertex_size * segment_vertices * MESH_RING_SEGMENTS;
+
+	glGenBuffers(1, &mBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, mBuffer);
+	glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, MESH_RING_FLAGS);
+	mMapped = (byte*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, MESH_RING_FLAGS);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	if (!mMapped) {
+		SYS_ERROR("could not map mesh ring buffer\n");
+		Destroy();
+		return false;
+	}
+
+	mSegmentVertices = segment_vertices;
+	mVertexSize = vertex_size;
+	mCurrentSegment = 0;
+	mNumVertices = 0;
+	mGeneration++;
+
+	return true;
+}
+
+void MeshRingBuffer::WaitSegment(int segment) {
+	GLsync fence = mFences[segment];
+	if (!fence) {
+		return;
+	}
+
+	GLenum r = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+	if (r == GL_TIMEOUT_EXPIRED) {
+		mStallCount++;
+
+		do {
+			r = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000); // 1 ms
+		} while (r == GL_TIMEOUT_EXPIRED);
+	}
+
+	glDeleteSync(fence);
+	mFences[segment] = 0;
+}
+
+void MeshRingBuffer::Destroy() {
+	for (int i = 0; i < MESH_RING_SEGMENTS; ++i) {
+		WaitSegment(i);
+	}
+
+	if (mBuffer) {
+		if (mMapped) {
+			glBindBuffer(GL_ARRAY_BUFFER, mBuffer);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			mMapped = nullptr;
+		}
+
+		glDeleteBuffers(1, &mBuffer);
+		mBuffer = 0;
+	}
+
+	mSegmentVertices = 0;
+}
@@ -0,0 +1,45 @@
+/*
+persistently mapped mesh ring buffer
+*/
+
+#pragma once
+
+#define	MESH_RING_SEGMENTS		3
+
+// vertex buffer split into segments, mesh assembly writes directly into the next free segment
+class MeshRingBuffer : public MeshSink {
+public:
+	MeshRingBuffer();
+	~MeshRingBuffer();
+
+	static bool					IsSupported();
+
+	bool						Init(int segment_vertices, int vertex_size);
+
+	void *						BeginMesh(int max_vertices, int vertex_size) override;
+	void						EndMesh(int num_vertices) override;
+
+	void						Fence();	// after the draw calls that read the current segment
+
+	GLuint						GetBuffer() const;
+	int							GetGeneration() const;	// changes whenever the buffer is recreated, the name may be reused
+	int							GetFirstVertex() const;
+	int							GetNumVertices() const;
+	int							GetStallCount() const;	// waits on a fence that was not signaled yet
+
+private:
+
+	GLuint						mBuffer;
+	byte *						mMapped;
+	int							mSegmentVertices;	// capacity of one segment
+	int							mVertexSize;
+	int							mCurrentSegment;
+	int							mNumVertices;
+	int							mStallCount;
+	int							mGeneration;
+	GLsync						mFences[MESH_RING_SEGMENTS];
+
+	bool						Recreate(int segment_vertices, int vertex_size);
+	void						WaitSegment(int segment);
+	void						Destroy();
+};
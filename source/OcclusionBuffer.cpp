@@ -0,0 +1,319 @@
+/*
+software occlusion buffer
+*/
+
+#include "Precompiled.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+# define	OCCLUSION_SSE
+# include <emmintrin.h>
+#endif
+
+static const int	SETUP_BATCH = 1024;		// triangles per job
+static const int	CULL_BATCH = 256;		// groups per job
+static const int	BANDS_PER_THREAD = 2;
+static const float	OCCLUDED_BIAS = 1.0001f;	// a hull must be this much farther than the occluders
+
+OcclusionBuffer::OcclusionBuffer():
+	mWidth(0),
+	mHeight(0),
+	mDepth(nullptr),
+	mRasterizedTriangles(0),
+	mSource(nullptr),
+	mBandRows(0),
+	mGroupSize(0),
+	mNumGroups(0),
+	mOccluded(nullptr)
+{
+}
+
+OcclusionBuffer::~OcclusionBuffer() {
+	if (mDepth) {
+		free(mDepth);
+		mDepth = nullptr;
+	}
+}
+
+void OcclusionBuffer::Begin(int width, int height, const mat4 &view_proj) {
+	width = (glm::max(width, 4) + 3) & ~3;
+	height = glm::max(height, 1);
+
+	if (width != mWidth || height != mHeight) {
+		if (mDepth) {
+			free(mDepth);
+		}
+
+		mWidth = width;
+		mHeight = height;
+		mDepth = (float*)malloc(sizeof(float) * mWidth * mHeight);
+	}
+
+	memset(mDepth, 0, sizeof(float) * mWidth * mHeight);
+	mViewProj = view_proj;
+	mRasterizedTriangles = 0;
+	mVertices.Reset();
+	mTriangles.Reset();
+}
+
+void OcclusionBuffer::RasterizeTriangles(const vec3 *vertices, int num_triangles) {
+	mSource = vertices;
+	mVertices.Reserve(num_triangles * 3);
+	mVertices.SetCount(num_triangles * 3);
+	mTriangles.Reserve(num_triangles);
+	mTriangles.SetCount(num_triangles);
+
+	Sys_ParallelFor((num_triangles + SETUP_BATCH - 1) / SETUP_BATCH, SetupBatch, this);
+
+	const occluder_triangle_s * tris = mTriangles.GetItems();
+	for (int i = 0; i < num_triangles; ++i) {
+		if (tris[i].mMinX <= tris[i].mMaxX) {
+			mRasterizedTriangles++;
+		}
+	}
+
+	// horizontal bands, every pixel is written by one thread only
+	int bands = glm::min(Sys_GetThreadCount() * BANDS_PER_THREAD, mHeight);
+	mBandRows = (mHeight + bands - 1) / bands;
+	Sys_ParallelFor((mHeight + mBandRows - 1) / mBandRows, RasterizeBand, this);
+}
+
+int OcclusionBuffer::CullGroups(int group_size, byte *occluded) {
+	mGroupSize = group_size;
+	mNumGroups = mVertices.GetCount() / group_size;
+	mOccluded = occluded;
+
+	Sys_ParallelFor((mNumGroups + CULL_BATCH - 1) / CULL_BATCH, CullBatch, this);
+
+	int count = 0;
+	for (int i = 0; i < mNumGroups; ++i) {
+		count += occluded[i];
+	}
+
+	return count;
+}
+
+int OcclusionBuffer::GetRasterizedTriangles() const {
+	return mRasterizedTriangles;
+}
+
+void OcclusionBuffer::SetupBatch(void *context, int index) {
+	OcclusionBuffer * self = (OcclusionBuffer*)context;
+
+	int begin = index * SETUP_BATCH;
+	int end = glm::min(begin + SETUP_BATCH, self->mTriangles.GetCount());
+
+	for (int i = begin; i < end; ++i) {
+		self->SetupTriangle(i);
+	}
+}
+
+void OcclusionBuffer::RasterizeBand(void *context, int index) {
+	OcclusionBuffer * self = (OcclusionBuffer*)context;
+
+	int min_y = index * self->mBandRows;
+	int max_y = glm::min(min_y + self->mBandRows, self->mHeight) - 1;
+
+	const occluder_triangle_s * tris = self->mTriangles.GetItems();
+	int count = self->mTriangles.GetCount();
+
+	for (int i = 0; i < count; ++i) {
+		const occluder_triangle_s & tri = tris[i];
+		if (tri.mMinX > tri.mMaxX || tri.mMaxY < min_y || tri.mMinY > max_y) {
+			continue;
+		}
+
+		self->RasterizeTriangle(tri, glm::max(tri.mMinY, min_y), glm::min(tri.mMaxY, max_y));
+	}
+}
+
+void OcclusionBuffer::CullBatch(void *context, int index) {
+	OcclusionBuffer * self = (OcclusionBuffer*)context;
+
+	int begin = index * CULL_BATCH;
+	int end = glm::min(begin + CULL_BATCH, self->mNumGroups);
+
+	for (int i = begin; i < end; ++i) {
+		self->mOccluded[i] = self->IsGroupOccluded(i) ? 1 : 0;
+	}
+}
+
+void OcclusionBuffer::SetupTriangle(int index) {
+	occlusion_vertex_s * v = mVertices.GetItems() + index * 3;
+	occluder_triangle_s & tri = mTriangles.GetItems()[index];
+
+	tri.mMinX = 1;
+	tri.mMaxX = 0;
+
+	bool clipped = false;
+	for (int i = 0; i < 3; ++i) {
+		vec4 clip = mViewProj * vec4(mSource[index * 3 + i], 1.0f);
+
+		// the renderer clips at the near and far plane, an occluder must not cover more than it draws
+		if (clip.w <= 0.0f || clip.z < -clip.w || clip.z > clip.w) {
+			v[i].mInvW = -1.0f;
+			clipped = true;
+			continue;
+		}
+
+		float inv_w = 1.0f / clip.w;
+		v[i].mX = (clip.x * inv_w * 0.5f + 0.5f) * mWidth;
+		v[i].mY = (clip.y * inv_w * 0.5f + 0.5f) * mHeight;
+		v[i].mInvW = inv_w;
+	}
+
+	if (clipped) {
+		return;
+	}
+
+	float min_x = glm::min(v[0].mX, glm::min(v[1].mX, v[2].mX));
+	float max_x = glm::max(v[0].mX, glm::max(v[1].mX, v[2].mX));
+	float min_y = glm::min(v[0].mY, glm::min(v[1].mY, v[2].mY));
+	float max_y = glm::max(v[0].mY, glm::max(v[1].mY, v[2].mY));
+
+	if (max_x - min_x < 1.0f || max_y - min_y < 1.0f) {
+		return; // covers no pixel fully
+	}
+
+	float area = (v[1].mX - v[0].mX) * (v[2].mY - v[0].mY) - (v[2].mX - v[0].mX) * (v[1].mY - v[0].mY);
+	if (fabsf(area) < 1.0f) {
+		return;
+	}
+
+	// counter clockwise, inside is where all edge functions are positive
+	const occlusion_vertex_s * p[3] = { v, v + 1, v + 2 };
+	if (area < 0.0f) {
+		p[1] = v + 2;
+		p[2] = v + 1;
+		area = -area;
+	}
+
+	for (int i = 0; i < 3; ++i) {
+		const occlusion_vertex_s * a = p[i];
+		const occlusion_vertex_s * b = p[(i + 1) % 3];
+
+		float ea = a->mY - b->mY;
+		float eb = b->mX - a->mX;
+		float ec = -(ea * a->mX + eb * a->mY);
+
+		// evaluated at the pixel corner, moved to the pixel center and then to the corner nearest the edge
+		tri.mEdgeA[i] = ea;
+		tri.mEdgeB[i] = eb;
+		tri.mEdgeC[i] = ec + 0.5f * (ea + eb) - 0.5f * (fabsf(ea) + fabsf(eb));
+	}
+
+	// 1 / w is linear in screen space, keep the farthest value inside the pixel
+	float d1 = p[1]->mInvW - p[0]->mInvW;
+	float d2 = p[2]->mInvW - p[0]->mInvW;
+	float da = (d1 * (p[2]->mY - p[0]->mY) - d2 * (p[1]->mY - p[0]->mY)) / area;
+	float db = (d2 * (p[1]->mX - p[0]->mX) - d1 * (p[2]->mX - p[0]->mX)) / area;
+	float dc = p[0]->mInvW - da * p[0]->mX - db * p[0]->mY;
+
+	tri.mDepthA = da;
+	tri.mDepthB = db;
+	tri.mDepthC = dc + 0.5f * (da + db) - 0.5f * (fabsf(da) + fabsf(db));
+
+	tri.mMinX = glm::max((int32_t)floorf(min_x), 0);
+	tri.mMaxX = glm::min((int32_t)ceilf(max_x), mWidth) - 1;
+	tri.mMinY = glm::max((int32_t)floorf(min_y), 0);
+	tri.mMaxY = glm::min((int32_t)ceilf(max_y), mHeight) - 1;
+}
+
+void OcclusionBuffer::RasterizeTriangle(const occluder_triangle_s &tri, int min_y, int max_y) {
+	int min_x = tri.mMinX & ~3; // the row stride is a multiple of 4
+
+#if defined(OCCLUSION_SSE)
+	__m128 lane = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+	__m128 ea0 = _mm_set1_ps(tri.mEdgeA[0]);
+	__m128 ea1 = _mm_set1_ps(tri.mEdgeA[1]);
+	__m128 ea2 = _mm_set1_ps(tri.mEdgeA[2]);
+	__m128 da = _mm_set1_ps(tri.mDepthA);
+	__m128 zero = _mm_setzero_ps();
+
+	for (int y = min_y; y <= max_y; ++y) {
+		float fy = (float)y;
+		__m128 ec0 = _mm_set1_ps(tri.mEdgeB[0] * fy + tri.mEdgeC[0]);
+		__m128 ec1 = _mm_set1_ps(tri.mEdgeB[1] * fy + tri.mEdgeC[1]);
+		__m128 ec2 = _mm_set1_ps(tri.mEdgeB[2] * fy + tri.mEdgeC[2]);
+		__m128 dc = _mm_set1_ps(tri.mDepthB * fy + tri.mDepthC);
+		float * row = mDepth + y * mWidth;
+
+		for (int x = min_x; x <= tri.mMaxX; x += 4) {
+			__m128 fx = _mm_add_ps(_mm_set1_ps((float)x), lane);
+
+			__m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(ea0, fx), ec0), zero);
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(ea1, fx), ec1), zero));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(ea2, fx), ec2), zero));
+
+			if (!_mm_movemask_ps(inside)) {
+				continue;
+			}
+
+			__m128 depth = _mm_add_ps(_mm_mul_ps(da, fx), dc);
+			__m128 old_depth = _mm_loadu_ps(row + x);
+			__m128 new_depth = _mm_max_ps(old_depth, depth);
+			_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, new_depth), _mm_andnot_ps(inside, old_depth)));
+		}
+	}
+#else
+	for (int y = min_y; y <= max_y; ++y) {
+		float fy = (float)y;
+		float * row = mDepth + y * mWidth;
+
+		for (int x = min_x; x <= tri.mMaxX; ++x) {
+			float fx = (float)x;
+
+			if (tri.mEdgeA[0] * fx + tri.mEdgeB[0] * fy + tri.mEdgeC[0] < 0.0f
+				|| tri.mEdgeA[1] * fx + tri.mEdgeB[1] * fy + tri.mEdgeC[1] < 0.0f
+				|| tri.mEdgeA[2] * fx + tri.mEdgeB[2] * fy + tri.mEdgeC[2] < 0.0f) {
+				continue;
+			}
+
+			row[x] = glm::max(row[x], tri.mDepthA * fx + tri.mDepthB * fy + tri.mDepthC);
+		}
+	}
+#endif
+}
+
+bool OcclusionBuffer::IsGroupOccluded(int group) const {
+	const occlusion_vertex_s * v = mVertices.GetItems() + group * mGroupSize;
+
+	float min_x = FLT_MAX;
+	float max_x = -FLT_MAX;
+	float min_y = FLT_MAX;
+	float max_y = -FLT_MAX;
+	float max_inv_w = 0.0f;
+
+	for (int i = 0; i < mGroupSize; ++i) {
+		if (v[i].mInvW < 0.0f) {
+			return false; // crosses the near or far plane
+		}
+
+		min_x = glm::min(min_x, v[i].mX);
+		max_x = glm::max(max_x, v[i].mX);
+		min_y = glm::min(min_y, v[i].mY);
+		max_y = glm::max(max_y, v[i].mY);
+		max_inv_w = glm::max(max_inv_w, v[i].mInvW); // 1 / w is affine, the nearest point of the hull is a vertex
+	}
+
+	int x0 = glm::max((int)floorf(min_x), 0);
+	int x1 = glm::min((int)floorf(max_x), mWidth - 1);
+	int y0 = glm::max((int)floorf(min_y), 0);
+	int y1 = glm::min((int)floorf(max_y), mHeight - 1);
+
+	if (x0 > x1 || y0 > y1) {
+		return false; // off screen, left to frustum culling
+	}
+
+	float nearest = max_inv_w * OCCLUDED_BIAS;
+
+	for (int y = y0; y <= y1; ++y) {
+		const float * row = mDepth + y * mWidth;
+		for (int x = x0; x <= x1; ++x) {
+			if (row[x] <= nearest) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,67 @@
+/*
+software occlusion buffer
+*/
+
+#pragma once
+
+// low resolution depth of the nearest occluders, stored as 1 / w, 0 is empty.
+// conservative: a triangle only writes the pixels it covers fully, with its farthest depth inside the pixel
+class OcclusionBuffer {
+public:
+
+	OcclusionBuffer();
+	~OcclusionBuffer();
+
+	void						Begin(int width, int height, const mat4 &view_proj);	// clears
+	void						RasterizeTriangles(const vec3 *vertices, int num_triangles);	// triangle list, on all threads
+	// the vertices of the last RasterizeTriangles in groups of group_size, occluded[i] is 1 if the convex hull
+	// of group i is behind the occluders at every pixel it covers. returns the occluded count
+	int							CullGroups(int group_size, byte *occluded);
+	int							GetRasterizedTriangles() const;	// last RasterizeTriangles, clipped and tiny ones skipped
+
+private:
+
+	struct occlusion_vertex_s {
+		float					mX;			// pixels
+		float					mY;
+		float					mInvW;		// < 0 outside the near or far plane
+	};
+
+	// edge functions and depth plane at pixel corners, already offset to the most conservative point of a pixel
+	struct occluder_triangle_s {
+		float					mEdgeA[3];
+		float					mEdgeB[3];
+		float					mEdgeC[3];
+		float					mDepthA;
+		float					mDepthB;
+		float					mDepthC;
+		int32_t					mMinX;		// mMinX > mMaxX: not rasterized
+		int32_t					mMinY;
+		int32_t					mMaxX;
+		int32_t					mMaxY;
+	};
+
+	int							mWidth;		// multiple of 4
+	int							mHeight;
+	float *						mDepth;
+	mat4						mViewProj;
+
+	ItemArray<occlusion_vertex_s, 65536>	mVertices;
+	ItemArray<occluder_triangle_s, 16384>	mTriangles;
+	int							mRasterizedTriangles;
+
+	// current parallel job
+	const vec3 *				mSource;
+	int							mBandRows;
+	int							mGroupSize;
+	int							mNumGroups;
+	byte *						mOccluded;
+
+	static void					SetupBatch(void *context, int index);
+	static void					RasterizeBand(void *context, int index);
+	static void					CullBatch(void *context, int index);
+
+	void						SetupTriangle(int index);
+	void						RasterizeTriangle(const occluder_triangle_s &tri, int min_y, int max_y);
+	bool						IsGroupOccluded(int group) const;
+};
@@ -0,0 +1,198 @@
+/*
+offscreen rendering context
+*/
+
+#include "Precompiled.h"
+
+#if defined(__linux__)
+# include <EGL/egl.h>
+# include <EGL/eglext.h>
+#endif
+
+Offscreen::Offscreen():
+	mDisplay(nullptr),
+	mContext(nullptr),
+	mSurface(nullptr),
+	mWidth(0),
+	mHeight(0),
+	mFBO(0),
+	mColorRBO(0),
+	mDepthRBO(0)
+{
+}
+
+Offscreen::~Offscreen() {
+	Shutdown();
+}
+
+bool Offscreen::Init(int width, int height) {
+	mWidth = width;
+	mHeight = height;
+
+	if (!CreateContext(width, height)) {
+		return false;
+	}
+
+	if (!GL_Init()) {
+		return false;
+	}
+
+	glGenRenderbuffers(1, &mColorRBO);
+	glBindRenderbuffer(GL_RENDERBUFFER, mColorRBO);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+	glGenRenderbuffers(1, &mDepthRBO);
+	glBindRenderbuffer(GL_RENDERBUFFER, mDepthRBO);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &mFBO);
+	glBindFramebuffer(GL_FRAMEBUFFER, mFBO);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, mColorRBO);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, mDepthRBO);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		SYS_ERROR("offscreen framebuffer incomplete\n");
+		return false;
+	}
+
+	// stays bound, everything the renderer draws goes here
+	glViewport(0, 0, width, height);
+
+	return true;
+}
+
+void Offscreen::Shutdown() {
+	if (mFBO) {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteFramebuffers(1, &mFBO);
+		glDeleteRenderbuffers(1, &mDepthRBO);
+		glDeleteRenderbuffers(1, &mColorRBO);
+		mFBO = mDepthRBO = mColorRBO = 0;
+	}
+
+#if defined(__linux__)
+	if (mDisplay) {
+		eglMakeCurrent((EGLDisplay)mDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+		if (mSurface) {
+			eglDestroySurface((EGLDisplay)mDisplay, (EGLSurface)mSurface);
+			mSurface = nullptr;
+		}
+
+		if (mContext) {
+			eglDestroyContext((EGLDisplay)mDisplay, (EGLContext)mContext);
+			mContext = nullptr;
+		}
+
+		eglTerminate((EGLDisplay)mDisplay);
+		mDisplay = nullptr;
+	}
+#endif
+}
+
+void Offscreen::ReadPixels(image32_s &image) const {
+	if (image.mWidth != mWidth || image.mHeight != mHeight || !image.mData) {
+		image.mWidth = mWidth;
+		image.mHeight = mHeight;
+		image.AllocDataSpace(mWidth * mHeight);
+	}
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glReadPixels(0, 0, mWidth, mHeight, GL_RGBA, GL_UNSIGNED_BYTE, image.mData);
+}
+
+bool Offscreen::CreateContext(int width, int height) {
+#if defined(__linux__)
+	EGLDisplay display = EGL_NO_DISPLAY;
+
+	// prefer a display that does not need a window system at all
+	const char * client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (client_extensions && strstr(client_extensions, "EGL_MESA_platform_surfaceless")) {
+		PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+			(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (get_platform_display) {
+			display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+		}
+	}
+
+	if (display == EGL_NO_DISPLAY) {
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+
+	EGLint major = 0, minor = 0;
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+		SYS_ERROR("could not initialize EGL display\n");
+		return false;
+	}
+
+	mDisplay = display;
+	printf("EGL %d.%d, %s\n", major, minor, eglQueryString(display, EGL_VENDOR));
+
+	const EGLint config_attribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_NONE
+	};
+
+	EGLConfig config = nullptr;
+	EGLint num_configs = 0;
+	if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) || num_configs < 1) {
+		SYS_ERROR("no suitable EGL config\n");
+		return false;
+	}
+
+	if (!eglBindAPI(EGL_OPENGL_API)) {
+		SYS_ERROR("EGL does not support desktop OpenGL\n");
+		return false;
+	}
+
+	// compatibility profile, text rendering uses GL_QUADS
+	const EGLint context_attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 5,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+		EGL_NONE
+	};
+
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+	if (context == EGL_NO_CONTEXT) {
+		SYS_ERROR("could not create OpenGL 4.5 context\n");
+		return false;
+	}
+
+	mContext = context;
+
+	if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		// no EGL_KHR_surfaceless_context, make current with a pbuffer
+		const EGLint pbuffer_attribs[] = {
+			EGL_WIDTH, width,
+			EGL_HEIGHT, height,
+			EGL_NONE
+		};
+
+		EGLSurface surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+		if (surface == EGL_NO_SURFACE) {
+			SYS_ERROR("could not create pbuffer surface\n");
+			return false;
+		}
+
+		mSurface = surface;
+
+		if (!eglMakeCurrent(display, surface, surface, context)) {
+			SYS_ERROR("eglMakeCurrent error\n");
+			return false;
+		}
+	}
+
+	return true;
+#else
+	SYS_ERROR("headless mode is only supported on linux\n");
+	return false;
+#endif
+}
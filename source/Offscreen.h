@@ -0,0 +1,31 @@
+/*
+offscreen rendering context
+*/
+
+#pragma once
+
+// GL context without a window, renders into a framebuffer object
+class Offscreen {
+public:
+	Offscreen();
+	~Offscreen();
+
+	bool						Init(int width, int height);
+	void						Shutdown();
+
+	void						ReadPixels(image32_s &image) const;	// RGBA, bottom-up
+
+private:
+
+	void *						mDisplay;	// EGLDisplay
+	void *						mContext;	// EGLContext
+	void *						mSurface;	// EGLSurface, only if surfaceless is not supported
+
+	int							mWidth;
+	int							mHeight;
+	GLuint						mFBO;
+	GLuint						mColorRBO;
+	GLuint						mDepthRBO;
+
+	bool						CreateContext(int width, int height);
+};
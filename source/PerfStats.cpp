@@ -0,0 +1,175 @@
+/*
+performance statistics
+*/
+
+#include "Precompiled.h"
+#include <algorithm>
+
+PerfStats::PerfStats():
+	mPriorFrameTime(-1.0),
+	mHistoryHead(0),
+	mHistoryCount(0),
+	mFrameUploadBytes(0),
+	mLodMemory(0),
+	mUniformCalls(0),
+	mUploadChunks(0),
+	mDrawnChunks(0),
+	mChunkCount(0),
+	mPacing(FP_UNCAPPED)
+{
+	memset(mPhaseStart, 0, sizeof(mPhaseStart));
+	memset(mPhaseAccum, 0, sizeof(mPhaseAccum));
+	memset(mFrameTimes, 0, sizeof(mFrameTimes));
+	memset(mPhaseTimes, 0, sizeof(mPhaseTimes));
+	memset(mUploadBytes, 0, sizeof(mUploadBytes));
+}
+
+PerfStats::~PerfStats() {
+}
+
+void PerfStats::BeginPhase(perf_phase_t phase) {
+	mPhaseStart[phase] = Sys_GetRelativeTime();
+}
+
+void PerfStats::EndPhase(perf_phase_t phase) {
+	mPhaseAccum[phase] += Sys_GetRelativeTime() - mPhaseStart[phase];
+}
+
+void PerfStats::AddUploadBytes(size_t bytes) {
+	mFrameUploadBytes += bytes;
+}
+
+void PerfStats::SetLodMemory(size_t bytes) {
+	mLodMemory = bytes;
+}
+
+void PerfStats::SetLodStats(const lod_stats_s &lod_stats) {
+	mLodStats = lod_stats;
+}
+
+void PerfStats::SetUniformCalls(int calls) {
+	mUniformCalls = calls;
+}
+
+void PerfStats::SetChunkStats(int uploaded, int drawn, int total) {
+	mUploadChunks = uploaded;
+	mDrawnChunks = drawn;
+	mChunkCount = total;
+}
+
+void PerfStats::SetPacingStats(frame_pacing_t pacing, const frame_pacing_stats_s &pacing_stats) {
+	mPacing = pacing;
+	mPacingStats = pacing_stats;
+}
+
+void PerfStats::EndFrame() {
+	double t = Sys_GetRelativeTime();
+
+	if (mPriorFrameTime >= 0.0) {
+		mFrameTimes[mHistoryHead] = (float)((t - mPriorFrameTime) * 1000.0);
+		for (int i = 0; i < PP_COUNT; ++i) {
+			mPhaseTimes[mHistoryHead][i] = (float)(mPhaseAccum[i] * 1000.0);
+		}
+		mUploadBytes[mHistoryHead] = mFrameUploadBytes;
+
+		mHistoryHead = (mHistoryHead + 1) % PERF_HISTORY_FRAMES;
+		if (mHistoryCount < PERF_HISTORY_FRAMES) {
+			mHistoryCount++;
+		}
+	}
+
+	mPriorFrameTime = t;
+	memset(mPhaseAccum, 0, sizeof(mPhaseAccum));
+	mFrameUploadBytes = 0;
+}
+
+int PerfStats::GetHistoryCount() const {
+	return mHistoryCount;
+}
+
+float PerfStats::GetHistoryFrameTime(int index) const {
+	int oldest = (mHistoryHead - mHistoryCount + PERF_HISTORY_FRAMES) % PERF_HISTORY_FRAMES;
+	return mFrameTimes[(oldest + index) % PERF_HISTORY_FRAMES];
+}
+
+float PerfStats::GetFrameTime() const {
+	return mHistoryCount ? mFrameTimes[LastSlot()] : 0.0f;
+}
+
+float PerfStats::GetPhaseTime(perf_phase_t phase) const {
+	return mHistoryCount ? mPhaseTimes[LastSlot()][phase] : 0.0f;
+}
+
+float PerfStats::GetPercentileFrameTime(float percentile) const {
+	if (!mHistoryCount) {
+		return 0.0f;
+	}
+
+	float sorted[PERF_HISTORY_FRAMES];
+	for (int i = 0; i < mHistoryCount; ++i) {
+		sorted[i] = GetHistoryFrameTime(i);
+	}
+	std::sort(sorted, sorted + mHistoryCount);
+
+	int index = (int)ceilf(percentile * mHistoryCount) - 1;
+	index = glm::clamp(index, 0, mHistoryCount - 1);
+
+	return sorted[index];
+}
+
+float PerfStats::GetUploadRate() const {
+	double bytes = 0.0;
+	double ms = 0.0;
+
+	for (int i = 0; i < mHistoryCount; ++i) {
+		int slot = (mHistoryHead - 1 - i + PERF_HISTORY_FRAMES) % PERF_HISTORY_FRAMES;
+		bytes += (double)mUploadBytes[slot];
+		ms += mFrameTimes[slot];
+	}
+
+	if (ms <= 0.0) {
+		return 0.0f;
+	}
+
+	return (float)((bytes / (1024.0 * 1024.0)) / (ms * 0.001));
+}
+
+size_t PerfStats::GetUploadBytes() const {
+	return mHistoryCount ? mUploadBytes[LastSlot()] : 0;
+}
+
+size_t PerfStats::GetLodMemory() const {
+	return mLodMemory;
+}
+
+const lod_stats_s & PerfStats::GetLodStats() const {
+	return mLodStats;
+}
+
+int PerfStats::GetUniformCalls() const {
+	return mUniformCalls;
+}
+
+int PerfStats::GetUploadChunks() const {
+	return mUploadChunks;
+}
+
+int PerfStats::GetDrawnChunks() const {
+	return mDrawnChunks;
+}
+
+int PerfStats::GetChunkCount() const {
+	return mChunkCount;
+}
+
+frame_pacing_t PerfStats::GetPacing() const {
+	return mPacing;
+}
+
+const frame_pacing_stats_s & PerfStats::GetPacingStats() const {
+	return mPacingStats;
+}
+
+int PerfStats::LastSlot() const {
+	return (mHistoryHead - 1 + PERF_HISTORY_FRAMES) % PERF_HISTORY_FRAMES;
+}
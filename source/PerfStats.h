@@ -0,0 +1,73 @@
+/*
+performance statistics
+*/
+
+#pragma once
+
+#define	PERF_HISTORY_FRAMES		128
+
+enum perf_phase_t {
+	PP_LOD_UPDATE,
+	PP_UPLOAD,
+	PP_DRAW_SUBMIT,
+	PP_FENCE_WAIT,		// CPU blocked on a frame still in flight
+
+	PP_COUNT
+};
+
+class PerfStats {
+public:
+
+	PerfStats();
+	~PerfStats();
+
+	void						BeginPhase(perf_phase_t phase);
+	void						EndPhase(perf_phase_t phase);
+	void						AddUploadBytes(size_t bytes);
+	void						SetLodMemory(size_t bytes);
+	void						SetLodStats(const lod_stats_s &lod_stats);
+	void						SetUniformCalls(int calls);
+	void						SetChunkStats(int uploaded, int drawn, int total);
+	void						SetPacingStats(frame_pacing_t pacing, const frame_pacing_stats_s &pacing_stats);
+	void						EndFrame();
+
+	int							GetHistoryCount() const;
+	float						GetHistoryFrameTime(int index) const; // 0 is the oldest, ms
+	float						GetFrameTime() const;	// ms
+	float						GetPhaseTime(perf_phase_t phase) const; // ms
+	float						GetPercentileFrameTime(float percentile) const; // ms
+	float						GetUploadRate() const;	// MB/s
+	size_t						GetUploadBytes() const;	// last frame
+	size_t						GetLodMemory() const;
+	const lod_stats_s &			GetLodStats() const;
+	int							GetUniformCalls() const;
+	int							GetUploadChunks() const;	// last frame
+	int							GetDrawnChunks() const;
+	int							GetChunkCount() const;
+	frame_pacing_t				GetPacing() const;
+	const frame_pacing_stats_s &GetPacingStats() const;
+
+private:
+
+	double						mPriorFrameTime;
+	double						mPhaseStart[PP_COUNT];
+	double						mPhaseAccum[PP_COUNT];	// current frame
+
+	float						mFrameTimes[PERF_HISTORY_FRAMES];
+	float						mPhaseTimes[PERF_HISTORY_FRAMES][PP_COUNT];
+	size_t						mUploadBytes[PERF_HISTORY_FRAMES];
+	int							mHistoryHead;	// next slot to write
+	int							mHistoryCount;
+
+	size_t						mFrameUploadBytes;	// current frame
+	size_t						mLodMemory;
+	lod_stats_s					mLodStats;
+	int							mUniformCalls;
+	int							mUploadChunks;
+	int							mDrawnChunks;
+	int							mChunkCount;
+	frame_pacing_t				mPacing;
+	frame_pacing_stats_s		mPacingStats;
+
+	int							LastSlot() const;
+};
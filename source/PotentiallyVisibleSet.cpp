@@ -0,0 +1,420 @@
+/*
+potentially visible set
+*/
+
+#include "Precompiled.h"
+
+static const uint32_t	PVS_MAGIC = 0x32535650;	// "PVS2"
+static const int		FINE_LEVELS = 2;		// height bounds this many levels below the regions
+
+PotentiallyVisibleSet::PotentiallyVisibleSet():
+	mLength(0),
+	mLevel(0),
+	mRegionLength(0),
+	mRegionSize(0),
+	mRowBytes(0),
+	mClearance(0.0f),
+	mMaxError(0.0f),
+	mActiveDistance(0.0f),
+	mSampleHash(0),
+	mCellTops(nullptr),
+	mBits(nullptr),
+	mFineLength(0),
+	mFineSize(0),
+	mNumLevels(0),
+	mRegionMaxs(nullptr),
+	mWindowMins(nullptr),
+	mWindowErrors(nullptr),
+	mCellDepths(nullptr),
+	mViewLevels(nullptr),
+	mNumViewLevels(0)
+{
+}
+
+PotentiallyVisibleSet::~PotentiallyVisibleSet() {
+	Reset();
+}
+
+bool PotentiallyVisibleSet::Bake(const QuadCollapseMesh &mesh, const vec3 *vertices, int level, float clearance) {
+	int length = mesh.GetMaxLevelVerticesLength();
+	if (!Alloc(length, level)) {
+		return false;
+	}
+
+	mClearance = clearance;
+	mMaxError = mesh.GetMaxError();
+	mActiveDistance = mesh.GetActiveDistances()[0];
+	mSampleHash = HashSamples(vertices, length);
+
+	int max_level = mesh.GetMaxLevel();
+	int fine_level = glm::min(level + FINE_LEVELS, max_level);
+	mFineLength = 1 << fine_level;
+	mFineSize = (length - 1) >> fine_level;
+
+	int num_regions = mRegionLength * mRegionLength;
+	int num_fine = mFineLength * mFineLength;
+
+	mNumLevels = max_level + 1;
+
+	float * fine_bounds = (float*)malloc(sizeof(float) * num_fine);
+	float * row_bounds = (float*)malloc(sizeof(float) * num_fine);
+	mRegionMaxs = (float*)malloc(sizeof(float) * num_regions);
+	mWindowMins = (float*)malloc(sizeof(float) * num_fine);
+	mWindowErrors = (float*)malloc(sizeof(float) * num_fine * mNumLevels);
+	mCellDepths = (float*)malloc(sizeof(float) * num_regions);
+
+	float min_z = FLT_MAX;
+	float max_z = -FLT_MAX;
+	for (int i = 0; i < length * length; ++i) {
+		min_z = glm::min(min_z, vertices[i].z);
+		max_z = glm::max(max_z, vertices[i].z);
+	}
+
+	// lowest sample of every fine cell, negated for WindowMax. samples on a shared edge belong to both sides,
+	// the surface between samples is inside their bounds
+	for (int fy = 0; fy < mFineLength; ++fy) {
+		for (int fx = 0; fx < mFineLength; ++fx) {
+			float z = FLT_MAX;
+			for (int y = fy * mFineSize; y <= (fy + 1) * mFineSize; ++y) {
+				for (int x = fx * mFineSize; x <= (fx + 1) * mFineSize; ++x) {
+					z = glm::min(z, vertices[y * length + x].z);
+				}
+			}
+			fine_bounds[fy * mFineLength + fx] = -z;
+		}
+	}
+	WindowMax(fine_bounds, row_bounds, mWindowMins);
+	for (int i = 0; i < num_fine; ++i) {
+		mWindowMins[i] = -mWindowMins[i];
+	}
+
+	free(fine_bounds);
+
+	float * fine_errors = (float*)malloc(sizeof(float) * num_fine * mNumLevels);
+	mesh.GetSurfaceErrors(mFineLength, fine_errors);
+
+	for (int level = 0; level < mNumLevels; ++level) {
+		WindowMax(fine_errors + level * num_fine, row_bounds, mWindowErrors + level * num_fine);
+	}
+
+	free(fine_errors);
+	free(row_bounds);
+
+	for (int ry = 0; ry < mRegionLength; ++ry) {
+		for (int rx = 0; rx < mRegionLength; ++rx) {
+			float z = -FLT_MAX;
+			for (int y = ry * mRegionSize; y <= (ry + 1) * mRegionSize; ++y) {
+				for (int x = rx * mRegionSize; x <= (rx + 1) * mRegionSize; ++x) {
+					z = glm::max(z, vertices[y * length + x].z);
+				}
+			}
+			mRegionMaxs[ry * mRegionLength + rx] = z;
+			mCellTops[ry * mRegionLength + rx] = z + clearance;
+			mCellDepths[ry * mRegionLength + rx] = glm::max(z + clearance, max_z) - min_z;
+		}
+	}
+
+	// the farthest a view position can be from any sample
+	float size = (float)(length - 1);
+	float max_distance = sqrtf(size * size * 2.0f + (max_z + clearance - min_z) * (max_z + clearance - min_z));
+	mNumViewLevels = (int)(max_distance / mFineSize) + 2;
+	mViewLevels = (byte*)malloc(mNumViewLevels);
+
+	for (int i = 0; i < mNumViewLevels; ++i) {
+		mViewLevels[i] = (byte)mesh.GetViewLevel((float)(i * mFineSize));
+	}
+
+	// cells are independent, every job writes its own bits
+	Sys_ParallelFor(num_regions, BakeCell, this);
+
+	free(mViewLevels);
+	free(mCellDepths);
+	free(mWindowErrors);
+	free(mWindowMins);
+	free(mRegionMaxs);
+	mViewLevels = nullptr;
+	mCellDepths = nullptr;
+	mWindowErrors = nullptr;
+	mWindowMins = nullptr;
+	mRegionMaxs = nullptr;
+
+	return true;
+}
+
+bool PotentiallyVisibleSet::Save(const char *filename) const {
+	if (!mBits) {
+		return false;
+	}
+
+	FILE * f = File_Open(filename, "wb");
+	if (!f) {
+		SYS_ERROR("could not write %s\n", filename);
+		return false;
+	}
+
+	pvs_header_s header;
+	header.mMagic = PVS_MAGIC;
+	header.mLength = mLength;
+	header.mLevel = mLevel;
+	header.mClearance = mClearance;
+	header.mMaxError = mMaxError;
+	header.mActiveDistance = mActiveDistance;
+	header.mSampleHash = mSampleHash;
+
+	int num_cells = GetCellCount();
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+		&& fwrite(mCellTops, sizeof(float), num_cells, f) == (size_t)num_cells
+		&& fwrite(mBits, mRowBytes, num_cells, f) == (size_t)num_cells;
+
+	fclose(f);
+
+	if (!ok) {
+		SYS_ERROR("could not write %s\n", filename);
+	}
+
+	return ok;
+}
+
+bool PotentiallyVisibleSet::Load(const char *filename, const QuadCollapseMesh &mesh, const vec3 *vertices) {
+	Reset();
+
+	FILE * f = File_Open(filename, "rb");
+	if (!f) {
+		SYS_ERROR("could not open %s\n", filename);
+		return false;
+	}
+
+	pvs_header_s header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || header.mMagic != PVS_MAGIC) {
+		SYS_ERROR("%s is not a visibility set\n", filename);
+		fclose(f);
+		return false;
+	}
+
+	int length = mesh.GetMaxLevelVerticesLength();
+	if (header.mLength != length || header.mSampleHash != HashSamples(vertices, length)) {
+		SYS_ERROR("%s was baked for another height field\n", filename);
+		fclose(f);
+		return false;
+	}
+
+	// the hidden bits hold only for the surface errors they were baked with
+	if (header.mMaxError != mesh.GetMaxError() || header.mActiveDistance != mesh.GetActiveDistances()[0]) {
+		SYS_ERROR("%s was baked with other LOD settings\n", filename);
+		fclose(f);
+		return false;
+	}
+
+	if (!Alloc(header.mLength, header.mLevel)) {
+		fclose(f);
+		return false;
+	}
+
+	mClearance = header.mClearance;
+	mMaxError = header.mMaxError;
+	mActiveDistance = header.mActiveDistance;
+	mSampleHash = header.mSampleHash;
+
+	int num_cells = GetCellCount();
+	bool ok = fread(mCellTops, sizeof(float), num_cells, f) == (size_t)num_cells
+		&& fread(mBits, mRowBytes, num_cells, f) == (size_t)num_cells;
+
+	fclose(f);
+
+	if (!ok) {
+		SYS_ERROR("%s is truncated\n", filename);
+		Reset();
+	}
+
+	return ok;
+}
+
+int PotentiallyVisibleSet::GetLevel() const {
+	return mLevel;
+}
+
+int PotentiallyVisibleSet::GetCellCount() const {
+	return mRegionLength * mRegionLength;
+}
+
+float PotentiallyVisibleSet::GetVisibleRatio() const {
+	int num_cells = GetCellCount();
+	if (!num_cells) {
+		return 0.0f;
+	}
+
+	double visible = 0.0;
+	for (int cell = 0; cell < num_cells; ++cell) {
+		for (int region = 0; region < num_cells; ++region) {
+			visible += IsVisible(cell, region) ? 1.0 : 0.0;
+		}
+	}
+
+	return (float)(visible / ((double)num_cells * num_cells));
+}
+
+int PotentiallyVisibleSet::FindCell(const vec3 &view_pos) const {
+	float size = (float)(mLength - 1);
+	if (!mBits || view_pos.x < 0.0f || view_pos.y < 0.0f || view_pos.x > size || view_pos.y > size) {
+		return -1;
+	}
+
+	int cx = glm::min((int)view_pos.x / mRegionSize, mRegionLength - 1);
+	int cy = glm::min((int)view_pos.y / mRegionSize, mRegionLength - 1);
+	int cell = cy * mRegionLength + cx;
+
+	return view_pos.z <= mCellTops[cell] ? cell : -1;
+}
+
+bool PotentiallyVisibleSet::IsVisible(int cell, int region) const {
+	return (mBits[cell * mRowBytes + (region >> 3)] >> (region & 7)) & 1;
+}
+
+void PotentiallyVisibleSet::Reset() {
+	if (mBits) {
+		free(mBits);
+		mBits = nullptr;
+	}
+
+	if (mCellTops) {
+		free(mCellTops);
+		mCellTops = nullptr;
+	}
+
+	mLength = 0;
+	mLevel = 0;
+	mRegionLength = 0;
+	mRegionSize = 0;
+	mRowBytes = 0;
+}
+
+// FNV-1a over the height bits, x and y follow from the grid
+uint64_t PotentiallyVisibleSet::HashSamples(const vec3 *vertices, int length) {
+	uint64_t h = 14695981039346656037ULL;
+
+	for (int i = 0; i < length * length; ++i) {
+		uint32_t z;
+		memcpy(&z, &vertices[i].z, sizeof(z));
+		h ^= z;
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+bool PotentiallyVisibleSet::Alloc(int length, int level) {
+	Reset();
+
+	if (length < 3 || !IsPowerOf2(length - 1)) {
+		SYS_ERROR("wrong length\n");
+		return false;
+	}
+
+	if (level < 1 || (1 << level) > length - 1 || level > MAX_QUAD_LEVEL_COUNT - 1) {
+		SYS_ERROR("bad visibility level %d\n", level);
+		return false;
+	}
+
+	mLength = length;
+	mLevel = level;
+	mRegionLength = 1 << level;
+	mRegionSize = (length - 1) >> level;
+	mRowBytes = (mRegionLength * mRegionLength + 7) >> 3;
+
+	int num_cells = GetCellCount();
+	mCellTops = (float*)malloc(sizeof(float) * num_cells);
+	mBits = (byte*)malloc((size_t)mRowBytes * num_cells);
+	memset(mBits, 0, (size_t)mRowBytes * num_cells);
+
+	return true;
+}
+
+void PotentiallyVisibleSet::BakeCell(void *context, int index) {
+	PotentiallyVisibleSet * self = (PotentiallyVisibleSet*)context;
+
+	byte * bits = self->mBits + (size_t)index * self->mRowBytes;
+	int num_regions = self->GetCellCount();
+
+	for (int region = 0; region < num_regions; ++region) {
+		if (!self->IsHidden(index, region)) {
+			bits[region >> 3] |= (byte)(1 << (region & 7));
+		}
+	}
+}
+
+// a region sized square starting anywhere in a fine cell overlaps at most fine_per_region + 1 fine cells per axis
+void PotentiallyVisibleSet::WindowMax(const float *fine, float *temp, float *windows) const {
+	int fine_per_region = mRegionSize / mFineSize;
+
+	for (int fy = 0; fy < mFineLength; ++fy) {
+		for (int fx = 0; fx < mFineLength; ++fx) {
+			float z = -FLT_MAX;
+			for (int i = fx; i <= glm::min(fx + fine_per_region, mFineLength - 1); ++i) {
+				z = glm::max(z, fine[fy * mFineLength + i]);
+			}
+			temp[fy * mFineLength + fx] = z;
+		}
+	}
+
+	for (int fy = 0; fy < mFineLength; ++fy) {
+		for (int fx = 0; fx < mFineLength; ++fx) {
+			float z = -FLT_MAX;
+			for (int i = fy; i <= glm::min(fy + fine_per_region, mFineLength - 1); ++i) {
+				z = glm::max(z, temp[i * mFineLength + fx]);
+			}
+			windows[fy * mFineLength + fx] = z;
+		}
+	}
+}
+
+// the mesh is coarser the farther, rounded up to the next entry
+const float * PotentiallyVisibleSet::GetWindowErrors(float distance) const {
+	int index = glm::min((int)(distance / mFineSize) + 1, mNumViewLevels - 1);
+	return mWindowErrors + mViewLevels[index] * mFineLength * mFineLength;
+}
+
+// a sight line from p in the cell to q in the region is at p + t * (q - p) inside the region sized square
+// lerp(cell, region, t), at most lerp(cell top, region max, t) high. if the rendered terrain under the whole
+// square is higher, every sight line is blocked there
+bool PotentiallyVisibleSet::IsHidden(int cell, int region) const {
+	int ax = cell % mRegionLength;
+	int ay = cell / mRegionLength;
+	int dx = region % mRegionLength - ax;
+	int dy = region / mRegionLength - ay;
+
+	// the square moves at most one fine cell per step
+	int fine_per_region = mRegionSize / mFineSize;
+	int steps = glm::max(abs(dx), abs(dy)) * fine_per_region;
+
+	// farthest distances from a view position, the mesh is coarser the farther
+	float size = (float)mRegionSize;
+	float depth_sq = mCellDepths[cell] * mCellDepths[cell];
+	float ex = (float)abs(dx) * size + size;
+	float ey = (float)abs(dy) * size + size;
+
+	// the window at the region's first fine cell covers the region
+	int rx = (ax + dx) * fine_per_region;
+	int ry = (ay + dy) * fine_per_region;
+	float z0 = mCellTops[cell];
+	float z1 = mRegionMaxs[region] + GetWindowErrors(sqrtf(ex * ex + ey * ey + depth_sq))[ry * mFineLength + rx];
+
+	for (int i = 1; i < steps; ++i) {
+		// fine cell holding the square's corner, floor division exact for negative directions
+		int nx = dx * fine_per_region * i;
+		int ny = dy * fine_per_region * i;
+		int fx = ax * fine_per_region + (nx >= 0 ? nx / steps : -((steps - 1 - nx) / steps));
+		int fy = ay * fine_per_region + (ny >= 0 ? ny / steps : -((steps - 1 - ny) / steps));
+
+		float t = (float)i / steps;
+		float sx = ex * t + size * (1.0f - t);
+		float sy = ey * t + size * (1.0f - t);
+		int window = fy * mFineLength + fx;
+		float ground = mWindowMins[window] - GetWindowErrors(sqrtf(sx * sx + sy * sy + depth_sq))[window];
+
+		if (ground > z0 + (z1 - z0) * t) {
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,74 @@
+/*
+potentially visible set
+*/
+
+#pragma once
+
+class QuadCollapseMesh;
+
+// the height field is divided into 4^level regions, the quad tree nodes of one level. every region is also a
+// camera cell reaching from the ground up to its highest sample plus a clearance. a cell stores one bit per
+// region, clear only if the terrain hides the region from every point of the cell. above the cell top
+// nothing is culled
+class PotentiallyVisibleSet {
+public:
+
+	PotentiallyVisibleSet();
+	~PotentiallyVisibleSet();
+
+	// vertices: the samples mesh was built from, x and y on the grid. on all threads.
+	// the mesh bounds how far its surface leaves the samples, by level and place
+	bool						Bake(const QuadCollapseMesh &mesh, const vec3 *vertices, int level, float clearance);
+	bool						Save(const char *filename) const;
+	// mesh and vertices of the terrain it is used for, rejected if baked for other samples or LOD settings
+	bool						Load(const char *filename, const QuadCollapseMesh &mesh, const vec3 *vertices);
+
+	int							GetLevel() const;
+	int							GetCellCount() const;
+	float						GetVisibleRatio() const;	// of all cell and region pairs
+	int							FindCell(const vec3 &view_pos) const;	// -1 outside every cell
+	bool						IsVisible(int cell, int region) const;
+
+private:
+
+	struct pvs_header_s {
+		uint32_t				mMagic;
+		int32_t					mLength;		// height field
+		int32_t					mLevel;
+		float					mClearance;
+		float					mMaxError;		// LOD settings the surface error bounds came from
+		float					mActiveDistance;
+		uint64_t				mSampleHash;	// of the scaled heights
+	};
+
+	int							mLength;
+	int							mLevel;
+	int							mRegionLength;	// regions per edge
+	int							mRegionSize;	// samples per region edge
+	int							mRowBytes;		// bits of one cell
+	float						mClearance;
+	float						mMaxError;
+	float						mActiveDistance;
+	uint64_t					mSampleHash;
+	float *						mCellTops;		// highest view position of every cell
+	byte *						mBits;
+
+	// bake, height bounds of the terrain around the sight lines
+	int							mFineLength;	// a finer quad tree level, mFineSize samples per edge
+	int							mFineSize;
+	int							mNumLevels;
+	float *						mRegionMaxs;	// highest sample of every region
+	float *						mWindowMins;	// lowest sample of region sized windows starting in a fine cell
+	float *						mWindowErrors;	// per quad level, surface error bound of the same windows
+	float *						mCellDepths;	// largest height difference between a view position and the terrain
+	byte *						mViewLevels;	// coarsest quad level by distance, mFineSize apart
+	int							mNumViewLevels;
+
+	void						Reset();
+	static uint64_t				HashSamples(const vec3 *vertices, int length);
+	bool						Alloc(int length, int level);
+	void						WindowMax(const float *fine, float *temp, float *windows) const;
+	static void					BakeCell(void *context, int index);
+	const float *				GetWindowErrors(float distance) const;
+	bool						IsHidden(int cell, int region) const;
+};
@@ -5,18 +5,26 @@ precompiled head
 #pragma once
 
 #include "Shared.h"
+#include "FrameScheduler.h"
+#include "PerfStats.h"
 
 // rendering
+#include "TextureCache.h"
 #include "UniformBuffers.h"
+#include "MeshRingBuffer.h"
 #include "Skybox.h"
 #include "RenderTerrain.h"
 #include "RenderText.h"
 #include "Renderer.h"
+#include "Offscreen.h"
 
 // level of detail
+#include "OcclusionBuffer.h"
+#include "PotentiallyVisibleSet.h"
 #include "QuadCollapseMesh.h"
 #include "Terrain.h"
 
 // demonstration application
 #include "Config.h"
 #include "DemoApp.h"
+#include "Benchmark.h"
@@ -3,6 +3,7 @@ quad collapse mesh
 */
 
 #include "Precompiled.h"
+#include <algorithm>
 
 /*
 ================================================================================
@@ -11,6 +12,11 @@ constants
 */
 static const float	ACTIVE_SCALE = 16.0f;
 static const int	MAX_LENGTH = 4097;
+static const int	PREFETCH_DISTANCE = 8;	// nodes ahead in the traversal
+static const int	MIN_REFINE_CHANGES = 16;	// per frame, the time budget never stalls refinement
+static const int	INITIAL_REFINE_CHANGES = 256;	// time budget only, adapted every frame
+static const int	MAX_REFINE_CHANGES = 1 << 20;
+static const uint32_t	VERT_FRAME_MASK = (1 << 23) - 1;	// vert_node_s::mActiveFrame
 
 /*
 ================================================================================
@@ -29,17 +35,19 @@ enum node_state_t {
 
 struct vert_node_s {
 	struct {
-		uint32_t				mActiveFrame : 24;
+		uint32_t				mActiveFrame : 23;
+		uint32_t				mSplit : 1;		// children refined, persists across frames
 		uint32_t				mState : 1;
 		uint32_t				mLevel : 4;
 		uint32_t				mAdjcentQuadsCount : 3;
 	};
+	uint32_t					mResolvedFrame;		// frame mResolvedIndex belongs to
 	const vec3 *				mOriginalPos;
-	float						mInterpolationFactor;	// position interpolation
+	int32_t						mResolvedIndex;		// nearest active ancestor in vert node pool, -1 if none
 	vec3						mInterpolatedPos;
 	vert_node_s *				mParent;
-	vert_node_s *				mFirstChild;
-	vert_node_s *				mNextSibling;
+	int32_t						mChildrenBegin;		// first index in children pool
+	int32_t						mChildrenCount;
 	struct quad_node_s *		mAdjcentQuads[4];
 
 	void						AddChild(vert_node_s *child);
@@ -57,21 +65,14 @@ void vert_node_s::AddChild(vert_node_s *child) {
 		return;
 	}
 
-	child->mParent = this;
-
-	if (child->mNextSibling) {
+	if (child->mParent) {
 		//ASSERT(false);
 		return;
 	}
 
-	if (mFirstChild) {
-		// head insert
-		child->mNextSibling = mFirstChild;
-		mFirstChild = child;
-	}
-	else {
-		mFirstChild = child;
-	}
+	// children are gathered into the contiguous children pool after build
+	child->mParent = this;
+	mChildrenCount++;
 }
 
 void vert_node_s::AddAdjcentQuad(struct quad_node_s * quad_node) {
@@ -88,14 +89,7 @@ void vert_node_s::AddAdjcentQuad(struct quad_node_s * quad_node) {
 }
 
 bool vert_node_s::HasChild(vert_node_s * test_node) const {
-	vert_node_s * child = mFirstChild;
-	while (child) {
-		if (child == test_node) {
-			return true;
-		}
-		child = child->mNextSibling;
-	}
-	return false;
+	return test_node->mParent == this;
 }
 
 struct quad_node_s {
@@ -139,17 +133,43 @@ struct quad_leaf_s {
 
 QuadCollapseMesh::QuadCollapseMesh():
 	mUpdateFrame(0),
+	mRefineFrame(0),
+	mRefined(false),
+	mFrustumCulling(true),
+	mRefineMaxChanges(0),
+	mRefineMaxTime(0.0f),
+	mRefineAllowance(0),
+	mRefineBudgeted(false),
+	mSplitsValid(false),
+	mRefinePending(false),
+	mPredictHorizon(0.0f),
+	mPredictDelta(0.0f),
+	mPredictInvLengthSq(0.0f),
+	mOcclusion(nullptr),
+	mOcclusionWidth(0),
+	mPvs(nullptr),
+	mPvsCell(-1),
 	mOriginalPosRef(nullptr),
 	mMaxLevel(0),
 	mMaxLevelVerticesLength(0),
 	mVertNodePool(nullptr),
 	mQuadNodePool(nullptr),
 	mQuadLeafPool(nullptr),
+	mVertChildrenPool(nullptr),
 	mVertNodePoolSize(0),
 	mQuadNodePoolSize(0),
 	mQuadLeafPoolSize(0),
 	mQuadNodePoolAllocated(0),
 	mQuadLeafPoolAllocated(0),
+	mVertexFormat(VF_FLOAT3),
+	mPackedVerts(nullptr),
+	mVertErrors(nullptr),
+	mMaxError(0.0f),
+	mChunkLevel(0),
+	mNumChunks(0),
+	mChunks(nullptr),
+	mChunkOffsets(nullptr),
+	mWritePos(nullptr),
 	mRootQuadnode(nullptr)
 {
 	memset(mVertNodesActiveDistance, 0, sizeof(mVertNodesActiveDistance));
@@ -159,6 +179,36 @@ QuadCollapseMesh::QuadCollapseMesh():
 }
 
 QuadCollapseMesh::~QuadCollapseMesh() {
+	if (mOcclusion) {
+		delete mOcclusion;
+		mOcclusion = nullptr;
+	}
+
+	if (mChunkOffsets) {
+		free(mChunkOffsets);
+		mChunkOffsets = nullptr;
+	}
+
+	if (mChunks) {
+		free(mChunks);
+		mChunks = nullptr;
+	}
+
+	if (mPackedVerts) {
+		free(mPackedVerts);
+		mPackedVerts = nullptr;
+	}
+
+	if (mVertErrors) {
+		free(mVertErrors);
+		mVertErrors = nullptr;
+	}
+
+	if (mVertChildrenPool) {
+		free(mVertChildrenPool);
+		mVertChildrenPool = nullptr;
+	}
+
 	if (mQuadLeafPool) {
 		free(mQuadLeafPool);
 		mQuadLeafPool = nullptr;
@@ -209,6 +259,15 @@ bool QuadCollapseMesh::Build(const vec3 *vertices, int width, int height) {
 	}
 
 	mMaxLevel = level_count - 1; // level range: 0 ~ mMaxLevel
+	mQuantization.Setup(vertices, width * height);
+
+	if (mChunkLevel > 0) {
+		mChunkLevel = min(mChunkLevel, (int)mMaxLevel);
+		mNumChunks = (1 << (mChunkLevel * 2)) + 1;
+		mChunks = (mesh_chunk_s*)malloc(sizeof(mesh_chunk_s) * mNumChunks);
+		mChunkOffsets = (int32_t*)malloc(sizeof(int32_t) * (mNumChunks + 1));
+		memset((void*)mChunks, 0, sizeof(mesh_chunk_s) * mNumChunks);
+	}
 	mVertNodePoolSize = 0;
 
 	int quad_count_per_edge = 1;
@@ -249,9 +308,80 @@ bool QuadCollapseMesh::Build(const vec3 *vertices, int width, int height) {
 	mQuadLeafPoolAllocated = 0;
 
 	BuildVertNodes();
-	mRootQuadnode = RecursiveBuildQuadNodes(0, 0, 0, mMaxLevelVerticesLength - 1);
 
-	return true;
+	int32_t root_step = mMaxLevelVerticesLength - 1;
+	if (root_step == 1) {
+		quad_leaf_s * root_leaf = AllocQuadLeaves(1);
+		InitQuadLeaf(root_leaf, 0, 0, 0);
+		mRootQuadnode = (quad_node_s*)root_leaf;
+	}
+	else {
+		mRootQuadnode = AllocQuadNodes(1);
+		RecursiveBuildQuadNode(mRootQuadnode, 0, 0, 0, root_step);
+	}
+
+	BuildVertChildren();
+	BuildVertErrors();
+
+	return BuildPackedVerts();
+}
+
+void QuadCollapseMesh::SetVertexFormat(vertex_format_t format) {
+	mVertexFormat = format;
+}
+
+void QuadCollapseMesh::SetFrustumCulling(bool enable) {
+	mFrustumCulling = enable;
+	mRefined = false;
+}
+
+void QuadCollapseMesh::SetRefineBudget(int max_changes, float max_ms) {
+	mRefineMaxChanges = glm::max(max_changes, 0);
+	mRefineMaxTime = glm::max(max_ms, 0.0f);
+	mRefineAllowance = mRefineMaxChanges ? mRefineMaxChanges : (mRefineMaxTime > 0.0f ? INITIAL_REFINE_CHANGES : MAX_REFINE_CHANGES);
+
+	// nodes that left the tree during full refinement keep stale flags
+	for (int i = 0; i < mVertNodePoolSize; ++i) {
+		mVertNodePool[i].mSplit = 0;
+	}
+
+	mSplitsValid = false;
+	mRefinePending = false;
+	mRefined = false;
+}
+
+void QuadCollapseMesh::SetOcclusionCulling(int width) {
+	mOcclusionWidth = glm::max(width, 0);
+
+	if (mOcclusionWidth && !mOcclusion) {
+		mOcclusion = NEW__ OcclusionBuffer();
+	}
+	else if (!mOcclusionWidth && mOcclusion) {
+		delete mOcclusion;
+		mOcclusion = nullptr;
+	}
+}
+
+void QuadCollapseMesh::SetVisibilitySet(const PotentiallyVisibleSet *pvs) {
+	mPvs = pvs;
+}
+
+void QuadCollapseMesh::SetMaxError(float max_error) {
+	mMaxError = glm::max(max_error, 0.0f);
+	mRefined = false;
+}
+
+void QuadCollapseMesh::SetPredictionHorizon(float seconds) {
+	mPredictHorizon = glm::max(seconds, 0.0f);
+	mRefined = false;
+}
+
+bool QuadCollapseMesh::IsRefinePending() const {
+	return mRefinePending;
+}
+
+void QuadCollapseMesh::SetChunkLevel(int level) {
+	mChunkLevel = glm::clamp(level, 0, MAX_CHUNK_LEVEL);
 }
 
 void QuadCollapseMesh::BuildVertNodes() {
@@ -267,12 +397,13 @@ void QuadCollapseMesh::BuildVertNodes() {
 				vert_node->mState = 0;
 				vert_node->mLevel = level;
 				vert_node->mAdjcentQuadsCount = 0;
+				vert_node->mResolvedFrame = 0;
 				vert_node->mOriginalPos = mOriginalPosRef + y * mMaxLevelVerticesLength + x;
-				vert_node->mInterpolationFactor = 1.0f;
+				vert_node->mResolvedIndex = -1;
 				vert_node->mInterpolatedPos = *vert_node->mOriginalPos;
 				vert_node->mParent = nullptr;
-				vert_node->mFirstChild = nullptr;
-				vert_node->mNextSibling = nullptr;
+				vert_node->mChildrenBegin = 0;
+				vert_node->mChildrenCount = 0;
 				memset(vert_node->mAdjcentQuads, 0, sizeof(vert_node->mAdjcentQuads));
 			}
 		}
@@ -287,64 +418,171 @@ void QuadCollapseMesh::BuildVertNodes() {
 	mRootVertnodes[3] = GetVertNode(0, 0, mMaxLevelVerticesLength - 1, false);
 }
 
-quad_node_s * QuadCollapseMesh::RecursiveBuildQuadNodes(uint32_t level, int32_t x0, int32_t y0, int32_t step) {
-	if (step == 1) { // leaf
-		quad_leaf_s * result = AllocQuadLeaf();
-
-		result->mActiveFrame = 0;
-		result->mState = 0;
-		result->mLevel = level;
-		result->mTriangleMode = TM_NW_SE;
-		result->mParent = nullptr;
-		result->mCornerVertNodes[0] = GetVertNode(level, x0, y0, false);
-		result->mCornerVertNodes[1] = GetVertNode(level, x0 + step, y0, false);
-		result->mCornerVertNodes[2] = GetVertNode(level, x0 + step, y0 + step, false);
-		result->mCornerVertNodes[3] = GetVertNode(level, x0, y0 + step, false);
-
-		for (int32_t i = 0; i < 4; ++i) {
-			vert_node_s * corner_vert_nodes = result->mCornerVertNodes[i];
-			if (corner_vert_nodes->mLevel == level) {
-				corner_vert_nodes->AddAdjcentQuad((quad_node_s*)result);
-			}
+void QuadCollapseMesh::InitQuadLeaf(quad_leaf_s *quad_leaf, uint32_t level, int32_t x0, int32_t y0) {
+	quad_leaf->mActiveFrame = 0;
+	quad_leaf->mState = 0;
+	quad_leaf->mLevel = level;
+	quad_leaf->mTriangleMode = TM_NW_SE;
+	quad_leaf->mParent = nullptr;
+	quad_leaf->mCornerVertNodes[0] = GetVertNode(level, x0, y0, false);
+	quad_leaf->mCornerVertNodes[1] = GetVertNode(level, x0 + 1, y0, false);
+	quad_leaf->mCornerVertNodes[2] = GetVertNode(level, x0 + 1, y0 + 1, false);
+	quad_leaf->mCornerVertNodes[3] = GetVertNode(level, x0, y0 + 1, false);
+
+	for (int32_t i = 0; i < 4; ++i) {
+		vert_node_s * corner_vert_nodes = quad_leaf->mCornerVertNodes[i];
+		if (corner_vert_nodes->mLevel == level) {
+			corner_vert_nodes->AddAdjcentQuad((quad_node_s*)quad_leaf);
 		}
+	}
+}
 
-		return (quad_node_s*)result;
+void QuadCollapseMesh::RecursiveBuildQuadNode(quad_node_s *quad_node, uint32_t level, int32_t x0, int32_t y0, int32_t step) {
+	quad_node->mActiveFrame = 0;
+	quad_node->mState = 0;
+	quad_node->mLevel = level;
+	quad_node->mParent = nullptr;
+
+	int half_step = step >> 1;
+	quad_node->mCenterVertNode = GetVertNode(level + 1, x0 + half_step, y0 + half_step, false);
+	quad_node->mCornerVertNodes[0] = GetVertNode(level, x0, y0, false);
+	quad_node->mCornerVertNodes[1] = GetVertNode(level, x0 + step, y0, false);
+	quad_node->mCornerVertNodes[2] = GetVertNode(level, x0 + step, y0 + step, false);
+	quad_node->mCornerVertNodes[3] = GetVertNode(level, x0, y0 + step, false);
+
+	for (int i = 0; i < 4; ++i) {
+		vert_node_s * corner_vert_nodes = quad_node->mCornerVertNodes[i];
+		corner_vert_nodes->AddAdjcentQuad(quad_node);
 	}
-	else {
-		quad_node_s * result = AllocQuadNode();
 
-		result->mActiveFrame = 0;
-		result->mState = 0;
-		result->mLevel = level;
-		result->mParent = nullptr;
+	uint32_t next_level = level + 1;
 
-		int half_step = step >> 1;
-		result->mCenterVertNode = GetVertNode(level + 1, x0 + half_step, y0 + half_step, false);
-		result->mCornerVertNodes[0] = GetVertNode(level, x0, y0, false);
-		result->mCornerVertNodes[1] = GetVertNode(level, x0 + step, y0, false);
-		result->mCornerVertNodes[2] = GetVertNode(level, x0 + step, y0 + step, false);
-		result->mCornerVertNodes[3] = GetVertNode(level, x0, y0 + step, false);
+	int32_t child_x0[4] = { x0, x0 + half_step, x0 + half_step, x0 };
+	int32_t child_y0[4] = { y0, y0, y0 + half_step, y0 + half_step };
 
+	// the four children are allocated side by side, traversal walks siblings in one memory range
+	if (half_step == 1) { // leaf
+		quad_leaf_s * children = AllocQuadLeaves(4);
 		for (int i = 0; i < 4; ++i) {
-			vert_node_s * corner_vert_nodes = result->mCornerVertNodes[i];
-			corner_vert_nodes->AddAdjcentQuad(result);
+			InitQuadLeaf(children + i, next_level, child_x0[i], child_y0[i]);
+			quad_node->mChildren[i] = (quad_node_s*)(children + i);
+		}
+	}
+	else {
+		quad_node_s * children = AllocQuadNodes(4);
+		for (int i = 0; i < 4; ++i) {
+			quad_node->mChildren[i] = children + i;
 		}
 
-		uint32_t next_level = level + 1;
+		for (int i = 0; i < 4; ++i) {
+			RecursiveBuildQuadNode(children + i, next_level, child_x0[i], child_y0[i], half_step);
+		}
+	}
 
-		result->mChildren[0] = RecursiveBuildQuadNodes(next_level, x0, y0, half_step);
-		result->mChildren[1] = RecursiveBuildQuadNodes(next_level, x0 + half_step, y0, half_step);
-		result->mChildren[2] = RecursiveBuildQuadNodes(next_level, x0 + half_step, y0 + half_step, half_step);
-		result->mChildren[3] = RecursiveBuildQuadNodes(next_level, x0, y0 + half_step, half_step);
+	for (int i = 0; i < 4; ++i) {
+		quad_node->mChildren[i]->mParent = quad_node;
+	}
 
-		for (int i = 0; i < 4; ++i) {
-			result->mChildren[i]->mParent = result;
+	CollapseQuad(quad_node, x0, y0, step);
+}
+
+void QuadCollapseMesh::BuildVertChildren() {
+	// prefix sum of children count, then scatter every node into its parent's range
+	int32_t children_count = 0;
+	for (int i = 0; i < mVertNodePoolSize; ++i) {
+		vert_node_s * vert_node = mVertNodePool + i;
+		vert_node->mChildrenBegin = children_count;
+		children_count += vert_node->mChildrenCount;
+		vert_node->mChildrenCount = 0;
+	}
+
+	mVertChildrenPool = (int32_t*)malloc(sizeof(int32_t) * max(children_count, 1));
+
+	for (int i = 0; i < mVertNodePoolSize; ++i) {
+		vert_node_s * p = mVertNodePool[i].mParent;
+		if (p) {
+			mVertChildrenPool[p->mChildrenBegin + p->mChildrenCount++] = i;
 		}
+	}
+}
 
-		CollapseQuad(result, x0, y0, step);
+// height of a vert node above or below the parent level quad edge or diagonal it collapses onto
+static void SetCollapseError(float *errors, const vert_node_s *vert_node_pool, const vert_node_s *vert_node, const vert_node_s *a, const vert_node_s *b) {
+	errors[vert_node - vert_node_pool] = fabsf(vert_node->mOriginalPos->z - (a->mOriginalPos->z + b->mOriginalPos->z) * 0.5f);
+}
 
-		return result;
+void QuadCollapseMesh::BuildVertErrors() {
+	float * own_errors = (float*)malloc(sizeof(float) * mVertNodePoolSize);
+	mVertErrors = (float*)malloc(sizeof(float) * mVertNodePoolSize);
+
+	memset(own_errors, 0, sizeof(float) * mVertNodePoolSize); // children at the parent position
+	memset(mVertErrors, 0, sizeof(float) * mVertNodePoolSize);
+
+	// every quad node is split, leaves are not in the quad node pool
+	for (int i = 0; i < mQuadNodePoolAllocated; ++i) {
+		const quad_node_s * quad_node = mQuadNodePool + i;
+		vert_node_s * const * corners = quad_node->mCornerVertNodes;
+
+		SetCollapseError(own_errors, mVertNodePool, quad_node->mChildren[0]->mCornerVertNodes[1], corners[0], corners[1]);
+		SetCollapseError(own_errors, mVertNodePool, quad_node->mChildren[1]->mCornerVertNodes[2], corners[1], corners[2]);
+		SetCollapseError(own_errors, mVertNodePool, quad_node->mChildren[2]->mCornerVertNodes[3], corners[2], corners[3]);
+		SetCollapseError(own_errors, mVertNodePool, quad_node->mChildren[3]->mCornerVertNodes[0], corners[3], corners[0]);
+
+		if (quad_node->mTriangulationMode == TM_SW_NE) {
+			SetCollapseError(own_errors, mVertNodePool, quad_node->mCenterVertNode, corners[0], corners[2]);
+		}
+		else {
+			SetCollapseError(own_errors, mVertNodePool, quad_node->mCenterVertNode, corners[1], corners[3]);
+		}
 	}
+
+	// children are in later levels of the pool, so a backward pass finishes every subtree before its parent.
+	// the surfaces of consecutive levels differ by at most the own errors, the subtree error adds them up
+	for (int i = mVertNodePoolSize - 1; i >= 0; --i) {
+		const vert_node_s * p = mVertNodePool[i].mParent;
+		if (p) {
+			float & error = mVertErrors[p - mVertNodePool];
+			error = glm::max(error, own_errors[i] + mVertErrors[i]);
+		}
+	}
+
+	free(own_errors);
+}
+
+bool QuadCollapseMesh::BuildPackedVerts() {
+	mPackedVerts = (uint32_t*)malloc(sizeof(uint32_t) * mVertNodePoolSize);
+
+	for (int i = 0; i < mVertNodePoolSize; ++i) {
+		const vert_node_s * vert_node = mVertNodePool + i;
+
+		int32_t index = (int32_t)(vert_node->mOriginalPos - mOriginalPosRef);
+		int32_t x = index % mMaxLevelVerticesLength;
+		int32_t y = index / mMaxLevelVerticesLength;
+		int32_t dx = 0;
+		int32_t dy = 0;
+
+		if (vert_node->mParent && vert_node->mParent->mOriginalPos != vert_node->mOriginalPos) {
+			int32_t parent_index = (int32_t)(vert_node->mParent->mOriginalPos - mOriginalPosRef);
+			int32_t step = (mMaxLevelVerticesLength - 1) >> vert_node->mLevel;
+
+			dx = parent_index % mMaxLevelVerticesLength - x;
+			dy = parent_index / mMaxLevelVerticesLength - y;
+
+			// the shader derives the level from the lowest set bit of x | y
+			uint32_t xy = (uint32_t)(x | y);
+			if (abs(dx) > step || abs(dy) > step || (dx % step) || (dy % step) || (xy & (0u - xy)) != (uint32_t)step) {
+				SYS_ERROR("vert node parent can not be packed\n");
+				return false;
+			}
+
+			dx /= step;
+			dy /= step;
+		}
+
+		mPackedVerts[i] = PackGridVertex(x, y, dx, dy);
+	}
+
+	return true;
 }
 
 void QuadCollapseMesh::CollapseQuad(quad_node_s *quad_node, int32_t x0, int32_t y0, int32_t step) {
@@ -570,28 +808,226 @@ void QuadCollapseMesh::CollapseQuad(quad_node_s *quad_node, int32_t x0, int32_t
 	}
 }
 
-void QuadCollapseMesh::Update(const camera_s &cam, const frustum_plane_s &fp) {
+void QuadCollapseMesh::Update(const camera_s &cam, const frustum_plane_s &fp, MeshSink *sink) {
+	mStats = lod_stats_s();
+
+	// refinement depends on the view position and its predicted path only, a rotation changes culling alone
+	vec3 predict_delta = cam.mVelocity * mPredictHorizon;
+	bool refine = !mRefined || cam.mPos != mRefinePos || predict_delta != mPredictDelta || mRefinePending;
+
+	if (!refine && !mFrustumCulling && !mOcclusion && !sink) {
+		mStats.mReusedRefinement = 1;
+		return; // nothing is view direction dependent, last mesh still valid
+	}
+
+	if (refine) {
+		float length_sq = dot(predict_delta, predict_delta);
+		mPredictDelta = predict_delta;
+		mPredictInvLengthSq = length_sq > 0.0f ? 1.0f / length_sq : 0.0f;
+
+		mRefineFrame = (mRefineFrame + 1) & VERT_FRAME_MASK;
+		if (!mRefineFrame) {
+			// wrapped, stamps of untouched nodes would match the new frames again
+			for (int i = 0; i < mVertNodePoolSize; ++i) {
+				mVertNodePool[i].mActiveFrame = 0;
+				mVertNodePool[i].mResolvedFrame = 0;
+			}
+			mRefineFrame = 1;
+		}
+		UpdateVertNodes(cam.mPos);
+		mRefinePos = cam.mPos;
+		mRefined = true;
+	}
+	else {
+		mStats.mReusedRefinement = 1;
+	}
+
+	mPvsCell = mPvs ? mPvs->FindCell(cam.mPos) : -1;
+
 	mUpdateFrame++;
+	MarkBoundaryQuads(fp);
+	CollectActiveQuads();
 
-	for (int i = 0; i < 4; ++i) {
-		mRootVertnodes[i]->mInterpolatedPos = *(mRootVertnodes[i]->mOriginalPos);
-		RecursiveUpdateVertNode(cam.mPos, fp, mRootVertnodes[i]);
+	if (mOcclusion) {
+		CullOccludedQuads(fp);
+	}
+
+	if (mNumChunks) {
+		SortActiveQuadsByChunk();
+	}
+
+	// every quad emits at most two triangles
+	int max_vertices = mActiveQuads.GetCount() * 6;
+	int vertex_size = VertexFormat_GetSize(mVertexFormat);
+	byte * dest = nullptr;
+
+	if (sink) {
+		dest = (byte*)sink->BeginMesh(max_vertices, vertex_size);
+		if (!dest) {
+			sink = nullptr; // out of space, this frame is assembled here and uploaded
+		}
+	}
+
+	if (!sink) {
+		mActiveVertices.Reserve(max_vertices * vertex_size);
+		dest = mActiveVertices.GetItems();
+	}
+
+	// hashing reads the vertices back, never from a sink's write-combined memory
+	int num_vertices = dest ? EmitActiveQuads(dest, !sink) : 0;
+
+	if (sink) {
+		sink->EndMesh(num_vertices);
+		mActiveMesh.mVertices = nullptr; // already in sink
+	}
+	else {
+		mActiveVertices.SetCount(num_vertices * vertex_size);
+		mActiveMesh.mVertices = mActiveVertices.GetItems();
 	}
 
-	mActiveVertices.Reset();
-	RecursiveSetActiveMesh(mRootQuadnode);
-	mActiveMesh.mVertices = mActiveVertices.GetItems();
-	mActiveMesh.mNumTriangles = mActiveVertices.GetCount() / 3;
+	mActiveMesh.mVertexFormat = mVertexFormat;
+	mActiveMesh.mChunks = mChunks;
+	mActiveMesh.mNumChunks = dest ? mNumChunks : 0;
+	mActiveMesh.mNumTriangles = num_vertices / 3;
 }
 
 int QuadCollapseMesh::GetMaxLevelVerticesLength() const {
 	return mMaxLevelVerticesLength;
 }
 
+int QuadCollapseMesh::GetMaxLevel() const {
+	return (int)mMaxLevel;
+}
+
+float QuadCollapseMesh::GetMaxError() const {
+	return mMaxError;
+}
+
+const float * QuadCollapseMesh::GetActiveDistances() const {
+	return mVertNodesActiveDistance;
+}
+
+int QuadCollapseMesh::GetViewLevel(float distance) const {
+	// every vert node of a level within a quad diagonal of the point is split, the point is covered by the next level
+	int level = 0;
+	while (level < (int)mMaxLevel && distance + 2.0f * mQuadNodesCullRadius[level] < mVertNodesActiveDistance[level]) {
+		level++;
+	}
+
+	return level;
+}
+
+void QuadCollapseMesh::GetSurfaceErrors(int grid_length, float *errors) const {
+	int grid_size = grid_length * grid_length;
+	int cell_size = (mMaxLevelVerticesLength - 1) / grid_length;
+
+	// the quads of a level against the samples they cover, leaves hit every sample
+	memset(errors, 0, sizeof(float) * grid_size * (mMaxLevel + 1));
+
+	for (int i = 0; i < mQuadNodePoolAllocated; ++i) {
+		const quad_node_s * quad_node = mQuadNodePool + i;
+		const vec3 * p0 = quad_node->mCornerVertNodes[0]->mOriginalPos;
+		int32_t index = (int32_t)(p0 - mOriginalPosRef);
+		int32_t x0 = index % mMaxLevelVerticesLength;
+		int32_t y0 = index / mMaxLevelVerticesLength;
+		int32_t step = (int32_t)(quad_node->mCornerVertNodes[1]->mOriginalPos - p0);
+
+		float z0 = p0->z;
+		float z1 = quad_node->mCornerVertNodes[1]->mOriginalPos->z;
+		float z2 = quad_node->mCornerVertNodes[2]->mOriginalPos->z;
+		float z3 = quad_node->mCornerVertNodes[3]->mOriginalPos->z;
+		float * level_errors = errors + grid_size * quad_node->mLevel;
+
+		for (int32_t y = 0; y <= step; ++y) {
+			for (int32_t x = 0; x <= step; ++x) {
+				float u = (float)x / step;
+				float v = (float)y / step;
+				float z;
+
+				if (quad_node->mTriangulationMode == TM_SW_NE) {
+					z = u >= v ? z0 + u * (z1 - z0) + v * (z2 - z1) : z0 + u * (z2 - z3) + v * (z3 - z0);
+				}
+				else {
+					z = u + v <= 1.0f ? z0 + u * (z1 - z0) + v * (z3 - z0) : z2 + (1.0f - u) * (z3 - z2) + (1.0f - v) * (z1 - z2);
+				}
+
+				int32_t cx = glm::min((x0 + x) / cell_size, grid_length - 1);
+				int32_t cy = glm::min((y0 + y) / cell_size, grid_length - 1);
+				float & error = level_errors[cy * grid_length + cx];
+				error = glm::max(error, fabsf(z - p0[y * mMaxLevelVerticesLength + x].z));
+			}
+		}
+	}
+
+	// the mesh of a level or deeper is no farther off than its coarsest quads
+	for (int level = (int)mMaxLevel - 1; level >= 0; --level) {
+		for (int i = 0; i < grid_size; ++i) {
+			errors[level * grid_size + i] = glm::max(errors[level * grid_size + i], errors[(level + 1) * grid_size + i]);
+		}
+	}
+
+	// quads morph toward the parent level and corners resolve to coarser vert nodes, which moves their surface
+	// sideways as well: take the level above and spread it by one of its quads.
+	// flat vert nodes stay unsplit, but nothing below them deviates by more than the max error
+	float * row_errors = (float*)malloc(sizeof(float) * grid_size);
+
+	for (int level = (int)mMaxLevel; level >= 0; --level) {
+		const float * source = errors + grid_size * glm::max(level - 2, 0);
+		float * dest = errors + grid_size * level;
+		int quad_size = (mMaxLevelVerticesLength - 1) >> glm::max(level - 1, 0);
+		int reach = (quad_size + cell_size - 1) / cell_size;
+
+		for (int cy = 0; cy < grid_length; ++cy) {
+			for (int cx = 0; cx < grid_length; ++cx) {
+				float error = 0.0f;
+				for (int i = glm::max(cx - reach, 0); i <= glm::min(cx + reach, grid_length - 1); ++i) {
+					error = glm::max(error, source[cy * grid_length + i]);
+				}
+				row_errors[cy * grid_length + cx] = error;
+			}
+		}
+
+		for (int cy = 0; cy < grid_length; ++cy) {
+			for (int cx = 0; cx < grid_length; ++cx) {
+				float error = mMaxError;
+				for (int i = glm::max(cy - reach, 0); i <= glm::min(cy + reach, grid_length - 1); ++i) {
+					error = glm::max(error, row_errors[i * grid_length + cx]);
+				}
+				dest[cy * grid_length + cx] = error;
+			}
+		}
+	}
+
+	free(row_errors);
+}
+
+const vertex_quantization_s & QuadCollapseMesh::GetQuantization() const {
+	return mQuantization;
+}
+
+size_t QuadCollapseMesh::GetMemoryUsage() const {
+	return sizeof(vert_node_s) * mVertNodePoolSize
+		+ sizeof(quad_node_s) * mQuadNodePoolSize
+		+ sizeof(quad_leaf_s) * mQuadLeafPoolSize
+		+ sizeof(int32_t) * mVertNodePoolSize // children pool
+		+ sizeof(uint32_t) * mVertNodePoolSize // packed verts
+		+ sizeof(float) * mVertNodePoolSize // errors
+		+ mActiveVertices.GetCapacity()
+		+ sizeof(quad_node_s*) * mActiveQuads.GetCapacity()
+		+ (sizeof(mesh_chunk_s) + sizeof(int32_t)) * mNumChunks
+		+ sizeof(uint16_t) * mQuadChunks.GetCapacity()
+		+ sizeof(quad_node_s*) * mSortedQuads.GetCapacity()
+		+ (sizeof(vec3) * 6 + 1) * (mOcclusion ? mOccluderVertices.GetCapacity() / 6 : 0);
+}
+
 const triangle_mesh_s & QuadCollapseMesh::GetActiveMesh() const {
 	return mActiveMesh;
 }
 
+const lod_stats_s & QuadCollapseMesh::GetStats() const {
+	return mStats;
+}
+
 vert_node_s * QuadCollapseMesh::GetVertNode(uint32_t level, int32_t x, int32_t y, bool init_mode) {
 	vert_node_s * level_vert_node = mVertNodePool + mVertNodesLevelOffset[level];
 
@@ -612,105 +1048,273 @@ vert_node_s * QuadCollapseMesh::GetVertNode(uint32_t level, int32_t x, int32_t y
 	return result;
 }
 
-quad_node_s * QuadCollapseMesh::AllocQuadNode() {
-	if (mQuadNodePoolAllocated >= mQuadNodePoolSize) {
+quad_node_s * QuadCollapseMesh::AllocQuadNodes(int count) {
+	if (mQuadNodePoolAllocated + count > mQuadNodePoolSize) {
 		SYS_ERROR("quad node pool overflow\n");
 		return nullptr;
 	}
 	else {
-		return mQuadNodePool + mQuadNodePoolAllocated++;
+		quad_node_s * result = mQuadNodePool + mQuadNodePoolAllocated;
+		mQuadNodePoolAllocated += count;
+		return result;
 	}
 }
 
-quad_leaf_s * QuadCollapseMesh::AllocQuadLeaf() {
-	if (mQuadLeafPoolAllocated >= mQuadLeafPoolSize) {
+quad_leaf_s * QuadCollapseMesh::AllocQuadLeaves(int count) {
+	if (mQuadLeafPoolAllocated + count > mQuadLeafPoolSize) {
 		SYS_ERROR("quad leaf pool overflow\n");
 		return nullptr;
 	}
 	else {
-		return mQuadLeafPool + mQuadLeafPoolAllocated++;
+		quad_leaf_s * result = mQuadLeafPool + mQuadLeafPoolAllocated;
+		mQuadLeafPoolAllocated += count;
+		return result;
+	}
+}
+
+void QuadCollapseMesh::UpdateVertNodes(const vec3 &view_pos) {
+	vert_node_array_t * frontier = &mVertFrontier[0];
+	vert_node_array_t * next_level = &mVertFrontier[1];
+
+	// the first budgeted frame refines fully to seed the split flags
+	bool budget = mRefineMaxChanges || mRefineMaxTime > 0.0f;
+	mRefineBudgeted = budget && mSplitsValid;
+	mRefineCandidates.Reset();
+	double start = Sys_GetRelativeTime();
+
+	mBoundaryQuads.Reset();
+
+	frontier->Reset();
+	for (int i = 0; i < 4; ++i) {
+		mRootVertnodes[i]->mInterpolatedPos = *(mRootVertnodes[i]->mOriginalPos);
+		frontier->Add(mRootVertnodes[i]);
+	}
+
+	// breadth first, one level per pass over a contiguous frontier
+	while (frontier->GetCount()) {
+		next_level->Reset();
+
+		vert_node_s ** nodes = frontier->GetItems();
+		int count = frontier->GetCount();
+
+		for (int i = 0; i < count; ++i) {
+			if (i + PREFETCH_DISTANCE < count) {
+				PREFETCH(nodes[i + PREFETCH_DISTANCE]);
+			}
+
+			if (i + PREFETCH_DISTANCE / 2 < count) {
+				PREFETCH(nodes[i + PREFETCH_DISTANCE / 2]->mOriginalPos);
+			}
+
+			UpdateVertNode(view_pos, nodes[i], *next_level);
+		}
+
+		vert_node_array_t * temp = frontier;
+		frontier = next_level;
+		next_level = temp;
 	}
+
+	if (mRefineBudgeted) {
+		ApplyRefineCandidates();
+
+		// fewer changes next frame while over the deadline, newly refined nodes are cold in cache
+		if (mRefineMaxTime > 0.0f) {
+			float ms = (float)((Sys_GetRelativeTime() - start) * 1000.0);
+			int limit = mRefineMaxChanges ? mRefineMaxChanges : MAX_REFINE_CHANGES;
+
+			if (ms > mRefineMaxTime) {
+				mRefineAllowance = glm::max(mRefineAllowance / 2, MIN_REFINE_CHANGES);
+			}
+			else {
+				mRefineAllowance = glm::min(mRefineAllowance + glm::max(mRefineAllowance / 8, MIN_REFINE_CHANGES), limit);
+			}
+		}
+	}
+
+	if (!mRefineBudgeted) {
+		mRefinePending = false;
+	}
+
+	mSplitsValid = budget;
 }
 
-void QuadCollapseMesh::RecursiveUpdateVertNode(const vec3 &view_pos, const frustum_plane_s &fp, vert_node_s * vert_node) {
-	if (vert_node->mActiveFrame == mUpdateFrame) {
+void QuadCollapseMesh::UpdateVertNode(const vec3 &view_pos, vert_node_s * vert_node, vert_node_array_t &next_level) {
+	if (vert_node->mActiveFrame == mRefineFrame) {
 		return;
 	}
 
-	vert_node->mActiveFrame = mUpdateFrame;
 	vert_node->mState = NS_BOUNDARY;
+	mStats.mVisitedVertNodes++;
 
 	vec3 delta = view_pos - *vert_node->mOriginalPos;
 	float dist = length(delta);
+	float active_distance = mVertNodesActiveDistance[vert_node->mLevel];
+	bool inside = dist < active_distance;
+
+	// split for the nearest point of the predicted path, the geomorph below still follows the view position
+	float refine_dist = dist;
+	if (mPredictInvLengthSq > 0.0f) {
+		float s = glm::clamp(dot(delta, -mPredictDelta) * mPredictInvLengthSq, 0.0f, 1.0f);
+		refine_dist = length(delta + s * mPredictDelta);
+	}
+	bool refine_inside = refine_dist < active_distance;
 
-	if (dist < mVertNodesActiveDistance[vert_node->mLevel]) {
-		if (vert_node->mFirstChild) {
-			vert_node->mState = NS_ACTIVE;
+	// nothing below this node deviates from its surface by more than the max error
+	if (refine_inside && vert_node->mChildrenCount && mVertErrors[vert_node - mVertNodePool] <= mMaxError) {
+		refine_inside = false;
+		mStats.mFlatVertNodes++;
+	}
 
-			vert_node_s * child = vert_node->mFirstChild;
-			while (child) {
-				if (child->mParent != vert_node) {
-					SYS_ERROR("child->mParent != vert_node\n");
-				}
-				RecursiveUpdateVertNode(view_pos, fp, child);
-				child = child->mNextSibling;
-			}
+	// budgeted: keep the previous split state, queue a change for ApplyRefineCandidates
+	bool split = mRefineBudgeted ? vert_node->mSplit : (refine_inside && vert_node->mChildrenCount);
+	vert_node->mSplit = split;
+
+	if (split) {
+		vert_node->mState = NS_ACTIVE;
+
+		const int32_t * children = mVertChildrenPool + vert_node->mChildrenBegin;
+		for (int32_t i = 0; i < vert_node->mChildrenCount; ++i) {
+			next_level.Add(mVertNodePool + children[i]);
 		}
-		else {
-			vert_node->mInterpolatedPos = *vert_node->mOriginalPos;
-			for (int32_t i = 0; i < (int32_t)vert_node->mAdjcentQuadsCount; ++i) {
-				QuadNodeSetBoundary(fp, vert_node->mAdjcentQuads[i]);
+
+		if (!inside) {
+			mStats.mPredictedSplits++;
+		}
+
+		// only budgeted, merge bottom up, the children morph onto this node meanwhile.
+		// merges rank after every split, they save work but do not add detail
+		if (!refine_inside) {
+			bool children_split = false;
+			for (int32_t i = 0; i < vert_node->mChildrenCount; ++i) {
+				children_split |= mVertNodePool[children[i]].mSplit != 0;
+			}
+
+			if (!children_split) {
+				AddRefineCandidate(vert_node, 2.0f - active_distance / refine_dist, false);
 			}
 		}
 	}
 	else {
-		if (vert_node->mParent) {
-			// interpolate
+		for (uint32_t i = 0; i < vert_node->mAdjcentQuadsCount; ++i) {
+			mBoundaryQuads.Add(vert_node->mAdjcentQuads[i]);
+		}
+
+		if (refine_inside && vert_node->mChildrenCount) { // only budgeted, nearest first
+			AddRefineCandidate(vert_node, refine_dist / active_distance, true);
+		}
+	}
+
+	if (inside || !vert_node->mParent) {
+		vert_node->mInterpolatedPos = *vert_node->mOriginalPos;
+	}
+	else {
+		// interpolate
 
-			// http://en.wikipedia.org/wiki/Line%E2%80%93sphere_intersection
+		// http://en.wikipedia.org/wiki/Line%E2%80%93sphere_intersection
 
-			// we need find interpolation factor t
-			// a ray from *(vertNode->mOriginalPos) to mCamera->mViewPos, intersection 
-			// vertNode->mParent active sphere
-			// d is the distance from *(vertNode->mOriginalPos) to vertNode->mParent active sphere surface
-			// dist is distance from mCamera->mViewPos to *(vertNode->mOriginalPos)
-			// when dist is d, t is 0, dist is mVertNodesActiveDistance[vertNode->mLevel] t is  1.
+		// we need find interpolation factor t
+		// a ray from *(vertNode->mOriginalPos) to mCamera->mViewPos, intersection 
+		// vertNode->mParent active sphere
+		// d is the distance from *(vertNode->mOriginalPos) to vertNode->mParent active sphere surface
+		// dist is distance from mCamera->mViewPos to *(vertNode->mOriginalPos)
+		// when dist is d, t is 0, dist is mVertNodesActiveDistance[vertNode->mLevel] t is  1.
 
-			vert_node_s * p = vert_node->mParent;
+		vert_node_s * p = vert_node->mParent;
 
-			vec3 o_minus_c = *vert_node->mOriginalPos - *p->mOriginalPos;
+		vec3 o_minus_c = *vert_node->mOriginalPos - *p->mOriginalPos;
 
-			vec3 l = view_pos - *vert_node->mOriginalPos;
-			l = normalize(l);
+		vec3 l = view_pos - *vert_node->mOriginalPos;
+		l = normalize(l);
 
-			float l_dot_o_minus_c = dot(l, o_minus_c);
+		float l_dot_o_minus_c = dot(l, o_minus_c);
 
-			float r = mVertNodesActiveDistance[vert_node->mLevel - 1];
+		float r = mVertNodesActiveDistance[vert_node->mLevel - 1];
 
-			float sqr_length = dot(o_minus_c, o_minus_c);
-			float temp = (l_dot_o_minus_c * l_dot_o_minus_c) - sqr_length + r * r;
+		float sqr_length = dot(o_minus_c, o_minus_c);
+		float temp = (l_dot_o_minus_c * l_dot_o_minus_c) - sqr_length + r * r;
 
+		// outside the parent's sphere only while split ahead of the camera or its merge is deferred, t is 0 there
+		float t = 0.0f;
+		if (temp > 0.0f) {
 			float d = -l_dot_o_minus_c + sqrtf(temp);
-			float t = (d - dist) / (d - mVertNodesActiveDistance[vert_node->mLevel]);
+			t = glm::clamp((d - dist) / (d - active_distance), 0.0f, 1.0f);
+		}
 
-			vec3 p_origin = *p->mOriginalPos;
-			vec3 c_origin = *vert_node->mOriginalPos;
+		// toward the parent's grid position like terrain_packed.vert, also when the parent was split ahead of the camera
+		vec3 p_origin = *p->mOriginalPos;
+		vec3 c_origin = *vert_node->mOriginalPos;
 
-			vert_node->mInterpolatedPos[0] = p_origin[0] + t * (c_origin[0] - p_origin[0]);
-			vert_node->mInterpolatedPos[1] = p_origin[1] + t * (c_origin[1] - p_origin[1]);
-			vert_node->mInterpolatedPos[2] = p_origin[2] + t * (c_origin[2] - p_origin[2]);
+		vert_node->mInterpolatedPos[0] = p_origin[0] + t * (c_origin[0] - p_origin[0]);
+		vert_node->mInterpolatedPos[1] = p_origin[1] + t * (c_origin[1] - p_origin[1]);
+		vert_node->mInterpolatedPos[2] = p_origin[2] + t * (c_origin[2] - p_origin[2]);
 
-			for (uint32_t i = 0; i < vert_node->mAdjcentQuadsCount; ++i) {
-				QuadNodeSetBoundary(fp, vert_node->mAdjcentQuads[i]);
-			}
+		if (t <= 0.0f) {
+			return; // left inactive, emitted as the ancestor it collapsed onto
 		}
-		else {
-			vert_node->mInterpolatedPos = *vert_node->mOriginalPos;
-			for (uint32_t i = 0; i < vert_node->mAdjcentQuadsCount; ++i) {
-				QuadNodeSetBoundary(fp, vert_node->mAdjcentQuads[i]);
-			}
+	}
+
+	vert_node->mActiveFrame = mRefineFrame;
+}
+
+static bool LessUrgent(const refine_candidate_s &a, const refine_candidate_s &b) {
+	return a.mPriority < b.mPriority;
+}
+
+void QuadCollapseMesh::AddRefineCandidate(vert_node_s *vert_node, float priority, bool split) {
+	mStats.mRefineDeferred++;
+
+	refine_candidate_s candidate;
+	candidate.mPriority = priority;
+	candidate.mVertIndex = (int32_t)(vert_node - mVertNodePool);
+	candidate.mSplit = split;
+
+	// keep the mRefineAllowance most urgent, the least urgent is on top of the heap
+	int count = mRefineCandidates.GetCount();
+	if (count < mRefineAllowance) {
+		mRefineCandidates.Add(candidate);
+		std::push_heap(mRefineCandidates.GetItems(), mRefineCandidates.GetItems() + count + 1, LessUrgent);
+	}
+	else if (count && priority < mRefineCandidates.GetItems()[0].mPriority) {
+		refine_candidate_s * items = mRefineCandidates.GetItems();
+		std::pop_heap(items, items + count, LessUrgent);
+		items[count - 1] = candidate;
+		std::push_heap(items, items + count, LessUrgent);
+	}
+}
+
+void QuadCollapseMesh::ApplyRefineCandidates() {
+	const refine_candidate_s * items = mRefineCandidates.GetItems();
+	int count = mRefineCandidates.GetCount();
+
+	// merges first, a split below a node merged in the same batch is dropped
+	for (int i = 0; i < count; ++i) {
+		if (!items[i].mSplit) {
+			mVertNodePool[items[i].mVertIndex].mSplit = 0;
+			mStats.mRefineChanges++;
 		}
 	}
+
+	for (int i = 0; i < count; ++i) {
+		vert_node_s * vert_node = mVertNodePool + items[i].mVertIndex;
+		if (items[i].mSplit && (!vert_node->mParent || vert_node->mParent->mSplit)) {
+			vert_node->mSplit = 1;
+			mStats.mRefineChanges++;
+		}
+	}
+
+	mStats.mRefineDeferred -= mStats.mRefineChanges;
+
+	// applied changes expose new candidates to the next walk
+	mRefinePending = mStats.mRefineChanges + mStats.mRefineDeferred > 0;
+}
+
+void QuadCollapseMesh::MarkBoundaryQuads(const frustum_plane_s &fp) {
+	quad_node_s * const * quads = mBoundaryQuads.GetItems();
+	int count = mBoundaryQuads.GetCount();
+
+	for (int i = 0; i < count; ++i) {
+		QuadNodeSetBoundary(fp, quads[i]);
+	}
 }
 
 void QuadCollapseMesh::QuadNodeSetBoundary(const frustum_plane_s &fp, quad_node_s *quad_node) {
@@ -718,7 +1322,7 @@ void QuadCollapseMesh::QuadNodeSetBoundary(const frustum_plane_s &fp, quad_node_
 		return; // already set
 	}
 
-	if (quad_node->mLevel < mMaxLevel && fp.CullHorizontalCircle(*(quad_node->mCenterVertNode->mOriginalPos), mQuadNodesCullRadius[quad_node->mLevel])) {
+	if (mFrustumCulling && quad_node->mLevel < mMaxLevel && fp.CullHorizontalCircle(*(quad_node->mCenterVertNode->mOriginalPos), mQuadNodesCullRadius[quad_node->mLevel])) {
 		return; // culled away
 	}
 
@@ -737,82 +1341,298 @@ void QuadCollapseMesh::QuadNodeSetBoundary(const frustum_plane_s &fp, quad_node_
 	}
 }
 
-void QuadCollapseMesh::RecursiveSetActiveMesh(quad_node_s *quad_node) {
-	if (!quad_node) {
-		return;
-	}
+void QuadCollapseMesh::CollectActiveQuads() {
+	mActiveQuads.Reset();
+	mQuadStack.Reset();
+	mQuadStack.Add(mRootQuadnode);
 
-	if (quad_node->mActiveFrame == mUpdateFrame) {
-		if (quad_node->mState == NS_BOUNDARY) {
+	while (mQuadStack.GetCount()) {
+		quad_node_s * quad_node = mQuadStack.Pop();
+		if (!quad_node) {
+			continue;
+		}
 
-			if (quad_node->mTriangulationMode == TM_SW_NE) {
-				AddActiveVertNode(quad_node->mCornerVertNodes[0]);
-				AddActiveVertNode(quad_node->mCornerVertNodes[1]);
-				AddActiveVertNode(quad_node->mCornerVertNodes[2]);
+		mStats.mVisitedQuadNodes++;
 
-				AddActiveVertNode(quad_node->mCornerVertNodes[0]);
-				AddActiveVertNode(quad_node->mCornerVertNodes[2]);
-				AddActiveVertNode(quad_node->mCornerVertNodes[3]);
-			}
-			else {
-				AddActiveVertNode(quad_node->mCornerVertNodes[0]);
-				AddActiveVertNode(quad_node->mCornerVertNodes[1]);
-				AddActiveVertNode(quad_node->mCornerVertNodes[3]);
+		// every descendant is in the same region, the whole subtree is hidden
+		if (mPvsCell >= 0 && (int)quad_node->mLevel >= mPvs->GetLevel()
+			&& !mPvs->IsVisible(mPvsCell, GetQuadCell(quad_node, mPvs->GetLevel()))) {
+			mStats.mPvsCulledQuads++;
+			continue;
+		}
 
-				AddActiveVertNode(quad_node->mCornerVertNodes[1]);
-				AddActiveVertNode(quad_node->mCornerVertNodes[2]);
-				AddActiveVertNode(quad_node->mCornerVertNodes[3]);
+		if (quad_node->mActiveFrame == mUpdateFrame) {
+			if (quad_node->mState == NS_BOUNDARY) {
+				mActiveQuads.Add(quad_node);
+			}
+			else { // NS_ACTIVE
+				// siblings are contiguous, push in reverse order to emit them in order
+				for (int32_t i = 3; i >= 0; --i) {
+					PREFETCH(quad_node->mChildren[i]);
+					mQuadStack.Add(quad_node->mChildren[i]);
+				}
 			}
 		}
-		else { // NS_ACTIVE
-			for (int32_t i = 0; i < 4; ++i) {
-				RecursiveSetActiveMesh(quad_node->mChildren[i]);
+		else { // not active, but a child of active quad
+			mActiveQuads.Add(quad_node);
+		}
+	}
+}
+
+void QuadCollapseMesh::CullOccludedQuads(const frustum_plane_s &fp) {
+	const quad_node_s ** quads = mActiveQuads.GetItems();
+	int count = mActiveQuads.GetCount();
+
+	// the triangles AddActiveQuad emits, at their morphed positions
+	mOccluderVertices.Reserve(count * 6);
+	mOccluderVertices.SetCount(count * 6);
+	vec3 * v = mOccluderVertices.GetItems();
+
+	static const int TRIANGLE_CORNERS[2][2][3] = {
+		{ { 0, 1, 3 }, { 1, 2, 3 } },	// TM_NW_SE
+		{ { 0, 1, 2 }, { 0, 2, 3 } }	// TM_SW_NE
+	};
+
+	for (int i = 0; i < count; ++i) {
+		vert_node_s * const * corners = quads[i]->mCornerVertNodes;
+		vert_node_s * resolved[4];
+
+		for (int k = 0; k < 4; ++k) {
+			resolved[k] = ResolveVertNode(corners[k]);
+		}
+
+		for (int t = 0; t < 2; ++t) {
+			const int * c = TRIANGLE_CORNERS[quads[i]->mTriangulationMode][t];
+
+			if (resolved[c[0]] && resolved[c[1]] && resolved[c[2]]) {
+				v[0] = resolved[c[0]]->mInterpolatedPos;
+				v[1] = resolved[c[1]]->mInterpolatedPos;
+				v[2] = resolved[c[2]]->mInterpolatedPos;
+			}
+			else {
+				// AddActiveTriangle drops it, it must not occlude. collapsed onto a resolved corner it covers
+				// no pixel and keeps the group bounds on the drawn triangle
+				int k = resolved[c[0]] ? c[0] : resolved[c[1]] ? c[1] : c[2];
+				v[0] = v[1] = v[2] = (resolved[k] ? resolved[k] : corners[k])->mInterpolatedPos;
 			}
+			v += 3;
 		}
 	}
-	else { // not active, but a child of active quad
-		if (quad_node->mTriangulationMode == TM_SW_NE) {
-			AddActiveVertNode(quad_node->mCornerVertNodes[0]);
-			AddActiveVertNode(quad_node->mCornerVertNodes[1]);
-			AddActiveVertNode(quad_node->mCornerVertNodes[2]);
 
-			AddActiveVertNode(quad_node->mCornerVertNodes[0]);
-			AddActiveVertNode(quad_node->mCornerVertNodes[2]);
-			AddActiveVertNode(quad_node->mCornerVertNodes[3]);
+	int height = glm::max((int)(mOcclusionWidth / fp.mAspect), 1);
+	mOcclusion->Begin(mOcclusionWidth, height, fp.mViewProj);
+	mOcclusion->RasterizeTriangles(mOccluderVertices.GetItems(), count * 2);
+
+	mQuadOccluded.Reserve(count);
+	byte * occluded = mQuadOccluded.GetItems();
+	mStats.mOccludedQuads = mOcclusion->CullGroups(6, occluded);
+	mStats.mOccluderTriangles = mOcclusion->GetRasterizedTriangles();
+
+	// keep the traversal order of the visible quads
+	int visible = 0;
+	for (int i = 0; i < count; ++i) {
+		if (!occluded[i]) {
+			quads[visible++] = quads[i];
 		}
-		else {
-			AddActiveVertNode(quad_node->mCornerVertNodes[0]);
-			AddActiveVertNode(quad_node->mCornerVertNodes[1]);
-			AddActiveVertNode(quad_node->mCornerVertNodes[3]);
+	}
+	mActiveQuads.SetCount(visible);
+}
+
+int QuadCollapseMesh::GetQuadCell(const quad_node_s *quad_node, int level) const {
+	// quad leaves share the corner layout, a quad center is inside exactly one cell
+	int32_t i0 = (int32_t)(quad_node->mCornerVertNodes[0]->mOriginalPos - mOriginalPosRef);
+	int32_t i2 = (int32_t)(quad_node->mCornerVertNodes[2]->mOriginalPos - mOriginalPosRef);
+	int32_t x = (i0 % mMaxLevelVerticesLength + i2 % mMaxLevelVerticesLength) >> 1;
+	int32_t y = (i0 / mMaxLevelVerticesLength + i2 / mMaxLevelVerticesLength) >> 1;
+	int32_t cell_size = (mMaxLevelVerticesLength - 1) >> level;
+
+	return (y / cell_size) * (1 << level) + x / cell_size;
+}
+
+int QuadCollapseMesh::GetQuadChunk(const quad_node_s *quad_node) const {
+	if ((int)quad_node->mLevel < mChunkLevel) {
+		return mNumChunks - 1;
+	}
+
+	return GetQuadCell(quad_node, mChunkLevel);
+}
 
-			AddActiveVertNode(quad_node->mCornerVertNodes[1]);
-			AddActiveVertNode(quad_node->mCornerVertNodes[2]);
-			AddActiveVertNode(quad_node->mCornerVertNodes[3]);
+void QuadCollapseMesh::SortActiveQuadsByChunk() {
+	const quad_node_s * const * quads = mActiveQuads.GetItems();
+	int count = mActiveQuads.GetCount();
+
+	mQuadChunks.Reserve(count);
+	mQuadChunks.SetCount(count);
+	mSortedQuads.Reserve(count);
+	mSortedQuads.SetCount(count);
+
+	uint16_t * quad_chunks = mQuadChunks.GetItems();
+	memset(mChunkOffsets, 0, sizeof(int32_t) * (mNumChunks + 1));
+
+	for (int i = 0; i < count; ++i) {
+		int chunk = GetQuadChunk(quads[i]);
+		quad_chunks[i] = (uint16_t)chunk;
+		mChunkOffsets[chunk + 1]++;
+	}
+
+	for (int i = 0; i < mNumChunks; ++i) {
+		mChunkOffsets[i + 1] += mChunkOffsets[i];
+	}
+
+	// stable, quads of a chunk keep their traversal order
+	const quad_node_s ** sorted = mSortedQuads.GetItems();
+	for (int i = 0; i < count; ++i) {
+		sorted[mChunkOffsets[quad_chunks[i]]++] = quads[i];
+	}
+
+	// shift back to chunk begin
+	for (int i = mNumChunks; i > 0; --i) {
+		mChunkOffsets[i] = mChunkOffsets[i - 1];
+	}
+	mChunkOffsets[0] = 0;
+}
+
+int QuadCollapseMesh::EmitActiveQuads(byte *dest, bool hash_chunks) {
+	mWritePos = dest;
+
+	int vertex_size = VertexFormat_GetSize(mVertexFormat);
+
+	if (!mNumChunks) {
+		EmitQuads(mActiveQuads.GetItems(), mActiveQuads.GetCount());
+		return (int)(mWritePos - dest) / vertex_size;
+	}
+
+	const quad_node_s * const * sorted = mSortedQuads.GetItems();
+
+	for (int i = 0; i < mNumChunks; ++i) {
+		byte * begin = mWritePos;
+		mChunkMins = vec3(FLT_MAX);
+		mChunkMaxs = vec3(-FLT_MAX);
+		EmitQuads(sorted + mChunkOffsets[i], mChunkOffsets[i + 1] - mChunkOffsets[i]);
+
+		mesh_chunk_s & chunk = mChunks[i];
+		chunk.mFirstVertex = (int)(begin - dest) / vertex_size;
+		chunk.mNumVertices = (int)(mWritePos - begin) / vertex_size;
+		chunk.mHash = hash_chunks ? HashFNV1a(begin, mWritePos - begin) : 0;
+		chunk.mMins = mChunkMins;
+		chunk.mMaxs = mChunkMaxs;
+	}
+
+	return (int)(mWritePos - dest) / vertex_size;
+}
+
+void QuadCollapseMesh::EmitQuads(const quad_node_s * const *quads, int count) {
+	for (int i = 0; i < count; ++i) {
+		if (i + PREFETCH_DISTANCE < count) {
+			PREFETCH(quads[i + PREFETCH_DISTANCE]);
 		}
+
+		AddActiveQuad(quads[i]);
 	}
 }
 
-void QuadCollapseMesh::AddActiveVertNode(vert_node_s * vert_node) {
-	if (vert_node->mActiveFrame == mUpdateFrame) {
-		mActiveVertices.Add(vert_node->mInterpolatedPos);
+void QuadCollapseMesh::AddActiveQuad(const quad_node_s *quad_node) {
+	vert_node_s * const * corners = quad_node->mCornerVertNodes;
+
+	if (quad_node->mTriangulationMode == TM_SW_NE) {
+		AddActiveTriangle(corners[0], corners[1], corners[2]);
+		AddActiveTriangle(corners[0], corners[2], corners[3]);
 	}
 	else {
-		vec3 * pos = nullptr;
-		vert_node_s * p = vert_node->mParent;
+		AddActiveTriangle(corners[0], corners[1], corners[3]);
+		AddActiveTriangle(corners[1], corners[2], corners[3]);
+	}
+}
 
-		while (p) {
-			if (p->mActiveFrame == mUpdateFrame) {
-				pos = &p->mInterpolatedPos;
-				break;
-			}
-			p = p->mParent;
-		}
+void QuadCollapseMesh::AddActiveTriangle(vert_node_s *vn0, vert_node_s *vn1, vert_node_s *vn2) {
+	vert_node_s * a = ResolveVertNode(vn0);
+	vert_node_s * b = ResolveVertNode(vn1);
+	vert_node_s * c = ResolveVertNode(vn2);
+
+	if (!a || !b || !c) {
+		mStats.mIncompleteTriangles++;
+		return;
+	}
+
+	// corners collapsed onto the same ancestor, or morphed onto the same position
+	if (a == b || b == c || a == c
+		|| a->mInterpolatedPos == b->mInterpolatedPos
+		|| b->mInterpolatedPos == c->mInterpolatedPos
+		|| a->mInterpolatedPos == c->mInterpolatedPos)
+	{
+		mStats.mDegenerateTriangles++;
+		return;
+	}
+
+	// resolved corners may lie outside the chunk's quad tree node
+	if (mNumChunks) {
+		mChunkMins = min(mChunkMins, min(a->mInterpolatedPos, min(b->mInterpolatedPos, c->mInterpolatedPos)));
+		mChunkMaxs = max(mChunkMaxs, max(a->mInterpolatedPos, max(b->mInterpolatedPos, c->mInterpolatedPos)));
+	}
+
+	// sequential stores only, the destination may be write-combined GPU memory
+	if (mVertexFormat == VF_PACKED_GRID) {
+		uint32_t * w = (uint32_t*)mWritePos;
+		w[0] = mPackedVerts[a - mVertNodePool];
+		w[1] = mPackedVerts[b - mVertNodePool];
+		w[2] = mPackedVerts[c - mVertNodePool];
+		mWritePos += sizeof(uint32_t) * 3;
+	}
+	else if (mVertexFormat == VF_QUANTIZED) {
+		uint16_t * w = (uint16_t*)mWritePos;
+		mQuantization.Quantize(a->mInterpolatedPos, w);
+		mQuantization.Quantize(b->mInterpolatedPos, w + 4);
+		mQuantization.Quantize(c->mInterpolatedPos, w + 8);
+		mWritePos += sizeof(uint16_t) * 12;
+	}
+	else {
+		vec3 * w = (vec3*)mWritePos;
+		w[0] = a->mInterpolatedPos;
+		w[1] = b->mInterpolatedPos;
+		w[2] = c->mInterpolatedPos;
+		mWritePos += sizeof(vec3) * 3;
+	}
+	mStats.mEmittedVertices += 3;
+}
+
+vert_node_s * QuadCollapseMesh::ResolveVertNode(vert_node_s * vert_node) {
+	if (vert_node->mActiveFrame == mRefineFrame) {
+		return vert_node;
+	}
+
+	mStats.mResolvedVertices++;
 
-		if (pos) {
-			mActiveVertices.Add(*pos);
+	if (vert_node->mResolvedFrame == mRefineFrame) {
+		mStats.mResolveCacheHits++;
+		return vert_node->mResolvedIndex >= 0 ? mVertNodePool + vert_node->mResolvedIndex : nullptr;
+	}
+
+	// walk up to the nearest active ancestor, or to an ancestor already resolved this frame
+	vert_node_s * result = nullptr;
+	vert_node_s * p = vert_node->mParent;
+
+	while (p) {
+		mStats.mParentWalkSteps++;
+
+		if (p->mActiveFrame == mRefineFrame) {
+			result = p;
+			break;
 		}
-		else {
-			return;
+
+		if (p->mResolvedFrame == mRefineFrame) {
+			result = p->mResolvedIndex >= 0 ? mVertNodePool + p->mResolvedIndex : nullptr;
+			break;
 		}
+
+		p = p->mParent;
+	}
+
+	// memoize along the walked chain, so every inactive node is walked at most once per frame
+	int32_t index = result ? (int32_t)(result - mVertNodePool) : -1;
+	for (vert_node_s * n = vert_node; n != p; n = n->mParent) {
+		n->mResolvedFrame = mRefineFrame;
+		n->mResolvedIndex = index;
 	}
+
+	return result;
 }
@@ -11,10 +11,28 @@ QuadCollapseMesh
 */
 #define	MAX_QUAD_LEVEL_COUNT	13
 
+// VF_PACKED_GRID vertex: grid x, grid y and the direction to the parent vert node,
+// the vertex shader fetches both heights and morphs like UpdateVertNode does
+#define	PACKED_GRID_BITS		13
+#define	PACKED_GRID_MASK		((1 << PACKED_GRID_BITS) - 1)
+#define	PACKED_PARENT_NONE		4		// no parent, or parent at the same position
+
+inline uint32_t PackGridVertex(int32_t x, int32_t y, int32_t parent_dx, int32_t parent_dy) {
+	uint32_t dir = (uint32_t)((parent_dx + 1) + (parent_dy + 1) * 3);
+	return (uint32_t)x | ((uint32_t)y << PACKED_GRID_BITS) | (dir << (PACKED_GRID_BITS * 2));
+}
+
 struct vert_node_s;
 struct quad_node_s;
 struct quad_leaf_s;
 
+// deferred split or merge of a vert node, time-sliced refinement
+struct refine_candidate_s {
+	float						mPriority;		// lower is more urgent
+	int32_t						mVertIndex;
+	bool						mSplit;			// false: merge
+};
+
 class QuadCollapseMesh {
 public:
 
@@ -22,13 +40,70 @@ public:
 	~QuadCollapseMesh();
 
 	bool						Build(const vec3 *vertices, int width, int height);
-	void						Update(const camera_s &cam, const frustum_plane_s &fp);
+	void						SetVertexFormat(vertex_format_t format);
+	void						SetChunkLevel(int level);	// before Build, 0 disables chunks
+	void						SetFrustumCulling(bool enable);	// off if chunks are culled later
+	// at most max_changes splits and merges per frame, fewer while refinement takes over max_ms,
+	// 0 and 0 refines fully every frame
+	void						SetRefineBudget(int max_changes, float max_ms);
+	void						SetMaxError(float max_error);	// object space height, vert nodes with flatter subtrees stay unsplit
+	void						SetOcclusionCulling(int width);	// occlusion buffer width in pixels, 0 disables
+	void						SetVisibilitySet(const PotentiallyVisibleSet *pvs);	// not owned, null disables
+	void						SetPredictionHorizon(float seconds);	// split ahead along camera_s::mVelocity, 0 disables
+	bool						IsRefinePending() const;	// deferred changes left, keep updating
+	// write the active mesh into sink if not null, otherwise into an internal array
+	void						Update(const camera_s &cam, const frustum_plane_s &fp, MeshSink *sink);
 	int							GetMaxLevelVerticesLength() const;
+	int							GetMaxLevel() const;
+	float						GetMaxError() const;
+	const float *				GetActiveDistances() const;	// per level, MAX_QUAD_LEVEL_COUNT
+	int							GetViewLevel(float distance) const;	// coarsest quad level of the converged mesh that far from the view position
+	// GetMaxLevel() + 1 grids of grid_length * grid_length cells over the height field. cell i of grid k holds the
+	// largest height difference between the samples in it and the mesh of quad nodes at level k or deeper
+	void						GetSurfaceErrors(int grid_length, float *errors) const;
+	const vertex_quantization_s &	GetQuantization() const;
+	size_t						GetMemoryUsage() const;	// bytes
 	const triangle_mesh_s &		GetActiveMesh() const;
+	const lod_stats_s &			GetStats() const;
 
 private:
 
-	uint32						mUpdateFrame;
+	typedef ItemArray<vert_node_s *, 4096>	vert_node_array_t;
+	typedef ItemArray<quad_node_s *, 1024>	quad_node_array_t;
+	typedef ItemArray<const quad_node_s *, 65536>	active_quad_array_t;
+	typedef ItemArray<refine_candidate_s, 1024>	refine_candidate_array_t;
+
+	uint32						mUpdateFrame;	// quad node stamp, every update
+	uint32						mRefineFrame;	// vert node stamp, when the view position moved
+	vec3						mRefinePos;
+	bool						mRefined;
+	bool						mFrustumCulling;
+
+	// time-sliced refinement, split flags of vert nodes persist across frames
+	int							mRefineMaxChanges;
+	float						mRefineMaxTime;		// ms
+	int							mRefineAllowance;	// changes allowed this frame
+	bool						mRefineBudgeted;	// this frame walks the persistent split flags
+	bool						mSplitsValid;		// split flags match the last refinement
+	bool						mRefinePending;
+	refine_candidate_array_t	mRefineCandidates;	// bounded heap, least urgent on top
+
+	// predictive refinement, vert nodes split within their active distance of the segment
+	// from the view position to where the camera will be after mPredictHorizon
+	float						mPredictHorizon;	// seconds
+	vec3						mPredictDelta;
+	float						mPredictInvLengthSq;	// 0: no prediction this frame
+
+	// active quads are rasterized as occluders, then quads behind them are dropped
+	OcclusionBuffer *			mOcclusion;
+	int							mOcclusionWidth;
+	ItemArray<vec3, 65536>		mOccluderVertices;	// two triangles per active quad
+	ItemArray<byte, 16384>		mQuadOccluded;
+
+	// quad nodes at the set's level or deeper are skipped if hidden from the view position's cell
+	const PotentiallyVisibleSet *	mPvs;
+	int							mPvsCell;		// -1: nothing culled this frame
+
 	const vec3 *				mOriginalPosRef;
 	uint32_t					mMaxLevel;
 	int							mMaxLevelVerticesLength;
@@ -37,6 +112,7 @@ private:
 	vert_node_s *				mVertNodePool;
 	quad_node_s *				mQuadNodePool;
 	quad_leaf_s *				mQuadLeafPool;
+	int32_t *					mVertChildrenPool;	// children of a vert node are a contiguous range
 	int							mVertNodePoolSize;
 	int							mQuadNodePoolSize;
 	int							mQuadLeafPoolSize;
@@ -47,24 +123,64 @@ private:
 	float						mQuadNodesCullRadius[MAX_QUAD_LEVEL_COUNT];
 	int							mVertNodesLevelOffset[MAX_QUAD_LEVEL_COUNT];
 
-	ItemArray<vec3, 65536>		mActiveVertices;
+	vertex_format_t				mVertexFormat;
+	uint32_t *					mPackedVerts;	// VF_PACKED_GRID vertex of every vert node
+	float *						mVertErrors;	// max height error of the subtree of every vert node if collapsed
+	float						mMaxError;
+	vertex_quantization_s		mQuantization;	// VF_QUANTIZED, morphed positions are quantized on emit
+
+	ItemArray<byte, 65536 * 12>	mActiveVertices;
 	triangle_mesh_s				mActiveMesh;
+	lod_stats_s					mStats;
+
+	// traversal work lists
+	vert_node_array_t			mVertFrontier[2];
+	quad_node_array_t			mQuadStack;
+	quad_node_array_t			mBoundaryQuads;	// adjacent to boundary vert nodes, culled after refinement
+	active_quad_array_t			mActiveQuads;	// quads to emit this frame
+
+	// chunks: 4^mChunkLevel quad tree nodes, plus one for active quads above that level
+	int							mChunkLevel;
+	int							mNumChunks;
+	mesh_chunk_s *				mChunks;
+	int32_t *					mChunkOffsets;	// mNumChunks + 1, into mSortedQuads
+	ItemArray<uint16_t, 65536>	mQuadChunks;	// chunk of each active quad
+	active_quad_array_t			mSortedQuads;	// active quads grouped by chunk
+	vec3						mChunkMins;		// of the chunk being emitted
+	vec3						mChunkMaxs;
+	byte *						mWritePos;
 
 	// root nodes
 	quad_node_s	*				mRootQuadnode;
 	vert_node_s *				mRootVertnodes[4];
 
 	void						BuildVertNodes();
-	quad_node_s *				RecursiveBuildQuadNodes(uint32_t level, int32_t x0, int32_t y0, int32_t step);
+	void						InitQuadLeaf(quad_leaf_s *quad_leaf, uint32_t level, int32_t x0, int32_t y0);
+	void						RecursiveBuildQuadNode(quad_node_s *quad_node, uint32_t level, int32_t x0, int32_t y0, int32_t step);
 	void						CollapseQuad(quad_node_s *quad_node, int32_t x0, int32_t y0, int32_t step);
+	void						BuildVertChildren();
+	void						BuildVertErrors();
+	bool						BuildPackedVerts();
 
 	vert_node_s *				GetVertNode(uint32_t level, int32_t x, int32_t y, bool init_mode);
-	quad_node_s *				AllocQuadNode();
-	quad_leaf_s *				AllocQuadLeaf();
-
-	void						RecursiveUpdateVertNode(const vec3 &view_pos, const frustum_plane_s &fp, vert_node_s * vert_node);
+	quad_node_s *				AllocQuadNodes(int count);
+	quad_leaf_s *				AllocQuadLeaves(int count);
+
+	void						UpdateVertNodes(const vec3 &view_pos);
+	void						UpdateVertNode(const vec3 &view_pos, vert_node_s * vert_node, vert_node_array_t &next_level);
+	void						AddRefineCandidate(vert_node_s *vert_node, float priority, bool split);
+	void						ApplyRefineCandidates();
+	void						MarkBoundaryQuads(const frustum_plane_s &fp);
 	void						QuadNodeSetBoundary(const frustum_plane_s &fp, quad_node_s *quad_node);
 
-	void						RecursiveSetActiveMesh(quad_node_s *quad_node);
-	void						AddActiveVertNode(vert_node_s * vert_node);
+	void						CollectActiveQuads();
+	void						CullOccludedQuads(const frustum_plane_s &fp);
+	int							GetQuadCell(const quad_node_s *quad_node, int level) const;	// quad tree node of level holding it
+	int							GetQuadChunk(const quad_node_s *quad_node) const;
+	void						SortActiveQuadsByChunk();
+	int							EmitActiveQuads(byte *dest, bool hash_chunks);	// returns vertex count
+	void						EmitQuads(const quad_node_s * const *quads, int count);
+	void						AddActiveQuad(const quad_node_s *quad_node);
+	void						AddActiveTriangle(vert_node_s *vn0, vert_node_s *vn1, vert_node_s *vn2);
+	vert_node_s *				ResolveVertNode(vert_node_s * vert_node);
 };
@@ -4,36 +4,210 @@ render terrain
 
 #include "Precompiled.h"
 
+static const int CHUNK_MIN_VERTICES = 96;	// slack of an empty chunk
+
+struct terrain_chunk_slot_s {
+	int							mFirstVertex;	// in the chunk buffer
+	int							mCapacity;
+	int							mNumVertices;
+	uint64_t					mHash;
+	bool						mValid;			// mHash describes the buffer content
+};
+
+// std430 layout of terrain_chunk_cull.comp
+struct terrain_chunk_bounds_s {
+	vec4						mMins;
+	vec4						mMaxs;
+	uint32_t					mFirstVertex;
+	uint32_t					mNumVertices;
+	uint32_t					mPad[2];
+};
+
+// glMultiDrawArraysIndirect command
+struct draw_arrays_command_s {
+	uint32_t					mCount;
+	uint32_t					mInstanceCount;
+	uint32_t					mFirst;
+	uint32_t					mBaseInstance;
+};
+
+static const int CHUNK_CULL_GROUP_SIZE = 64;	// local_size_x of terrain_chunk_cull.comp
+
 RenderTerrain::RenderTerrain():
 	mDrawWireframe(false),
-	mVAO(0),
-	mVBO(0),
+	mBackend(TB_QUAD_COLLAPSE),
+	mVertexFormat(VF_FLOAT3),
+	mNumUploadBuffers(1),
+	mCurrentUploadBuffer(0),
 	mBaseTexture(0),
 	mDetailTexture(0),
+	mVertexBufferCapacity(0),
+	mRingBuffer(nullptr),
+	mRingVAO(0),
+	mRingVAOGeneration(0),
+	mFromRing(false),
+	mFirstVertex(0),
+	mChunked(false),
+	mChunkVAO(0),
+	mChunkVBO(0),
+	mChunkBufferCapacity(0),
+	mChunkSlots(nullptr),
+	mNumChunks(0),
+	mDrawFirst(nullptr),
+	mDrawCount(nullptr),
+	mNumDraws(0),
+	mUploadChunks(0),
+	mGpuCulling(false),
+	mChunkBounds(nullptr),
+	mChunkBoundsBuffer(0),
+	mDrawCommandBuffer(0),
+	mCullFrame(0),
+	mDrawnChunks(0),
 	mNumTerrainTriangles(0),
-	mVertexBufferCapacity(0)
+	mUploadBytes(0),
+	mMaxLevel(0),
+	mHeightTexture(0),
+	mPatchVAO(0),
+	mPatchVBO(0),
+	mNumPatchVertices(0),
+	mHeightFieldWidth(0),
+	mHeightFieldHeight(0),
+	mMinHeight(0.0f),
+	mMaxHeight(0.0f),
+	mTessPixelsPerEdge(8.0f),
+	mMaxTessLevel(64),
+	mPrimitiveQuery(0),
+	mQueryPending(false)
 {
+	memset(mVAO, 0, sizeof(mVAO));
+	memset(mVBO, 0, sizeof(mVBO));
+	memset((void*)mActiveDistances, 0, sizeof(mActiveDistances));
+	memset(mCullCounters, 0, sizeof(mCullCounters));
 }
 
 RenderTerrain::~RenderTerrain() {
-	glDeleteBuffers(1, &mVBO);
-	glDeleteVertexArrays(1, &mVAO);
+	if (mRingBuffer) {
+		delete mRingBuffer;
+		mRingBuffer = nullptr;
+	}
+	glDeleteVertexArrays(1, &mRingVAO);
+	glDeleteBuffers(MAX_FRAMES_IN_FLIGHT, mCullCounters);
+	glDeleteBuffers(1, &mDrawCommandBuffer);
+	glDeleteBuffers(1, &mChunkBoundsBuffer);
+	free(mChunkBounds);
+	GL_DeleteProgram(mProgram_ChunkCull);
+	glDeleteBuffers(1, &mChunkVBO);
+	glDeleteVertexArrays(1, &mChunkVAO);
+	free(mDrawCount);
+	free(mDrawFirst);
+	free(mChunkSlots);
+	glDeleteQueries(1, &mPrimitiveQuery);
+	glDeleteBuffers(1, &mPatchVBO);
+	glDeleteVertexArrays(1, &mPatchVAO);
+	glDeleteTextures(1, &mHeightTexture);
+	GL_DeleteProgram(mProgram_TessWireframe);
+	GL_DeleteProgram(mProgram_TessTerrain);
+	glDeleteBuffers(MAX_FRAMES_IN_FLIGHT, mVBO);
+	glDeleteVertexArrays(MAX_FRAMES_IN_FLIGHT, mVAO);
 	glDeleteTextures(1, &mDetailTexture);
 	glDeleteTextures(1, &mBaseTexture);
 	GL_DeleteProgram(mProgram_Wireframe);
 	GL_DeleteProgram(mProgram_Terrain);
 }
 
+static void SetupVertexFormat(GLuint vao, vertex_format_t format) {
+	glEnableVertexArrayAttrib(vao, 0);
+	if (format == VF_PACKED_GRID) {
+		glVertexArrayAttribIFormat(vao, 0, 1, GL_UNSIGNED_INT, 0);
+	}
+	else if (format == VF_QUANTIZED) {
+		glVertexArrayAttribFormat(vao, 0, 3, GL_UNSIGNED_SHORT, GL_TRUE, 0);
+	}
+	else {
+		glVertexArrayAttribFormat(vao, 0, 3, GL_FLOAT, GL_FALSE, 0);
+	}
+	glVertexArrayAttribBinding(vao, 0, 0);
+}
+
 bool RenderTerrain::Init(const config_s &cfg) {
+	mBackend = cfg.mTerrainBackend;
+	mVertexFormat = mBackend == TB_QUAD_COLLAPSE ? cfg.mTerrainVertexFormat : VF_FLOAT3;
+
 	// create program
-	if (!GL_CreateProgram(cfg.mResDir, "terrain.vert", "terrain.frag", mProgram_Terrain)) {
+	const char * vs = "terrain.vert";
+	const char * wireframe_vs = "terrain_wireframe.vert";
+
+	if (mVertexFormat == VF_PACKED_GRID) {
+		vs = wireframe_vs = "terrain_packed.vert";
+	}
+	else if (mVertexFormat == VF_QUANTIZED) {
+		vs = wireframe_vs = "terrain_quantized.vert";
+	}
+
+	if (!GL_CreateProgram(cfg.mResDir, vs, "terrain.frag", mProgram_Terrain)) {
 		return false;
 	}
 
-	if (!GL_CreateProgram(cfg.mResDir, "terrain_wireframe.vert", "terrain_wireframe.frag", mProgram_Wireframe)) {
+	if (!GL_CreateProgram(cfg.mResDir, wireframe_vs, "terrain_wireframe.frag", mProgram_Wireframe)) {
 		return false;
 	}
 
+	if (mBackend == TB_TESSELLATION) {
+		return InitTessellation(cfg);
+	}
+
+	// the frame that last used a buffer has retired before the buffer comes around again.
+	// the buffers are created by the first upload, chunks and the ring buffer never need them
+	mNumUploadBuffers = max(1, cfg.mMaxFramesInFlight);
+	mVertexBufferCapacity = 1024 * 1024;
+
+	// changed chunks are copied out of the LOD mesh, it must stay in system memory
+	mChunked = cfg.mTerrainChunkLevel > 0;
+	if (mChunked) {
+		glCreateVertexArrays(1, &mChunkVAO);
+		SetupVertexFormat(mChunkVAO, mVertexFormat);
+
+		if (cfg.mTerrainGpuCulling) {
+			if (GLEW_ARB_compute_shader && GLEW_ARB_multi_draw_indirect && GLEW_ARB_shader_storage_buffer_object) {
+				if (!GL_CreateComputeProgram(cfg.mResDir, "terrain_chunk_cull.comp", mProgram_ChunkCull)) {
+					return false;
+				}
+
+				uint32_t zero = 0;
+				glCreateBuffers(MAX_FRAMES_IN_FLIGHT, mCullCounters);
+				for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+					glNamedBufferData(mCullCounters[i], sizeof(zero), &zero, GL_DYNAMIC_READ);
+				}
+
+				mGpuCulling = true;
+			}
+			else {
+				printf("GPU chunk culling not available\n");
+			}
+		}
+	}
+	else if (cfg.mPersistentMeshBuffer) {
+		if (MeshRingBuffer::IsSupported()) {
+			mRingBuffer = NEW__ MeshRingBuffer();
+			if (mRingBuffer->Init(mVertexBufferCapacity, VertexFormat_GetSize(mVertexFormat))) {
+				glCreateVertexArrays(1, &mRingVAO);
+				SetupVertexFormat(mRingVAO, mVertexFormat);
+			}
+			else {
+				delete mRingBuffer;
+				mRingBuffer = nullptr;
+			}
+		}
+
+		if (!mRingBuffer) {
+			printf("persistent mesh buffer not available, fall back to buffer upload\n");
+		}
+	}
+
+	return true;
+}
+
+bool RenderTerrain::CreateTextures(const config_s &cfg) {
 	mBaseTexture = GL_CreateTexture2D(cfg.mResDir, cfg.mTerrainBase, true, true);
 	if (!mBaseTexture) {
 		printf("could not load base texture \"%s\"\n", cfg.mTerrainBase);
@@ -46,29 +220,209 @@ bool RenderTerrain::Init(const config_s &cfg) {
 		return false;
 	}
 
-	mVertexBufferCapacity = 1024 * 1024;
-	RecreateVertexBuffer();
+	return true;
+}
+
+int RenderTerrain::GetTextureFiles(const config_s &cfg, char (*files)[MAX_PATH]) {
+	sprintf_(files[0], "%s%s%s", cfg.mResDir, PATH_SEPERATOR, cfg.mTerrainBase);
+	sprintf_(files[1], "%s%s%s", cfg.mResDir, PATH_SEPERATOR, cfg.mTerrainDetail);
+	return 2;
+}
+
+bool RenderTerrain::InitTessellation(const config_s &cfg) {
+	if (!GL_CreateProgram(cfg.mResDir, "terrain_tess.vert", "terrain_tess.tesc", "terrain_tess.tese", "terrain.frag", mProgram_TessTerrain)) {
+		return false;
+	}
+
+	if (!GL_CreateProgram(cfg.mResDir, "terrain_tess.vert", "terrain_tess.tesc", "terrain_tess.tese", "terrain_wireframe.frag", mProgram_TessWireframe)) {
+		return false;
+	}
+
+	GLint max_level = 64;
+	glGetIntegerv(GL_MAX_TESS_GEN_LEVEL, &max_level);
+	mMaxTessLevel = min(max_level, TESS_PATCH_SIZE); // one triangle edge per height field unit at most
+	mTessPixelsPerEdge = cfg.mTessPixelsPerEdge;
+
+	glGenQueries(1, &mPrimitiveQuery);
 
 	return true;
 }
 
+void RenderTerrain::SetHeightField(const vec3 *vertices, int width, int height) {
+	mHeightFieldWidth = width;
+	mHeightFieldHeight = height;
+
+	if (mBackend != TB_TESSELLATION && mVertexFormat != VF_PACKED_GRID) {
+		return;
+	}
+
+	// height texture, one texel per height field vertex
+	float * heights = (float*)malloc(sizeof(float) * width * height);
+	mMinHeight = vertices[0].z;
+	mMaxHeight = vertices[0].z;
+	for (int i = 0; i < width * height; ++i) {
+		heights[i] = vertices[i].z;
+		mMinHeight = min(mMinHeight, heights[i]);
+		mMaxHeight = max(mMaxHeight, heights[i]);
+	}
+
+	glDeleteTextures(1, &mHeightTexture);
+	glGenTextures(1, &mHeightTexture);
+	glBindTexture(GL_TEXTURE_2D, mHeightTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, heights);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	free(heights);
+
+	if (mBackend != TB_TESSELLATION) {
+		return;
+	}
+
+	// static patch grid, uploaded once
+	int cx = (width - 1 + TESS_PATCH_SIZE - 1) / TESS_PATCH_SIZE;
+	int cy = (height - 1 + TESS_PATCH_SIZE - 1) / TESS_PATCH_SIZE;
+
+	mNumPatchVertices = cx * cy * 4;
+	vec2 * patches = (vec2*)malloc(sizeof(vec2) * mNumPatchVertices);
+	vec2 * p = patches;
+
+	for (int y = 0; y < cy; ++y) {
+		float y0 = (float)(y * TESS_PATCH_SIZE);
+		float y1 = (float)min((y + 1) * TESS_PATCH_SIZE, height - 1);
+
+		for (int x = 0; x < cx; ++x) {
+			float x0 = (float)(x * TESS_PATCH_SIZE);
+			float x1 = (float)min((x + 1) * TESS_PATCH_SIZE, width - 1);
+
+			// counter-clockwise seen from above
+			p[0] = vec2(x0, y0);
+			p[1] = vec2(x1, y0);
+			p[2] = vec2(x1, y1);
+			p[3] = vec2(x0, y1);
+			p += 4;
+		}
+	}
+
+	glDeleteBuffers(1, &mPatchVBO);
+	glDeleteVertexArrays(1, &mPatchVAO);
+
+	glGenVertexArrays(1, &mPatchVAO);
+	glBindVertexArray(mPatchVAO);
+
+	glGenBuffers(1, &mPatchVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, mPatchVBO);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vec2) * mNumPatchVertices, patches, GL_STATIC_DRAW);
+
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(vec2), (const void *)0);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+
+	free(patches);
+
+	printf("tessellation: %d x %d patches, max level %d\n", cx, cy, mMaxTessLevel);
+}
+
+void RenderTerrain::SetLodLevels(const float *active_distances, int max_level) {
+	memcpy((void*)mActiveDistances, active_distances, sizeof(float) * MAX_QUAD_LEVEL_COUNT);
+	mMaxLevel = max_level;
+}
+
+void RenderTerrain::SetQuantization(const vertex_quantization_s &quantization) {
+	mQuantization = quantization;
+
+	if (mVertexFormat == VF_QUANTIZED) {
+		vec3 e = mQuantization.GetErrorBound();
+		printf("quantized terrain vertices, error bound: %.4f, %.4f, %.4f\n", e.x, e.y, e.z);
+	}
+}
+
+void RenderTerrain::SetupUniforms(UniformBuffers *ub, const camera_s &cam, int view_height) {
+	if (mVertexFormat == VF_PACKED_GRID) {
+		// same eye position as the LOD update of this frame
+		ub->SetMorph(
+			vec4(cam.mPos, 1.0f),
+			vec4((float)mMaxLevel, (float)(mHeightFieldWidth - 1), (float)mHeightFieldWidth, (float)mHeightFieldHeight),
+			mActiveDistances);
+	}
+	else if (mVertexFormat == VF_QUANTIZED) {
+		ub->SetQuantization(vec4(mQuantization.mOffset, (float)(mHeightFieldWidth - 1)), vec4(mQuantization.mScale, 0.0f));
+	}
+
+	if (mBackend != TB_TESSELLATION) {
+		return;
+	}
+
+	// screen pixels covered by one unit at distance 1
+	float pixels_per_unit = view_height / (2.0f * tanf(cam.mFovy * PI / 360.0f));
+
+	ub->SetTessellation(
+		vec4(cam.mPos, 1.0f),
+		vec4(pixels_per_unit, mTessPixelsPerEdge, (float)mMaxTessLevel, (float)(mHeightFieldWidth - 1)),
+		vec4((float)mHeightFieldWidth, (float)mHeightFieldHeight, mMinHeight, mMaxHeight));
+}
+
 void RenderTerrain::ToggleWireframeMode() {
 	mDrawWireframe = !mDrawWireframe;
 }
 
+MeshSink * RenderTerrain::GetMeshSink() {
+	return mRingBuffer;
+}
+
 void RenderTerrain::Update(const triangle_mesh_s & tm) {
-	size_t size = sizeof(vec3) * tm.mNumTriangles * 3;
+	int vertex_size = VertexFormat_GetSize(mVertexFormat);
+	size_t size = (size_t)vertex_size * tm.mNumTriangles * 3;
 	mNumTerrainTriangles = tm.mNumTriangles;
+	mUploadBytes = 0;
+	mUploadChunks = 0;
+
+	if (mChunked) {
+		if (tm.mVertexFormat != mVertexFormat || !tm.mNumChunks) {
+			SYS_ERROR("terrain mesh is not chunked\n");
+			return;
+		}
+
+		UpdateChunks(tm);
+		return;
+	}
+
+	// vertices were written into the mapped segment during mesh assembly, unless the ring could not take them
+	mFromRing = mRingBuffer && !tm.mVertices;
+	if (mFromRing) {
+		if (mRingVAOGeneration != mRingBuffer->GetGeneration()) {
+			mRingVAOGeneration = mRingBuffer->GetGeneration();
+			glVertexArrayVertexBuffer(mRingVAO, 0, mRingBuffer->GetBuffer(), 0, vertex_size);
+		}
+
+		mFirstVertex = mRingBuffer->GetFirstVertex();
+		mUploadBytes = size;
+		return;
+	}
 
 	if (tm.mNumTriangles > 0) {
-		if (tm.mNumTriangles * 3 > mVertexBufferCapacity) {
-			mVertexBufferCapacity = tm.mNumTriangles * 3;
+		if (tm.mVertexFormat != mVertexFormat) {
+			SYS_ERROR("terrain vertex format mismatch\n");
+			return;
+		}
+
+		if (!mVBO[0] || tm.mNumTriangles * 3 > mVertexBufferCapacity) {
+			mVertexBufferCapacity = max(mVertexBufferCapacity, tm.mNumTriangles * 3);
 			RecreateVertexBuffer();
 		}
 
-		glBindBuffer(GL_ARRAY_BUFFER, mVBO);
+		mCurrentUploadBuffer = (mCurrentUploadBuffer + 1) % mNumUploadBuffers;
+
+		glBindBuffer(GL_ARRAY_BUFFER, mVBO[mCurrentUploadBuffer]);
 		glBufferSubData(GL_ARRAY_BUFFER, 0, size, tm.mVertices);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		mUploadBytes = size;
 	}
 }
 
@@ -76,20 +430,62 @@ int	RenderTerrain::GetDrawTriangleCount() const {
 	return mNumTerrainTriangles;
 }
 
+size_t RenderTerrain::GetUploadBytes() const {
+	return mUploadBytes;
+}
+
+int RenderTerrain::GetUploadChunkCount() const {
+	return mUploadChunks;
+}
+
+int RenderTerrain::GetChunkCount() const {
+	return mNumChunks;
+}
+
+vertex_format_t RenderTerrain::GetVertexFormat() const {
+	return mVertexFormat;
+}
+
+bool RenderTerrain::IsGpuCulling() const {
+	return mGpuCulling;
+}
+
+int RenderTerrain::GetDrawnChunkCount() const {
+	return mGpuCulling ? mDrawnChunks : mNumDraws;
+}
+
 void RenderTerrain::Draw(UniformBuffers *ub, uint32_t draw_flags) {
+	if (mBackend == TB_TESSELLATION) {
+		DrawTessellation(ub, draw_flags);
+		return;
+	}
+
 	if (mNumTerrainTriangles > 0) {
+		GLuint vao = mChunked ? mChunkVAO : mFromRing ? mRingVAO : mVAO[mCurrentUploadBuffer];
+		int first = mFromRing ? mFirstVertex : 0;
+
+		if (mGpuCulling) {
+			CullChunks(ub);
+		}
 
 		if (draw_flags & DF_SOLID_TERRAIN) {
 			glUseProgram(mProgram_Terrain.mProgram);
 			{
-				glBindBufferBase(GL_UNIFORM_BUFFER, 0, ub->mUBO[UniformBuffers::UBO_MODEL_VIEW_PROJ_MATRIX]);
-				glBindBufferBase(GL_UNIFORM_BUFFER, 1, ub->mUBO[UniformBuffers::UBO_HEIGHT_FIELD]);
-				glBindBufferBase(GL_UNIFORM_BUFFER, 2, ub->mUBO[UniformBuffers::UBO_FOG]);
-				glBindVertexArray(mVAO);
+				ub->Bind(0, UniformBuffers::UBO_MODEL_VIEW_PROJ_MATRIX);
+				ub->Bind(1, UniformBuffers::UBO_HEIGHT_FIELD);
+				ub->Bind(2, UniformBuffers::UBO_FOG);
+				glBindVertexArray(vao);
 
 				glBindTextureUnit(0, mBaseTexture);
 				glBindTextureUnit(1, mDetailTexture);
-				glDrawArrays(GL_TRIANGLES, 0, mNumTerrainTriangles * 3);
+				if (mVertexFormat == VF_PACKED_GRID) {
+					ub->Bind(4, UniformBuffers::UBO_MORPH);
+					glBindTextureUnit(2, mHeightTexture);
+				}
+				else if (mVertexFormat == VF_QUANTIZED) {
+					ub->Bind(4, UniformBuffers::UBO_QUANTIZATION);
+				}
+				DrawMesh(first);
 			}
 		}
 
@@ -100,36 +496,295 @@ void RenderTerrain::Draw(UniformBuffers *ub, uint32_t draw_flags) {
 
 			glUseProgram(mProgram_Wireframe.mProgram);
 			{
-				glBindBufferBase(GL_UNIFORM_BUFFER, 0, ub->mUBO[UniformBuffers::UBO_MODEL_VIEW_PROJ_MATRIX]);
-				glBindBufferBase(GL_UNIFORM_BUFFER, 1, ub->mUBO[UniformBuffers::UBO_WIREFRAME_COLOR]);
-				glBindVertexArray(mVAO);
-				glDrawArrays(GL_TRIANGLES, 0, mNumTerrainTriangles * 3);
+				ub->Bind(0, UniformBuffers::UBO_MODEL_VIEW_PROJ_MATRIX);
+				ub->Bind(1, UniformBuffers::UBO_WIREFRAME_COLOR);
+				glBindVertexArray(vao);
+				if (mVertexFormat == VF_PACKED_GRID) {
+					ub->Bind(4, UniformBuffers::UBO_MORPH);
+					glBindTextureUnit(2, mHeightTexture);
+				}
+				else if (mVertexFormat == VF_QUANTIZED) {
+					ub->Bind(4, UniformBuffers::UBO_QUANTIZATION);
+				}
+				DrawMesh(first);
 			}
 
 			glPolygonOffset(0, 0);
 			glDisable(GL_POLYGON_OFFSET_LINE);
 			glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 		}
+
+		if (mRingBuffer) {
+			mRingBuffer->Fence();
+		}
+	}
+}
+
+void RenderTerrain::DrawTessellation(UniformBuffers *ub, uint32_t draw_flags) {
+	if (!mNumPatchVertices) {
+		return;
+	}
+
+	// result of an earlier frame, never wait for it
+	if (mQueryPending) {
+		GLint available = 0;
+		glGetQueryObjectiv(mPrimitiveQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint triangles = 0;
+			glGetQueryObjectuiv(mPrimitiveQuery, GL_QUERY_RESULT, &triangles);
+			mNumTerrainTriangles = (int)triangles;
+			mQueryPending = false;
+		}
+	}
+
+	// count the first pass only
+	bool query = !mQueryPending;
+
+	glPatchParameteri(GL_PATCH_VERTICES, 4);
+	glBindVertexArray(mPatchVAO);
+
+	if (draw_flags & DF_SOLID_TERRAIN) {
+		glUseProgram(mProgram_TessTerrain.mProgram);
+		{
+			ub->Bind(0, UniformBuffers::UBO_MODEL_VIEW_PROJ_MATRIX);
+			ub->Bind(2, UniformBuffers::UBO_FOG);
+			ub->Bind(3, UniformBuffers::UBO_TESSELLATION);
+
+			glBindTextureUnit(0, mBaseTexture);
+			glBindTextureUnit(1, mDetailTexture);
+			glBindTextureUnit(2, mHeightTexture);
+
+			if (query) {
+				glBeginQuery(GL_PRIMITIVES_GENERATED, mPrimitiveQuery);
+			}
+
+			glDrawArrays(GL_PATCHES, 0, mNumPatchVertices);
+
+			if (query) {
+				glEndQuery(GL_PRIMITIVES_GENERATED);
+				mQueryPending = true;
+				query = false;
+			}
+		}
+	}
+
+	if (draw_flags & DF_WIREFRAME_TERRAIN) {
+		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+		glEnable(GL_POLYGON_OFFSET_LINE);
+		glPolygonOffset(-1, 0);
+
+		glUseProgram(mProgram_TessWireframe.mProgram);
+		{
+			ub->Bind(0, UniformBuffers::UBO_MODEL_VIEW_PROJ_MATRIX);
+			ub->Bind(1, UniformBuffers::UBO_WIREFRAME_COLOR);
+			ub->Bind(3, UniformBuffers::UBO_TESSELLATION);
+
+			glBindTextureUnit(2, mHeightTexture);
+
+			if (query) {
+				glBeginQuery(GL_PRIMITIVES_GENERATED, mPrimitiveQuery);
+			}
+
+			glDrawArrays(GL_PATCHES, 0, mNumPatchVertices);
+
+			if (query) {
+				glEndQuery(GL_PRIMITIVES_GENERATED);
+				mQueryPending = true;
+			}
+		}
+
+		glPolygonOffset(0, 0);
+		glDisable(GL_POLYGON_OFFSET_LINE);
+		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	}
+}
+
+void RenderTerrain::DrawMesh(int first) {
+	if (mGpuCulling) {
+		// culled chunks have an instance count of 0
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mDrawCommandBuffer);
+		glMultiDrawArraysIndirect(GL_TRIANGLES, nullptr, mNumChunks, 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+	else if (mChunked) {
+		glMultiDrawArrays(GL_TRIANGLES, mDrawFirst, mDrawCount, mNumDraws);
+	}
+	else {
+		glDrawArrays(GL_TRIANGLES, first, mNumTerrainTriangles * 3);
 	}
 }
 
 void RenderTerrain::RecreateVertexBuffer() {
-	glDeleteBuffers(1, &mVBO);
-	glDeleteVertexArrays(1, &mVAO);
+	glDeleteBuffers(MAX_FRAMES_IN_FLIGHT, mVBO);
+	glDeleteVertexArrays(MAX_FRAMES_IN_FLIGHT, mVAO);
+	memset(mVAO, 0, sizeof(mVAO));
+	memset(mVBO, 0, sizeof(mVBO));
 
-	size_t init_size = sizeof(vec3) * mVertexBufferCapacity;
+	int vertex_size = VertexFormat_GetSize(mVertexFormat);
+	size_t init_size = (size_t)vertex_size * mVertexBufferCapacity;
 
-	glGenVertexArrays(1, &mVAO);
-	glBindVertexArray(mVAO);
+	for (int i = 0; i < mNumUploadBuffers; ++i) {
+		glGenVertexArrays(1, &mVAO[i]);
+		glBindVertexArray(mVAO[i]);
 
-	glGenBuffers(1, &mVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, mVBO);
-	glBufferData(GL_ARRAY_BUFFER, init_size, nullptr, GL_STATIC_DRAW);
+		glGenBuffers(1, &mVBO[i]);
+		glBindBuffer(GL_ARRAY_BUFFER, mVBO[i]);
+		glBufferData(GL_ARRAY_BUFFER, init_size, nullptr, GL_STATIC_DRAW);
 
-	glEnableVertexAttribArray(0);
+		glEnableVertexAttribArray(0);
 
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vec3), (const void *)0);
+		if (mVertexFormat == VF_PACKED_GRID) {
+			glVertexAttribIPointer(0, 1, GL_UNSIGNED_INT, vertex_size, (const void *)0);
+		}
+		else if (mVertexFormat == VF_QUANTIZED) {
+			glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, vertex_size, (const void *)0);
+		}
+		else {
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, vertex_size, (const void *)0);
+		}
+	}
 
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindVertexArray(0);
 }
+
+void RenderTerrain::UpdateChunks(const triangle_mesh_s & tm) {
+	bool layout = tm.mNumChunks != mNumChunks;
+	for (int i = 0; i < tm.mNumChunks && !layout; ++i) {
+		layout = tm.mChunks[i].mNumVertices > mChunkSlots[i].mCapacity;
+	}
+
+	if (layout) {
+		LayoutChunks(tm);
+	}
+
+	int vertex_size = VertexFormat_GetSize(mVertexFormat);
+	const byte * vertices = (const byte*)tm.mVertices;
+
+	mNumDraws = 0;
+
+	glBindBuffer(GL_ARRAY_BUFFER, mChunkVBO);
+
+	for (int i = 0; i < mNumChunks; ++i) {
+		const mesh_chunk_s & chunk = tm.mChunks[i];
+		terrain_chunk_slot_s & slot = mChunkSlots[i];
+
+		if (!slot.mValid || slot.mHash != chunk.mHash || slot.mNumVertices != chunk.mNumVertices) {
+			size_t size = (size_t)vertex_size * chunk.mNumVertices;
+			if (size) {
+				glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)vertex_size * slot.mFirstVertex, size, vertices + (size_t)vertex_size * chunk.mFirstVertex);
+			}
+
+			slot.mNumVertices = chunk.mNumVertices;
+			slot.mHash = chunk.mHash;
+			slot.mValid = true;
+
+			mUploadBytes += size;
+			mUploadChunks++;
+		}
+
+		if (slot.mNumVertices) {
+			mDrawFirst[mNumDraws] = slot.mFirstVertex;
+			mDrawCount[mNumDraws] = slot.mNumVertices;
+			mNumDraws++;
+		}
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	if (mGpuCulling) {
+		UpdateChunkBounds(tm);
+	}
+}
+
+void RenderTerrain::UpdateChunkBounds(const triangle_mesh_s & tm) {
+	bool changed = false;
+
+	for (int i = 0; i < mNumChunks; ++i) {
+		const mesh_chunk_s & chunk = tm.mChunks[i];
+		const terrain_chunk_slot_s & slot = mChunkSlots[i];
+
+		terrain_chunk_bounds_s bounds = {};
+		if (slot.mNumVertices) {
+			bounds.mMins = vec4(chunk.mMins, 0.0f);
+			bounds.mMaxs = vec4(chunk.mMaxs, 0.0f);
+			bounds.mFirstVertex = (uint32_t)slot.mFirstVertex;
+			bounds.mNumVertices = (uint32_t)slot.mNumVertices;
+		}
+
+		if (memcmp(&bounds, mChunkBounds + i, sizeof(bounds))) {
+			mChunkBounds[i] = bounds;
+			changed = true;
+		}
+	}
+
+	if (changed) {
+		GLsizeiptr size = (GLsizeiptr)sizeof(terrain_chunk_bounds_s) * mNumChunks;
+		glNamedBufferSubData(mChunkBoundsBuffer, 0, size, mChunkBounds);
+		mUploadBytes += size;
+	}
+}
+
+void RenderTerrain::CullChunks(UniformBuffers *ub) {
+	// written MAX_FRAMES_IN_FLIGHT frames ago, that frame has retired
+	GLuint counter = mCullCounters[mCullFrame];
+	mCullFrame = (mCullFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+
+	uint32_t drawn = 0;
+	glGetNamedBufferSubData(counter, 0, sizeof(drawn), &drawn);
+	mDrawnChunks = (int)drawn;
+
+	drawn = 0;
+	glNamedBufferSubData(counter, 0, sizeof(drawn), &drawn);
+
+	glUseProgram(mProgram_ChunkCull.mProgram);
+	ub->Bind(0, UniformBuffers::UBO_MODEL_VIEW_PROJ_MATRIX);
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, mChunkBoundsBuffer, 0, sizeof(terrain_chunk_bounds_s) * mNumChunks);
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, mDrawCommandBuffer, 0, sizeof(draw_arrays_command_s) * mNumChunks);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, counter);
+
+	glDispatchCompute((mNumChunks + CHUNK_CULL_GROUP_SIZE - 1) / CHUNK_CULL_GROUP_SIZE, 1, 1);
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+void RenderTerrain::LayoutChunks(const triangle_mesh_s & tm) {
+	if (tm.mNumChunks != mNumChunks) {
+		mNumChunks = tm.mNumChunks;
+		mChunkSlots = (terrain_chunk_slot_s*)realloc(mChunkSlots, sizeof(terrain_chunk_slot_s) * mNumChunks);
+		mDrawFirst = (GLint*)realloc(mDrawFirst, sizeof(GLint) * mNumChunks);
+		mDrawCount = (GLsizei*)realloc(mDrawCount, sizeof(GLsizei) * mNumChunks);
+		memset(mChunkSlots, 0, sizeof(terrain_chunk_slot_s) * mNumChunks);
+
+		if (mGpuCulling) {
+			mChunkBounds = (terrain_chunk_bounds_s*)realloc((void*)mChunkBounds, sizeof(terrain_chunk_bounds_s) * mNumChunks);
+			memset((void*)mChunkBounds, 0, sizeof(terrain_chunk_bounds_s) * mNumChunks);
+
+			glDeleteBuffers(1, &mChunkBoundsBuffer);
+			glDeleteBuffers(1, &mDrawCommandBuffer);
+			glCreateBuffers(1, &mChunkBoundsBuffer);
+			glCreateBuffers(1, &mDrawCommandBuffer);
+			glNamedBufferData(mChunkBoundsBuffer, sizeof(terrain_chunk_bounds_s) * mNumChunks, mChunkBounds, GL_DYNAMIC_DRAW);
+			glNamedBufferData(mDrawCommandBuffer, sizeof(draw_arrays_command_s) * mNumChunks, nullptr, GL_DYNAMIC_DRAW);
+		}
+	}
+
+	// room to grow, so that a chunk refining a bit does not move every other chunk
+	int total = 0;
+	for (int i = 0; i < mNumChunks; ++i) {
+		int n = max(tm.mChunks[i].mNumVertices, mChunkSlots[i].mNumVertices);
+		terrain_chunk_slot_s & slot = mChunkSlots[i];
+		slot.mFirstVertex = total;
+		slot.mCapacity = n + (n >> 1) + CHUNK_MIN_VERTICES;
+		slot.mValid = false;
+		total += slot.mCapacity;
+	}
+
+	if (total > mChunkBufferCapacity) {
+		mChunkBufferCapacity = total + (total >> 2);
+
+		glDeleteBuffers(1, &mChunkVBO);
+		glCreateBuffers(1, &mChunkVBO);
+		glNamedBufferData(mChunkVBO, (GLsizeiptr)VertexFormat_GetSize(mVertexFormat) * mChunkBufferCapacity, nullptr, GL_DYNAMIC_DRAW);
+		glVertexArrayVertexBuffer(mChunkVAO, 0, mChunkVBO, 0, VertexFormat_GetSize(mVertexFormat));
+	}
+}
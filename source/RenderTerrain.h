@@ -4,32 +4,113 @@ render terrain
 
 #pragma once
 
+#define	TESS_PATCH_SIZE			64		// height field units per patch edge
+
+struct terrain_chunk_slot_s;
+struct terrain_chunk_bounds_s;
+
 class RenderTerrain {
 public:
 	RenderTerrain();
 	~RenderTerrain();
 
 	bool						Init(const config_s &cfg);
+	bool						CreateTextures(const config_s &cfg);	// after Init, from the prepared texture cache
+	static int					GetTextureFiles(const config_s &cfg, char (*files)[MAX_PATH]);	// full paths, returns the count
+	void						SetHeightField(const vec3 *vertices, int width, int height);	// height texture for tessellation or packed vertices
+	void						SetLodLevels(const float *active_distances, int max_level);	// packed vertices morph on the GPU
+	void						SetQuantization(const vertex_quantization_s &quantization);
 
 	void						ToggleWireframeMode();
+	MeshSink *					GetMeshSink();	// nullptr if the mesh must be uploaded by Update
 	void						Update(const triangle_mesh_s & tm);
 	int							GetDrawTriangleCount() const;
+	size_t						GetUploadBytes() const;	// last update
+	int							GetUploadChunkCount() const;	// chunks uploaded by the last update
+	int							GetChunkCount() const;
+	vertex_format_t				GetVertexFormat() const;	// of the uploaded mesh
+	int							GetDrawnChunkCount() const;	// after GPU culling, a few frames late
+	bool						IsGpuCulling() const;
+	void						SetupUniforms(UniformBuffers *ub, const camera_s &cam, int view_height);
 	void						Draw(UniformBuffers *ub, uint32_t draw_flags);
 
 private:
 
 	bool						mDrawWireframe;
+	terrain_backend_t			mBackend;
+	vertex_format_t				mVertexFormat;
 
-	GLuint						mVAO;
-	GLuint						mVBO;
+	GLuint						mVAO[MAX_FRAMES_IN_FLIGHT];
+	GLuint						mVBO[MAX_FRAMES_IN_FLIGHT];	// one per frame in flight
+	int							mNumUploadBuffers;
+	int							mCurrentUploadBuffer;
 	GLuint						mBaseTexture;
 	GLuint						mDetailTexture;
-	int							mVertexBufferCapacity;
+	int							mVertexBufferCapacity;	// vertices
+
+	MeshRingBuffer *			mRingBuffer;
+	GLuint						mRingVAO;
+	int							mRingVAOGeneration;	// of the ring buffer currently attached to mRingVAO
+	bool						mFromRing;			// last mesh is in the ring, not in an upload buffer
+	int							mFirstVertex;
+
+	// chunked mesh, one range per chunk in mChunkVBO, only changed chunks are uploaded
+	bool						mChunked;
+	GLuint						mChunkVAO;
+	GLuint						mChunkVBO;
+	int							mChunkBufferCapacity;	// vertices
+	terrain_chunk_slot_s *		mChunkSlots;
+	int							mNumChunks;
+	GLint *						mDrawFirst;		// non-empty chunks, for glMultiDrawArrays
+	GLsizei *					mDrawCount;
+	int							mNumDraws;
+	int							mUploadChunks;
+
+	// GPU culling of chunks into indirect draw commands
+	bool						mGpuCulling;
+	gl_program_s				mProgram_ChunkCull;
+	terrain_chunk_bounds_s *	mChunkBounds;	// last uploaded
+	GLuint						mChunkBoundsBuffer;
+	GLuint						mDrawCommandBuffer;
+	GLuint						mCullCounters[MAX_FRAMES_IN_FLIGHT];	// chunks drawn, read back when the frame has retired
+	int							mCullFrame;
+	int							mDrawnChunks;
 
 	int							mNumTerrainTriangles;
+	size_t						mUploadBytes;
 
 	gl_program_s				mProgram_Terrain;
 	gl_program_s				mProgram_Wireframe;
 
+	// packed vertices, height and morph in the vertex shader
+	vec4						mActiveDistances[4];	// MAX_QUAD_LEVEL_COUNT floats
+	int							mMaxLevel;
+
+	// quantized vertices, decoded in the vertex shader
+	vertex_quantization_s		mQuantization;
+
+	// tessellation backend
+	gl_program_s				mProgram_TessTerrain;
+	gl_program_s				mProgram_TessWireframe;
+	GLuint						mHeightTexture;	// GL_R32F, also used by packed vertices
+	GLuint						mPatchVAO;
+	GLuint						mPatchVBO;
+	int							mNumPatchVertices;
+	int							mHeightFieldWidth;
+	int							mHeightFieldHeight;
+	float						mMinHeight;
+	float						mMaxHeight;
+	float						mTessPixelsPerEdge;
+	int							mMaxTessLevel;
+	GLuint						mPrimitiveQuery;	// generated triangles, read back without stalling
+	bool						mQueryPending;
+
+	bool						InitTessellation(const config_s &cfg);
+	void						DrawTessellation(UniformBuffers *ub, uint32_t draw_flags);
 	void						RecreateVertexBuffer();
+	void						UpdateChunks(const triangle_mesh_s & tm);
+	void						LayoutChunks(const triangle_mesh_s & tm);
+	void						UpdateChunkBounds(const triangle_mesh_s & tm);
+	void						CullChunks(UniformBuffers *ub);
+	void						DrawMesh(int first);
 };
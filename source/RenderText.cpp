@@ -4,11 +4,13 @@ render text
 
 #include "Precompiled.h"
 
+static const char * FONT_FILE = "font" PATH_SEPERATOR "font.bmp";
+
 RenderText::RenderText():
 	mVAO(0),
 	mVBO(0),
 	mFontTexture(0),
-	mNumChar(0)
+	mNumQuads(0)
 {
 }
 
@@ -44,12 +46,7 @@ bool RenderText::Init(const config_s &cfg) {
 		return false;
 	}
 
-	mFontTexture = GL_CreateTexture2D(cfg.mResDir, "font" PATH_SEPERATOR "font.bmp", true, true);
-	if (!mFontTexture) {
-		return false;
-	}
-
-	size_t size = sizeof(vertex_s) * MAX_PRINT_TEXT_LEN * 4;
+	size_t size = sizeof(vertex_s) * MAX_TEXT_QUADS * 4;
 
 	glGenVertexArrays(1, &mVAO);
 	glBindVertexArray(mVAO);
@@ -70,25 +67,32 @@ bool RenderText::Init(const config_s &cfg) {
 	return true;
 }
 
-void RenderText::Print(const char *text) {
-#define TEXT_CX	8.0f
-#define TEXT_CY	16.0f
+bool RenderText::CreateTextures(const config_s &cfg) {
+	mFontTexture = GL_CreateTexture2D(cfg.mResDir, FONT_FILE, true, true);
+	return mFontTexture != 0;
+}
 
-	glBindBuffer(GL_ARRAY_BUFFER, mVBO);
-	vertex_s * cur = (vertex_s*)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+int RenderText::GetTextureFiles(const config_s &cfg, char (*files)[MAX_PATH]) {
+	sprintf_(files[0], "%s%s%s", cfg.mResDir, PATH_SEPERATOR, FONT_FILE);
+	return 1;
+}
 
-	float x = 0.0f;
-	float y = 0.0f;
+void RenderText::Clear() {
+	mNumQuads = 0;
+}
+
+void RenderText::Print(float x, float y, const char *text) {
+	float line_x = x;
 
-	mNumChar = 0;
 	const char * pc = text;
 	while (*pc) {
-		if (mNumChar >= MAX_PRINT_TEXT_LEN - 1) {
-			break; // truncate
-		}
+		char c = *pc++;
 
-		mNumChar++;
-		char c = *pc;
+		if (c == '\n') {
+			x = line_x;
+			y -= TEXT_CY;
+			continue;
+		}
 
 		// clamp char
 		if (c < 32) {
@@ -101,44 +105,25 @@ void RenderText::Print(const char *text) {
 			index = 0;
 		}
 
-		char_info_s * tex_coord = mCharInfos + index;
-
-		cur[0].mPos.x = x;
-		cur[0].mPos.y = y;
-		cur[0].mPos.z = 0.0f;
-		cur[0].mTexCoord.x = tex_coord->mS0;
-		cur[0].mTexCoord.y = tex_coord->mT0;
-
-		cur[1].mPos.x = x + TEXT_CX;
-		cur[1].mPos.y = y;
-		cur[1].mPos.z = 0.0f;
-		cur[1].mTexCoord.x = tex_coord->mS1;
-		cur[1].mTexCoord.y = tex_coord->mT0;
-
-		cur[2].mPos.x = x + TEXT_CX;
-		cur[2].mPos.y = y + TEXT_CY;
-		cur[2].mPos.z = 0.0f;
-		cur[2].mTexCoord.x = tex_coord->mS1;
-		cur[2].mTexCoord.y = tex_coord->mT1;
+		const char_info_s * tex_coord = mCharInfos + index;
 
-		cur[3].mPos.x = x;
-		cur[3].mPos.y = y + TEXT_CY;
-		cur[3].mPos.z = 0.0f;
-		cur[3].mTexCoord.x = tex_coord->mS0;
-		cur[3].mTexCoord.y = tex_coord->mT1;
+		AddQuad(x, y, x + TEXT_CX, y + TEXT_CY, tex_coord->mS0, tex_coord->mT0, tex_coord->mS1, tex_coord->mT1);
 
 		x += TEXT_CX;
-		cur += 4;
-
-		pc++;
 	}
+}
 
-	glUnmapBuffer(GL_ARRAY_BUFFER);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+void RenderText::AddRect(float x, float y, float width, float height) {
+	// negative texture coordinate marks a solid quad, see text.frag
+	AddQuad(x, y, x + width, y + height, -1.0f, -1.0f, -1.0f, -1.0f);
 }
 
 void RenderText::Draw(UniformBuffers *ub) {
-	if (mNumChar) {
+	if (mNumQuads) {
+		glBindBuffer(GL_ARRAY_BUFFER, mVBO);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertex_s) * mNumQuads * 4, mVertices);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
 		glDepthMask(GL_FALSE);
 		glDisable(GL_DEPTH_TEST);
 
@@ -146,12 +131,12 @@ void RenderText::Draw(UniformBuffers *ub) {
 
 		glUseProgram(mProgram_Text.mProgram);
 		{
-			glBindBufferBase(GL_UNIFORM_BUFFER, 0, ub->mUBO[UniformBuffers::UBO_ORTHO_MODEL_VIEW_PROJ_MATRIX]);
-			glBindBufferBase(GL_UNIFORM_BUFFER, 1, ub->mUBO[UniformBuffers::UBO_FONT_COLOR]);
+			ub->Bind(0, UniformBuffers::UBO_ORTHO_MODEL_VIEW_PROJ_MATRIX);
+			ub->Bind(1, UniformBuffers::UBO_FONT_COLOR);
 			glBindVertexArray(mVAO);
 
 			glBindTextureUnit(0, mFontTexture);
-			glDrawArrays(GL_QUADS, 0, mNumChar * 4);
+			glDrawArrays(GL_QUADS, 0, mNumQuads * 4);
 		}
 
 		glDisable(GL_BLEND);
@@ -160,3 +145,25 @@ void RenderText::Draw(UniformBuffers *ub) {
 		glDepthMask(GL_TRUE);
 	}
 }
+
+void RenderText::AddQuad(float x0, float y0, float x1, float y1, float s0, float t0, float s1, float t1) {
+	if (mNumQuads >= MAX_TEXT_QUADS) {
+		return; // truncate
+	}
+
+	vertex_s * cur = mVertices + mNumQuads * 4;
+
+	cur[0].mPos = vec3(x0, y0, 0.0f);
+	cur[0].mTexCoord = vec2(s0, t0);
+
+	cur[1].mPos = vec3(x1, y0, 0.0f);
+	cur[1].mTexCoord = vec2(s1, t0);
+
+	cur[2].mPos = vec3(x1, y1, 0.0f);
+	cur[2].mTexCoord = vec2(s1, t1);
+
+	cur[3].mPos = vec3(x0, y1, 0.0f);
+	cur[3].mTexCoord = vec2(s0, t1);
+
+	mNumQuads++;
+}
@@ -4,13 +4,23 @@ render text
 
 #pragma once
 
+#define	TEXT_CX					8.0f
+#define	TEXT_CY					16.0f
+#define	MAX_TEXT_QUADS			(MAX_PRINT_TEXT_LEN * 4)
+
 class RenderText {
 public:
 	RenderText();
 	~RenderText();
 
 	bool						Init(const config_s &cfg);
-	void						Print(const char *text);
+	bool						CreateTextures(const config_s &cfg);	// after Init, from the prepared texture cache
+	static int					GetTextureFiles(const config_s &cfg, char (*files)[MAX_PATH]);	// full paths, returns the count
+
+	// all quads added between two Draw calls are batched into a single draw call
+	void						Clear();
+	void						Print(float x, float y, const char *text);
+	void						AddRect(float x, float y, float width, float height);
 	void						Draw(UniformBuffers *ub);
 
 private:
@@ -28,7 +38,11 @@ private:
 	GLuint						mVAO;
 	GLuint						mVBO;
 	GLuint						mFontTexture;
-	int							mNumChar;
+	int							mNumQuads;
+
+	vertex_s					mVertices[MAX_TEXT_QUADS * 4];
 
 	gl_program_s				mProgram_Text;
+
+	void						AddQuad(float x0, float y0, float x1, float y1, float s0, float t0, float s1, float t1);
 };
@@ -5,14 +5,22 @@ renderer
 #include "Precompiled.h"
 #include <stdarg.h>
 
+static const int MAX_TEXTURE_FILES = 16;
+
 Renderer::Renderer():
 	mViewWidth(1),
 	mViewHeight(1),
 	mUniformBuffer(nullptr),
 	mSkybox(nullptr),
 	mTerrain(nullptr),
-	mTextOutput(nullptr)
+	mTextOutput(nullptr),
+	mTextureCache(nullptr),
+	mFramesInFlight(0),
+	mFrameIndex(0),
+	mUniformCalls(0)
 {
+	mStatusText[0] = 0;
+	memset(mFrameFences, 0, sizeof(mFrameFences));
 }
 
 Renderer::~Renderer() {
@@ -20,8 +28,32 @@ Renderer::~Renderer() {
 }
 
 bool Renderer::Init(const config_s &cfg) {
+	mFramesInFlight = cfg.mMaxFramesInFlight;
+
+	// prepare every texture at once on a task thread while the programs are created, then upload them from the cache
+	double t1 = Sys_GetRelativeTime();
+
+	char cache_dir[MAX_PATH];
+	sprintf_(cache_dir, "%s%s%s", cfg.mResDir, PATH_SEPERATOR, cfg.mTextureCache);
+
+	mTextureCache = NEW__ TextureCache();
+	mTextureCache->Init(cfg.mTextureCache[0] ? cache_dir : nullptr,
+		cfg.mTextureCompression && GLEW_EXT_texture_compression_s3tc);
+
+	char texture_files[MAX_TEXTURE_FILES][MAX_PATH];
+	int num_textures = Skybox::GetTextureFiles(cfg, texture_files);
+	num_textures += RenderTerrain::GetTextureFiles(cfg, texture_files + num_textures);
+	num_textures += RenderText::GetTextureFiles(cfg, texture_files + num_textures);
+
+	const char * texture_names[MAX_TEXTURE_FILES];
+	for (int i = 0; i < num_textures; ++i) {
+		texture_names[i] = texture_files[i];
+	}
+
+	mTextureCache->StartPrepare(texture_names, num_textures);
+
 	mUniformBuffer = NEW__ UniformBuffers();
-	if (!mUniformBuffer->Init()) {
+	if (!mUniformBuffer->Init(cfg.mPersistentUniformBuffer)) {
 		printf("init uniform buffer error\n");
 		return false;
 	}
@@ -48,6 +80,24 @@ bool Renderer::Init(const config_s &cfg) {
 		return false;
 	}
 
+	double t2 = Sys_GetRelativeTime();
+	double texture_wait = mTextureCache->WaitPrepare();
+	GL_SetTextureCache(mTextureCache);
+
+	if (!mSkybox->CreateTextures(cfg) || !mTerrain->CreateTextures(cfg) || !mTextOutput->CreateTextures(cfg)) {
+		printf("init textures error\n");
+		return false;
+	}
+
+	double t3 = Sys_GetRelativeTime();
+	printf("renderer: %d textures prepared in %.1f ms, %d from the cache, %.1f ms of decoding on %d threads, "
+		"%.1f MB uploaded in %.1f ms, GL setup in %.1f ms, %.1f ms waited for textures\n", num_textures,
+		mTextureCache->GetPrepareTime() * 1000.0, mTextureCache->GetCachedCount(), mTextureCache->GetDecodeWork() * 1000.0,
+		Sys_GetThreadCount(), mTextureCache->GetLevelBytes() / (1024.0 * 1024.0), (t3 - t2 - texture_wait) * 1000.0,
+		(t2 - t1) * 1000.0, texture_wait * 1000.0);
+
+	FreeTextureCache();
+
 	glClearColor(cfg.mBackgroundColor.x, cfg.mBackgroundColor.y, cfg.mBackgroundColor.z, 1.0f);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glEnable(GL_DEPTH_TEST);
@@ -58,6 +108,13 @@ bool Renderer::Init(const config_s &cfg) {
 }
 
 void Renderer::Shutdown() {
+	for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+		if (mFrameFences[i]) {
+			glDeleteSync(mFrameFences[i]);
+			mFrameFences[i] = 0;
+		}
+	}
+
 	if (mTextOutput) {
 		delete mTextOutput;
 		mTextOutput = nullptr;
@@ -77,6 +134,17 @@ void Renderer::Shutdown() {
 		delete mUniformBuffer;
 		mUniformBuffer = nullptr;
 	}
+
+	FreeTextureCache(); // left over by a failed Init
+}
+
+void Renderer::FreeTextureCache() {
+	GL_SetTextureCache(nullptr);
+
+	if (mTextureCache) {
+		delete mTextureCache;
+		mTextureCache = nullptr;
+	}
 }
 
 void Renderer::ResizeViewport(int view_width, int view_height) {
@@ -99,23 +167,85 @@ void Renderer::SetHeightFieldSize(int size) {
 	mUniformBuffer->SetHeightFieldSize(size);
 }
 
+void Renderer::SetHeightField(const vec3 *vertices, int width, int height) {
+	mTerrain->SetHeightField(vertices, width, height);
+}
+
+void Renderer::SetTerrainLodLevels(const float *active_distances, int max_level) {
+	mTerrain->SetLodLevels(active_distances, max_level);
+}
+
+void Renderer::SetTerrainQuantization(const vertex_quantization_s &quantization) {
+	mTerrain->SetQuantization(quantization);
+}
+
+MeshSink * Renderer::GetTerrainMeshSink() {
+	return mTerrain->GetMeshSink();
+}
+
 void Renderer::UpdateTerrainMesh(const triangle_mesh_s & tm) {
 	mTerrain->Update(tm);
 }
 
-void Renderer::Printf(const char *fmt, ...) {
-	char buffer[MAX_PRINT_TEXT_LEN];
+size_t Renderer::GetTerrainUploadBytes() const {
+	return mTerrain->GetUploadBytes();
+}
+
+int Renderer::GetTerrainUploadChunkCount() const {
+	return mTerrain->GetUploadChunkCount();
+}
 
+int Renderer::GetTerrainChunkCount() const {
+	return mTerrain->GetChunkCount();
+}
+
+int Renderer::GetTerrainDrawnChunkCount() const {
+	return mTerrain->GetDrawnChunkCount();
+}
+
+bool Renderer::IsTerrainGpuCulling() const {
+	return mTerrain->IsGpuCulling();
+}
+
+int Renderer::GetUniformCallCount() const {
+	return mUniformCalls;
+}
+
+int Renderer::GetTerrainTriangleCount() const {
+	return mTerrain->GetDrawTriangleCount();
+}
+
+void Renderer::Printf(const char *fmt, ...) {
 	va_list argptr;
 	va_start(argptr, fmt);
-	vsprintf_(buffer, fmt, argptr);
+	vsprintf_(mStatusText, fmt, argptr);
 	va_end(argptr);
+}
+
+void Renderer::BeginFrame() {
+	if (!mFramesInFlight) {
+		return;
+	}
 
-	mTextOutput->Print(buffer);
+	GLsync fence = mFrameFences[mFrameIndex % mFramesInFlight];
+	if (fence) {
+		GLenum r;
+		do {
+			r = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000); // 1 ms
+		} while (r == GL_TIMEOUT_EXPIRED);
+
+		glDeleteSync(fence);
+		mFrameFences[mFrameIndex % mFramesInFlight] = 0;
+	}
 }
 
-void Renderer::Draw(const camera_s &cam, uint32_t draw_flags) {
+void Renderer::Draw(const camera_s &cam, uint32_t draw_flags, const PerfStats &perf_stats) {
+	// idle frames are drawn without an update, the slot is free before the uniforms go into it
+	BeginFrame();
+
+	mUniformBuffer->ResetCallCount();
 	SetupUniformBuffers(cam);
+	mUniformBuffer->Commit();
 	
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -124,9 +254,23 @@ void Renderer::Draw(const camera_s &cam, uint32_t draw_flags) {
 	}
 
 	mTerrain->Draw(mUniformBuffer, draw_flags);
+
+	BuildTextOutput(draw_flags, perf_stats);
 	mTextOutput->Draw(mUniformBuffer);
-	
-	glFinish();
+
+	mUniformCalls = mUniformBuffer->GetCallCount();
+
+	if (mFramesInFlight) {
+		GLsync & fence = mFrameFences[mFrameIndex % mFramesInFlight];
+		if (fence) {
+			glDeleteSync(fence);
+		}
+		fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		mFrameIndex++;
+	}
+	else {
+		glFinish();
+	}
 
 	//GL_CheckError();
 }
@@ -143,4 +287,57 @@ void Renderer::SetupUniformBuffers(const camera_s &cam) {
 	mUniformBuffer->SetModelViewProjMatrix(mvpmatrix, view_matrix);
 	mUniformBuffer->SetModelViewProjMatrix_FollowCamera(mvpmatrix_followcamera);
 	mUniformBuffer->SetOrthoModelViewProjMatrix(orthographic_mvp_matrix);
+	mTerrain->SetupUniforms(mUniformBuffer, cam, mViewHeight);
+}
+
+void Renderer::BuildTextOutput(uint32_t draw_flags, const PerfStats &perf_stats) {
+	mTextOutput->Clear();
+	mTextOutput->Print(0.0f, 0.0f, mStatusText);
+
+	if (!(draw_flags & DF_PERF_HUD)) {
+		return;
+	}
+
+	// text lines, below the status line
+	const lod_stats_s & lod_stats = perf_stats.GetLodStats();
+	const frame_pacing_stats_s & pacing_stats = perf_stats.GetPacingStats();
+
+	char buffer[MAX_PRINT_TEXT_LEN];
+	sprintf_(buffer,
+		"frame: %6.2f ms, p99: %6.2f ms (last %d frames)\n"
+		"pacing: %s, %5.1f fps, cpu: %5.1f%%, jitter: %5.2f ms rms, %5.2f ms max\n"
+		"lod update: %6.2f ms, upload: %6.2f ms, draw submit: %6.2f ms, fence wait: %6.2f ms\n"
+		"upload: %8.2f MB/s, chunks: %d uploaded, %d drawn of %d, lod memory: %8.2f MB, uniform calls: %d (%s)\n"
+		"emitted vertices: %d, resolved: %d, parent walk steps: %d, memo hits: %d%s\n"
+		"dropped triangles: %d degenerate, %d incomplete, %.1f KB saved, %d occluded quads, %d pvs culled, refine: %d changes, %d deferred, %d predicted, %d flat",
+		perf_stats.GetFrameTime(), perf_stats.GetPercentileFrameTime(0.99f), perf_stats.GetHistoryCount(),
+		FramePacing_GetName(perf_stats.GetPacing()), pacing_stats.mFrameRate, pacing_stats.mCpuUtilization * 100.0f,
+		pacing_stats.mJitter, pacing_stats.mMaxJitter,
+		perf_stats.GetPhaseTime(PP_LOD_UPDATE), perf_stats.GetPhaseTime(PP_UPLOAD), perf_stats.GetPhaseTime(PP_DRAW_SUBMIT), perf_stats.GetPhaseTime(PP_FENCE_WAIT),
+		perf_stats.GetUploadRate(), perf_stats.GetUploadChunks(), perf_stats.GetDrawnChunks(), perf_stats.GetChunkCount(), perf_stats.GetLodMemory() / (1024.0 * 1024.0),
+		perf_stats.GetUniformCalls(), mUniformBuffer->IsPersistentRing() ? "ring" : "map",
+		lod_stats.mEmittedVertices, lod_stats.mResolvedVertices, lod_stats.mParentWalkSteps, lod_stats.mResolveCacheHits,
+		lod_stats.mReusedRefinement ? ", refinement reused" : "",
+		lod_stats.mDegenerateTriangles, lod_stats.mIncompleteTriangles,
+		(lod_stats.mDegenerateTriangles + lod_stats.mIncompleteTriangles) * 3 * VertexFormat_GetSize(mTerrain->GetVertexFormat()) / 1024.0f, lod_stats.mOccludedQuads, lod_stats.mPvsCulledQuads,
+		lod_stats.mRefineChanges, lod_stats.mRefineDeferred, lod_stats.mPredictedSplits, lod_stats.mFlatVertNodes);
+
+	mTextOutput->Print(0.0f, -TEXT_CY * 2.0f, buffer);
+
+	// frame time graph, one bar per frame, oldest on the left
+	const float BAR_WIDTH = 2.0f;
+	const float GRAPH_HEIGHT = 64.0f;
+	const float GRAPH_MS = 33.3f; // top of the graph
+	const float GRAPH_BOTTOM = -TEXT_CY * 8.0f - GRAPH_HEIGHT;
+
+	int count = perf_stats.GetHistoryCount();
+	for (int i = 0; i < count; ++i) {
+		float ms = perf_stats.GetHistoryFrameTime(i);
+		float h = min(ms / GRAPH_MS, 1.0f) * GRAPH_HEIGHT;
+		mTextOutput->AddRect(i * BAR_WIDTH, GRAPH_BOTTOM, BAR_WIDTH - 1.0f, max(h, 1.0f));
+	}
+
+	// 60 Hz reference line
+	float ref_y = GRAPH_BOTTOM + (1000.0f / 60.0f) / GRAPH_MS * GRAPH_HEIGHT;
+	mTextOutput->AddRect(0.0f, ref_y, PERF_HISTORY_FRAMES * BAR_WIDTH, 1.0f);
 }
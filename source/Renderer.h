@@ -17,10 +17,23 @@ public:
 	void						GetViewport(int &view_width, int &view_height) const;
 	void						ToggleWireframeMode();
 	void						SetHeightFieldSize(int size);
+	void						SetHeightField(const vec3 *vertices, int width, int height);
+	void						SetTerrainLodLevels(const float *active_distances, int max_level);
+	void						SetTerrainQuantization(const vertex_quantization_s &quantization);
+	MeshSink *					GetTerrainMeshSink();
 	void						UpdateTerrainMesh(const triangle_mesh_s & tm);
+	size_t						GetTerrainUploadBytes() const;
+	int							GetTerrainUploadChunkCount() const;
+	int							GetTerrainChunkCount() const;	// 0 if the mesh is not chunked
+	int							GetTerrainDrawnChunkCount() const;
+	bool						IsTerrainGpuCulling() const;
+	int							GetUniformCallCount() const;	// GL calls for uniform data, last frame
+	int							GetTerrainTriangleCount() const;
 	void						Printf(const char *fmt, ...);
 
-	void						Draw(const camera_s &cam, uint32_t draw_flags);
+	void						BeginFrame();	// blocks until a frame slot is free, before any upload. Draw calls it too
+
+	void						Draw(const camera_s &cam, uint32_t draw_flags, const PerfStats &perf_stats);
 
 private:
 
@@ -31,6 +44,17 @@ private:
 	Skybox *					mSkybox;
 	RenderTerrain *				mTerrain;
 	RenderText *				mTextOutput;
+	TextureCache *				mTextureCache;	// during Init
+
+	char						mStatusText[MAX_PRINT_TEXT_LEN];
+
+	int							mFramesInFlight;	// 0: glFinish every frame
+	int							mFrameIndex;
+	GLsync						mFrameFences[MAX_FRAMES_IN_FLIGHT];
+
+	int							mUniformCalls;
 
+	void						FreeTextureCache();
 	void						SetupUniformBuffers(const camera_s &cam);
+	void						BuildTextOutput(uint32_t draw_flags, const PerfStats &perf_stats);
 };
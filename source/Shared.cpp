@@ -6,6 +6,35 @@ shared data type & function
 #include <malloc.h>
 #include <stdarg.h>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#if defined(_WIN32)
+# define NOMINMAX
+# include <windows.h>
+# include <timeapi.h>
+#endif
+
+#if defined(_WIN32)
+# include <psapi.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+# define	IMAGE_SSE
+# include <emmintrin.h>
+#endif
+
+#if defined(__linux__)
+# include <time.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/resource.h>
+# include <errno.h>
+#endif
 
 void frustum_plane_s::Setup(int viewport_width, int viewport_height, const camera_s &cam) {
 
@@ -26,6 +55,10 @@ void frustum_plane_s::Setup(int viewport_width, int viewport_height, const camer
 	m = rotate(mat4(1.0f), deg * PI / 180.0f, cam.mUp);
 	mRightPlane = m * vec4(forward, 0.0f);
 	mRightPlane.w = -dot(cam.mPos, vec3(mRightPlane));
+
+	mAspect = (float)viewport_width / viewport_height;
+	mat4 proj = perspective(cam.mFovy * PI / 180.0f, mAspect, cam.mZNear, cam.mZFar);
+	mViewProj = proj * lookAt(cam.mPos, cam.mTarget, cam.mUp);
 }
 
 bool frustum_plane_s::CullHorizontalCircle(const vec3 &center, float radius) const {
@@ -56,6 +89,43 @@ uint32_t ToggleFlags(uint32_t flags, uint32_t bit) {
 	}
 }
 
+uint64_t HashFNV1a(const void *data, size_t size) {
+	const byte * p = (const byte*)data;
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; ++i) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+int VertexFormat_GetSize(vertex_format_t format) {
+	switch (format) {
+	case VF_PACKED_GRID:
+		return (int)sizeof(uint32_t);
+	case VF_QUANTIZED:
+		return (int)sizeof(uint16_t) * 4;
+	default:
+		return (int)sizeof(vec3);
+	}
+}
+
+const char * HeightFormat_GetName(height_format_t format) {
+	switch (format) {
+	case HF_UNORM16: return "unorm16";
+	case HF_FLOAT32: return "float32";
+	default: return "unorm8";
+	}
+}
+
+height_format_t HeightFormat_FromName(const char *name) {
+	if (!strcmp(name, "float32")) {
+		return HF_FLOAT32;
+	}
+
+	return HF_UNORM16;
+}
+
 /*
 ================================================================================
 math
@@ -341,38 +411,99 @@ void image32_s::AllocDataSpace(int pixels) {
 	mData = (byte*)malloc(4 * pixels);
 }
 
+height_field_s::~height_field_s() {
+	if (mData) {
+		free(mData);
+	}
+
+	File_Unmap(mMapping);
+}
+
 void height_field_s::AllocDataSpace(int size) {
 	if (mData) {
 		free(mData);
 	}
 
 	mData = (byte*)malloc(size);
+	mSamples = mData;
+}
+
+int height_field_s::GetSampleSize() const {
+	switch (mFormat) {
+	case HF_UNORM16: return (int)sizeof(uint16_t);
+	case HF_FLOAT32: return (int)sizeof(float);
+	default: return 1;
+	}
+}
+
+void height_field_s::GetRow(int y, float *heights) const {
+	size_t offset = (size_t)mWidth * y;
+
+	switch (mFormat) {
+	case HF_UNORM16: {
+		const uint16_t * src = (const uint16_t*)mSamples + offset;
+		for (int x = 0; x < mWidth; ++x) {
+			heights[x] = (float)src[x] * mScale + mOffset;
+		}
+		break;
+	}
+	case HF_FLOAT32: {
+		const float * src = (const float*)mSamples + offset;
+		for (int x = 0; x < mWidth; ++x) {
+			heights[x] = src[x] * mScale + mOffset;
+		}
+		break;
+	}
+	default: {
+		const byte * src = (const byte*)mSamples + offset;
+		for (int x = 0; x < mWidth; ++x) {
+			heights[x] = (float)src[x] * mScale + mOffset;
+		}
+		break;
+	}
+	}
+}
+
+void vertex_quantization_s::Setup(const vec3 *vertices, int count) {
+	vec3 lo = count ? vertices[0] : vec3(0.0f);
+	vec3 hi = lo;
+
+	for (int i = 1; i < count; ++i) {
+		lo = min(lo, vertices[i]);
+		hi = max(hi, vertices[i]);
+	}
+
+	mOffset = lo;
+	mScale = max(hi - lo, vec3(1e-6f)); // flat axis
+}
+
+vec3 vertex_quantization_s::GetErrorBound() const {
+	return mScale * (0.5f / 65535.0f);
 }
 
-bool File_LoadBMP(const char * filename, image32_s &image) {
 #pragma pack(push, 1)
 
-	struct bmpfilehead_s {
-		word		bfType;
-		dword		bfSize;
-		word		bfReserved1;
-		word		bfReserved2;
-		dword		bfOffBits;
-	};
-
-	struct bmpinfohead_s {
-		dword		biSize;
-		int32_t		biWidth;
-		int32_t		biHeight;
-		word		biPlanes;
-		word		biBitCount;
-		dword		biCompression;
-		dword		biSizeImage;
-		int32_t		biXPelsPerMeter;
-		int32_t		biYPelsPerMeter;
-		dword		biClrUsed;
-		dword		biClrImportant;
-	};
+struct bmpfilehead_s {
+	word		bfType;
+	dword		bfSize;
+	word		bfReserved1;
+	word		bfReserved2;
+	dword		bfOffBits;
+};
+
+struct bmpinfohead_s {
+	dword		biSize;
+	int32_t		biWidth;
+	int32_t		biHeight;
+	word		biPlanes;
+	word		biBitCount;
+	dword		biCompression;
+	dword		biSizeImage;
+	int32_t		biXPelsPerMeter;
+	int32_t		biYPelsPerMeter;
+	dword		biClrUsed;
+	dword		biClrImportant;
+};
 
 #pragma pack(pop)
 
@@ -383,85 +514,76 @@ bool File_LoadBMP(const char * filename, image32_s &image) {
 #define BI_JPEG       4L
 #define BI_PNG        5L
 
-	int size = File_GetSize(filename);
-	char * buf = (char*)malloc(size);
-	bool error = false;
-
-	File_LoadBinary(filename, buf, size);
+static const int BMP_BAND_ROWS = 64;
+
+// one BMP file, uncompressed rows are decoded in bands on all threads
+struct bmp_decode_s {
+	const char *		mFileName;
+	char *				mBuffer;		// whole file
+	const byte *		mSrc;			// first row
+	int					mSrcLineLen;
+	int					mBitCount;
+	int					mNumBands;		// 0: nothing left to decode
+	int					mFirstBand;		// of all files being decoded
+	uint32_t			mPalette[256];	// RGBA
+	image32_s *			mImage;
+	bool				mError;
+};
 
+// RLE8 and 16 bits, serial
+static bool DecodeBMP(char *buf, int size, image32_s &image) {
 	bmpfilehead_s * filehead = (bmpfilehead_s*)buf;
 	bmpinfohead_s * infohead = (bmpinfohead_s*)(filehead + 1);
+	bool error = false;
 
-	if (infohead->biBitCount == 8) {
-
-		if (infohead->biCompression == BI_RGB) { // uncompressed
-			int src_line_len = (infohead->biWidth + 3) & ~3;
-
-			int valid_size = sizeof(bmpfilehead_s) + sizeof(bmpinfohead_s) + 4 * 256 + src_line_len * infohead->biHeight;
-			if (valid_size != size) {
-				SYS_ERROR("bad size\n");
-				error = true;
-			}
-			else {
-				image.mWidth = infohead->biWidth;
-				image.mHeight = infohead->biHeight;
-				image.AllocDataSpace(infohead->biWidth * 4 * infohead->biHeight);
-
-				byte * palette = (byte*)(infohead + 1);
-				byte * src = palette + 4 * 256;
-
-				int dst_line_len = infohead->biWidth * 4;
+	if (infohead->biBitCount == 8 && infohead->biCompression == BI_RLE8) {
+		image.mWidth = infohead->biWidth;
+		image.mHeight = infohead->biHeight;
+		image.AllocDataSpace(infohead->biWidth * 4 * infohead->biHeight);
 
-				for (int h = 0; h < infohead->biHeight; ++h) {
-					byte * src_line = src + src_line_len * h;
-					byte * dst_line = image.mData + dst_line_len * h;
+		memset(image.mData, 0xff, infohead->biWidth * 4 * infohead->biHeight);
 
-					for (int w = 0; w < infohead->biWidth; ++w) {
-						byte idx = src_line[w];
+		byte * palette = (byte*)(infohead + 1);
+		byte * src = palette + 4 * 256;
 
-						byte * src_clr = palette + idx * 4;
-						byte * dst_clr = dst_line + w * 4;
+		int dst_line_len = infohead->biWidth * 4;
 
-						dst_clr[0] = src_clr[2]; // red
-						dst_clr[1] = src_clr[1]; // green
-						dst_clr[2] = src_clr[0]; // blue
-						dst_clr[3] = 255; // opaque
-					}
-				}
-			}
-			
-		}
-		else if (infohead->biCompression == BI_RLE8) {
-			image.mWidth = infohead->biWidth;
-			image.mHeight = infohead->biHeight;
-			image.AllocDataSpace(infohead->biWidth * 4 * infohead->biHeight);
+		byte * s = src;
 
-			memset(image.mData, 0xff, infohead->biWidth * 4 * infohead->biHeight);
+		int line = 0;
+		int clrxpos = 0;
+		byte * dst_line = image.mData;
 
-			byte * palette = (byte*)(infohead + 1);
-			byte * src = palette + 4 * 256;
+		bool breakloop = false;
+		while (!breakloop) {
+			byte byte1 = s[0];
+			byte byte2 = s[1];
+			s += 2;
 
-			int dst_line_len = infohead->biWidth * 4;
-
-			byte * s = src;
+			if (byte1 > 0) {
+				byte runlen = byte1;
+				byte clridx = byte2;
 
-			int line = 0;
-			int clrxpos = 0;
-			byte * dst_line = image.mData;
+				byte * src_clr = palette + clridx * 4;
 
-			bool breakloop = false;
-			while (!breakloop) {
-				byte byte1 = s[0];
-				byte byte2 = s[1];
-				s += 2;
+				for (int i = 0; i < (int)runlen; ++i) {
+					byte * dst_clr = dst_line + clrxpos * 4;
 
-				if (byte1 > 0) {
-					byte runlen = byte1;
-					byte clridx = byte2;
+					dst_clr[0] = src_clr[2]; // red
+					dst_clr[1] = src_clr[1]; // green
+					dst_clr[2] = src_clr[0]; // blue
+					dst_clr[3] = 255; // opaque
 
-					byte * src_clr = palette + clridx * 4;
+					clrxpos++;
+				}
+			}
+			else { // 0 == byte1
+				if (byte2 >= 0x03) {
+					byte clrlen = byte2;
+					for (int i = 0; i < (int)clrlen; ++i) {
+						byte clridx = s[i];
 
-					for (int i = 0; i < (int)runlen; ++i) {
+						byte * src_clr = palette + clridx * 4;
 						byte * dst_clr = dst_line + clrxpos * 4;
 
 						dst_clr[0] = src_clr[2]; // red
@@ -471,61 +593,39 @@ bool File_LoadBMP(const char * filename, image32_s &image) {
 
 						clrxpos++;
 					}
+					s += clrlen;
 				}
-				else { // 0 == byte1
-					if (byte2 >= 0x03) {
-						byte clrlen = byte2;
-						for (int i = 0; i < (int)clrlen; ++i) {
-							byte clridx = s[i];
-
-							byte * src_clr = palette + clridx * 4;
-							byte * dst_clr = dst_line + clrxpos * 4;
-
-							dst_clr[0] = src_clr[2]; // red
-							dst_clr[1] = src_clr[1]; // green
-							dst_clr[2] = src_clr[0]; // blue
-							dst_clr[3] = 255; // opaque
-
-							clrxpos++;
-						}
-						s += clrlen;
-					}
-					else {
-						switch (byte2) {
-						case 0: // end of line
-							line++;
-							dst_line = image.mData + dst_line_len * line;
-							if (clrxpos != infohead->biWidth) {
-								SYS_ERROR("bad data\n");
-								error = true;
-								breakloop = true;
-							}
-							clrxpos = 0;
-							break;
-						case 1: // end of bitmap
-							breakloop = true;
-							break;
-						case 2: 
-							// delta.The 2 bytes following the escape contain unsigned values indicating the horizontal 
-							// and vertical offsets of the next pixel from the current position.
-							SYS_ERROR("did not know how to handle delta yet\n");
-							error = true;
-							breakloop = true;
-							break;
-						default:
+				else {
+					switch (byte2) {
+					case 0: // end of line
+						line++;
+						dst_line = image.mData + dst_line_len * line;
+						if (clrxpos != infohead->biWidth) {
 							SYS_ERROR("bad data\n");
 							error = true;
 							breakloop = true;
-							break;
 						}
+						clrxpos = 0;
+						break;
+					case 1: // end of bitmap
+						breakloop = true;
+						break;
+					case 2: 
+						// delta.The 2 bytes following the escape contain unsigned values indicating the horizontal 
+						// and vertical offsets of the next pixel from the current position.
+						SYS_ERROR("did not know how to handle delta yet\n");
+						error = true;
+						breakloop = true;
+						break;
+					default:
+						SYS_ERROR("bad data\n");
+						error = true;
+						breakloop = true;
+						break;
 					}
 				}
 			}
 		}
-		else {
-			error = true;
-		}
-
 	}
 	else if (infohead->biBitCount == 16) {
 		int src_line_len = (infohead->biWidth * 2 + 3) & ~3;
@@ -562,107 +662,623 @@ bool File_LoadBMP(const char * filename, image32_s &image) {
 					dst_clr[3] = 255; // opaque
 				}
 			}
-		}		
+		}
+	}
+	else {
+		error = true;
 	}
-	else if (infohead->biBitCount == 24) {
-		int src_line_len = (infohead->biWidth * 3 + 3) & ~3;
 
-		int valid_size = sizeof(bmpfilehead_s) + sizeof(bmpinfohead_s) + src_line_len * infohead->biHeight;
-		if (valid_size > size) {
-			SYS_ERROR("bad size\n");
-			error = true;
+	return !error;
+}
+
+// reads the file and sets up the row bands
+static void BMP_Begin(bmp_decode_s &d) {
+	d.mBuffer = nullptr;
+	d.mNumBands = 0;
+	d.mError = true;
+
+	int size = File_GetSize(d.mFileName);
+	if (size < (int)(sizeof(bmpfilehead_s) + sizeof(bmpinfohead_s))) {
+		SYS_ERROR("could not load %s\n", d.mFileName);
+		return;
+	}
+
+	d.mBuffer = (char*)malloc(size);
+	File_LoadBinary(d.mFileName, d.mBuffer, size);
+
+	bmpfilehead_s * filehead = (bmpfilehead_s*)d.mBuffer;
+	bmpinfohead_s * infohead = (bmpinfohead_s*)(filehead + 1);
+
+	d.mBitCount = infohead->biBitCount;
+	bool rows = (d.mBitCount == 8 || d.mBitCount == 24 || d.mBitCount == 32) && infohead->biCompression == BI_RGB;
+
+	if (!rows) {
+		d.mError = !DecodeBMP(d.mBuffer, size, *d.mImage);
+		return;
+	}
+
+	// the palette and rows must be in the buffer before any of them is read
+	int palette_size = d.mBitCount == 8 ? 4 * 256 : 0;
+	d.mSrcLineLen = (infohead->biWidth * (d.mBitCount >> 3) + 3) & ~3;
+	int valid_size = sizeof(bmpfilehead_s) + sizeof(bmpinfohead_s) + palette_size + d.mSrcLineLen * infohead->biHeight;
+
+	if (d.mBitCount == 8 ? valid_size != size : valid_size > size) {
+		SYS_ERROR("bad size\n");
+		return;
+	}
+
+	const byte * src = (const byte*)(infohead + 1);
+
+	if (d.mBitCount == 8) {
+		for (int i = 0; i < 256; ++i) {
+			const byte * clr = src + i * 4;
+			d.mPalette[i] = clr[2] | (clr[1] << 8) | (clr[0] << 16) | 0xff000000u; // opaque
+		}
+	}
+
+	d.mSrc = src + palette_size;
+
+	d.mImage->mWidth = infohead->biWidth;
+	d.mImage->mHeight = infohead->biHeight;
+	d.mImage->AllocDataSpace(infohead->biWidth * infohead->biHeight);
+	d.mNumBands = (infohead->biHeight + BMP_BAND_ROWS - 1) / BMP_BAND_ROWS;
+	d.mError = false;
+}
+
+#if defined(IMAGE_SSE)
+// BGRA dwords to RGBA, keep selects green and alpha
+static inline __m128i SwapRedBlue(__m128i bgra, __m128i keep, __m128i alpha) {
+	__m128i rb = _mm_and_si128(bgra, _mm_set1_epi32(0x00ff00ff));
+	rb = _mm_or_si128(_mm_srli_epi32(rb, 16), _mm_slli_epi32(rb, 16));
+	return _mm_or_si128(_mm_or_si128(_mm_and_si128(bgra, keep), rb), alpha);
+}
+#endif
+
+static void BMP_DecodeBand(const bmp_decode_s &d, int band) {
+	int width = d.mImage->mWidth;
+	int first = band * BMP_BAND_ROWS;
+	int last = glm::min(first + BMP_BAND_ROWS, d.mImage->mHeight);
+
+	for (int h = first; h < last; ++h) { // OpenGL stores the bottom row first, same as BMP
+		const byte * src = d.mSrc + d.mSrcLineLen * h;
+		uint32_t * dst = (uint32_t*)d.mImage->mData + width * h;
+		int w = 0;
+
+		if (d.mBitCount == 8) {
+			for (; w < width; ++w) {
+				dst[w] = d.mPalette[src[w]];
+			}
+		}
+		else if (d.mBitCount == 24) {
+#if defined(IMAGE_SSE)
+			__m128i keep = _mm_set1_epi32(0x0000ff00);
+			__m128i alpha = _mm_set1_epi32((int)0xff000000);
+			for (; w + 6 <= width; w += 4) { // 4 pixels of a 16 byte load, never past the row
+				__m128i v = _mm_loadu_si128((const __m128i*)(src + w * 3));
+				__m128i p01 = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+				__m128i p23 = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+				_mm_storeu_si128((__m128i*)(dst + w), SwapRedBlue(_mm_unpacklo_epi64(p01, p23), keep, alpha));
+			}
+#endif
+			for (; w < width; ++w) {
+				const byte * clr = src + w * 3;
+				dst[w] = clr[2] | (clr[1] << 8) | (clr[0] << 16) | 0xff000000u; // opaque
+			}
 		}
 		else {
-			image.mWidth = infohead->biWidth;
-			image.mHeight = infohead->biHeight;
-			image.AllocDataSpace(infohead->biWidth * 4 * infohead->biHeight);
+#if defined(IMAGE_SSE)
+			__m128i keep = _mm_set1_epi32((int)0xff00ff00);
+			__m128i alpha = _mm_setzero_si128();
+			for (; w + 4 <= width; w += 4) {
+				__m128i v = _mm_loadu_si128((const __m128i*)(src + w * 4));
+				_mm_storeu_si128((__m128i*)(dst + w), SwapRedBlue(v, keep, alpha));
+			}
+#endif
+			for (; w < width; ++w) {
+				const byte * clr = src + w * 4;
+				dst[w] = clr[2] | (clr[1] << 8) | (clr[0] << 16) | ((uint32_t)clr[3] << 24);
+			}
+		}
+	}
+}
 
-			byte * src = (byte*)(infohead + 1);
+static void BMP_End(bmp_decode_s &d) {
+	if (d.mBuffer) {
+		free(d.mBuffer);
+		d.mBuffer = nullptr;
+	}
+}
 
-			int dst_line_len = infohead->biWidth * 4;
+static void DecodeBandProc(void *context, int index) {
+	BMP_DecodeBand(*(bmp_decode_s*)context, index);
+}
 
-			for (int h = 0; h < infohead->biHeight; ++h) { //OpenGL store bottom row first, same as BMP
-				byte * src_line = src + src_line_len * h;
-				byte * dst_line = image.mData + dst_line_len * h;
+bool File_LoadBMP(const char * filename, image32_s &image) {
+	bmp_decode_s d;
+	d.mFileName = filename;
+	d.mImage = &image;
 
-				for (int w = 0; w < infohead->biWidth; ++w) {
-					byte * src_clr = src_line + w * 3;
-					byte * dst_clr = dst_line + w * 4;
+	BMP_Begin(d);
+	if (!d.mError) {
+		Sys_ParallelFor(d.mNumBands, DecodeBandProc, &d);
+	}
+	BMP_End(d);
 
-					dst_clr[0] = src_clr[2]; // red
-					dst_clr[1] = src_clr[1]; // green
-					dst_clr[2] = src_clr[0]; // blue
-					dst_clr[3] = 255; // opaque
-				}
+	return !d.mError;
+}
+
+/*
+image preload
+*/
+struct preloaded_image_s {
+	char				mFileName[MAX_PATH];
+	image32_s			mImage;
+	bmp_decode_s		mDecode;
+};
+
+static preloaded_image_s *			gPreloaded = nullptr;
+static int							gNumPreloaded = 0;
+static int							gNumPreloadBands = 0;
+static std::atomic<int64_t>			gPreloadWork(0); // nanoseconds
+
+static int64_t GetWorkTime(double t1) {
+	return (int64_t)((Sys_GetRelativeTime() - t1) * 1E9);
+}
+
+static void PreloadBeginProc(void *, int index) {
+	double t1 = Sys_GetRelativeTime();
+	BMP_Begin(gPreloaded[index].mDecode);
+	gPreloadWork += GetWorkTime(t1);
+}
+
+static void PreloadBandProc(void *, int index) {
+	double t1 = Sys_GetRelativeTime();
+
+	int i = gNumPreloaded - 1;
+	while (gPreloaded[i].mDecode.mFirstBand > index) {
+		i--;
+	}
+
+	BMP_DecodeBand(gPreloaded[i].mDecode, index - gPreloaded[i].mDecode.mFirstBand);
+	gPreloadWork += GetWorkTime(t1);
+}
+
+double Image_Preload(const char * const *filenames, int count) {
+	Image_FreePreloaded();
+
+	gPreloaded = NEW__ preloaded_image_s[count];
+	gNumPreloaded = count;
+	gPreloadWork = 0;
+
+	for (int i = 0; i < count; ++i) {
+		strcpy_(gPreloaded[i].mFileName, filenames[i]);
+		gPreloaded[i].mDecode.mFileName = gPreloaded[i].mFileName;
+		gPreloaded[i].mDecode.mImage = &gPreloaded[i].mImage;
+	}
+
+	// read all files at once, then decode the rows of all of them at once
+	Sys_ParallelFor(count, PreloadBeginProc, nullptr);
+
+	gNumPreloadBands = 0;
+	for (int i = 0; i < count; ++i) {
+		bmp_decode_s &d = gPreloaded[i].mDecode;
+		d.mFirstBand = gNumPreloadBands;
+		gNumPreloadBands += d.mError ? 0 : d.mNumBands;
+	}
+
+	Sys_ParallelFor(gNumPreloadBands, PreloadBandProc, nullptr);
+
+	for (int i = 0; i < count; ++i) {
+		BMP_End(gPreloaded[i].mDecode);
+	}
+
+	return gPreloadWork * 1E-9;
+}
+
+bool Image_TakePreloaded(const char * filename, image32_s &image) {
+	for (int i = 0; i < gNumPreloaded; ++i) {
+		preloaded_image_s &p = gPreloaded[i];
+		if (!p.mDecode.mError && p.mImage.mData && !strcmp(p.mFileName, filename)) {
+			if (image.mData) {
+				free(image.mData);
 			}
+
+			image = p.mImage; // hand over the pixels
+			p.mImage.mData = nullptr;
+			return true;
 		}
 	}
-	else if (infohead->biBitCount == 32) {
-		int src_line_len = infohead->biWidth * 4;
 
-		int valid_size = sizeof(bmpfilehead_s) + sizeof(bmpinfohead_s) + src_line_len * infohead->biHeight;
-		if (valid_size > size) {
+	return false;
+}
+
+void Image_FreePreloaded() {
+	if (gPreloaded) {
+		for (int i = 0; i < gNumPreloaded; ++i) {
+			BMP_End(gPreloaded[i].mDecode);
+		}
+
+		delete[] gPreloaded;
+		gPreloaded = nullptr;
+	}
+
+	gNumPreloaded = 0;
+	gNumPreloadBands = 0;
+}
+
+bool File_MakeDir(const char * dir) {
+#if defined(_WIN32)
+	return CreateDirectoryA(dir, nullptr) || GetLastError() == ERROR_ALREADY_EXISTS;
+#endif
+
+#if defined(__linux__)
+	return mkdir(dir, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+bool File_Replace(const char * src, const char * dst) {
+#if defined(_WIN32)
+	return MoveFileExA(src, dst, MOVEFILE_REPLACE_EXISTING) != 0;
+#endif
+
+#if defined(__linux__)
+	return rename(src, dst) == 0;
+#endif
+}
+
+bool File_Map(const char * filename, mapped_file_s &mf) {
+	File_Unmap(mf);
+
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	HANDLE mapping = nullptr;
+	const void * data = nullptr;
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping) {
+			data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		}
+	}
+
+	if (!data) {
+		if (mapping) {
+			CloseHandle(mapping);
+		}
+		CloseHandle(file);
+		return false;
+	}
+
+	mf.mData = (const byte*)data;
+	mf.mSize = (size_t)size.QuadPart;
+	mf.mFile = (intptr_t)file;
+	mf.mMapping = (intptr_t)mapping;
+#endif
+
+#if defined(__linux__)
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		close(fd);
+		return false;
+	}
+
+	void * data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping keeps the file
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+	mf.mData = (const byte*)data;
+	mf.mSize = (size_t)st.st_size;
+#endif
+
+	return true;
+}
+
+void File_Unmap(mapped_file_s &mf) {
+	if (!mf.mData) {
+		return;
+	}
+
+#if defined(_WIN32)
+	UnmapViewOfFile(mf.mData);
+	CloseHandle((HANDLE)mf.mMapping);
+	CloseHandle((HANDLE)mf.mFile);
+#endif
+
+#if defined(__linux__)
+	munmap((void*)mf.mData, mf.mSize);
+#endif
+
+	mf = mapped_file_s();
+}
+
+#pragma pack(push, 1)
+
+// raw height field file, the samples follow
+struct hf_header_s {
+	dword		mMagic;
+	int32_t		mWidth;
+	int32_t		mHeight;
+	int32_t		mFormat;	// height_format_t
+	float		mScale;
+	float		mOffset;
+};
+
+#pragma pack(pop)
+
+static const dword HF_MAGIC = 0x444c4648; // "HFLD"
+
+static bool LoadRawHeightField(const char * filename, height_field_s &hf) {
+	if (!File_Map(filename, hf.mMapping)) {
+		SYS_ERROR("could not map %s\n", filename);
+		return false;
+	}
+
+	const hf_header_s * header = (const hf_header_s*)hf.mMapping.mData;
+	if (hf.mMapping.mSize < sizeof(hf_header_s) || header->mMagic != HF_MAGIC
+		|| header->mFormat < HF_UNORM8 || header->mFormat > HF_FLOAT32 || header->mWidth <= 0 || header->mHeight <= 0) {
+		SYS_ERROR("bad height field %s\n", filename);
+		File_Unmap(hf.mMapping);
+		return false;
+	}
+
+	hf.mWidth = header->mWidth;
+	hf.mHeight = header->mHeight;
+	hf.mFormat = (height_format_t)header->mFormat;
+	hf.mScale = header->mScale;
+	hf.mOffset = header->mOffset;
+
+	if (hf.mMapping.mSize < sizeof(hf_header_s) + (size_t)hf.mWidth * hf.mHeight * hf.GetSampleSize()) {
+		SYS_ERROR("bad size\n");
+		File_Unmap(hf.mMapping);
+		return false;
+	}
+
+	hf.mSamples = header + 1; // no copy, pages are read on first touch
+	return true;
+}
+
+// one row buffer instead of a whole RGBA image, 8 bits indexed uncompressed, 24 and 32 bits
+static bool LoadBMPHeightField(FILE * f, const char * filename, height_field_s &hf) {
+	bmpfilehead_s filehead;
+	bmpinfohead_s infohead;
+	if (fread(&filehead, sizeof(filehead), 1, f) != 1 || fread(&infohead, sizeof(infohead), 1, f) != 1) {
+		SYS_ERROR("bad size\n");
+		return false;
+	}
+
+	int bpp = infohead.biBitCount / 8;
+	bool streamed = infohead.biCompression == BI_RGB && (bpp == 1 || bpp == 3 || bpp == 4)
+		&& infohead.biWidth > 0 && infohead.biHeight > 0;
+
+	if (!streamed) { // RLE8 and 16 bits through the full decoder
+		image32_s image;
+		if (!File_LoadBMP(filename, image)) {
+			return false;
+		}
+
+		hf.mWidth = image.mWidth;
+		hf.mHeight = image.mHeight;
+		hf.AllocDataSpace(hf.mWidth * hf.mHeight);
+
+		int pixels = hf.mWidth * hf.mHeight;
+		for (int i = 0; i < pixels; ++i) {
+			hf.mData[i] = image.mData[i * 4]; // red
+		}
+
+		return true;
+	}
+
+	byte palette[256 * 4];
+	if (bpp == 1) {
+		int colors = infohead.biClrUsed ? glm::min((int)infohead.biClrUsed, 256) : 256;
+		memset(palette, 0, sizeof(palette));
+		if (fread(palette, 4, colors, f) != (size_t)colors) {
+			SYS_ERROR("bad size\n");
+			return false;
+		}
+	}
+
+	hf.mWidth = infohead.biWidth;
+	hf.mHeight = infohead.biHeight;
+	hf.AllocDataSpace(hf.mWidth * hf.mHeight);
+
+	int src_line_len = (hf.mWidth * bpp + 3) & ~3;
+	byte * src_line = (byte*)malloc(src_line_len);
+	bool error = fseek(f, filehead.bfOffBits, SEEK_SET) != 0;
+
+	for (int h = 0; h < hf.mHeight && !error; ++h) { // bottom row first, same as the height field
+		if (fread(src_line, src_line_len, 1, f) != 1) {
 			SYS_ERROR("bad size\n");
 			error = true;
+			break;
+		}
+
+		byte * dst_line = hf.mData + hf.mWidth * h;
+		if (bpp == 1) {
+			for (int w = 0; w < hf.mWidth; ++w) {
+				dst_line[w] = palette[src_line[w] * 4 + 2]; // red
+			}
 		}
 		else {
-			image.mWidth = infohead->biWidth;
-			image.mHeight = infohead->biHeight;
-			image.AllocDataSpace(infohead->biWidth * 4 * infohead->biHeight);
+			for (int w = 0; w < hf.mWidth; ++w) {
+				dst_line[w] = src_line[w * bpp + 2]; // red
+			}
+		}
+	}
 
-			byte * src = (byte*)(infohead + 1);
+	free(src_line);
 
-			int dst_line_len = infohead->biWidth * 4;
+	return !error;
+}
 
-			for (int h = 0; h < infohead->biHeight; ++h) {
-				byte * src_line = src + src_line_len * h;
-				byte * dst_line = image.mData + dst_line_len * h;
+bool File_LoadHeightField(const char * filename, height_field_s &hf) {
+	FILE * f = File_Open(filename, "rb");
+	if (!f) {
+		SYS_ERROR("could not open %s\n", filename);
+		return false;
+	}
 
-				for (int w = 0; w < infohead->biWidth; ++w) {
-					byte * src_clr = src_line + w * 4;
-					byte * dst_clr = dst_line + w * 4;
-					dst_clr[0] = src_clr[2]; // red
-					dst_clr[1] = src_clr[1]; // green
-					dst_clr[2] = src_clr[0]; // blue
-					dst_clr[3] = src_clr[3]; // alpha
+	dword magic = 0;
+	bool ok = false;
+	if (fread(&magic, sizeof(magic), 1, f) == 1) {
+		if (magic == HF_MAGIC) {
+			fclose(f);
+			return LoadRawHeightField(filename, hf);
+		}
+
+		if ((magic & 0xffff) == 0x4d42) { // "BM"
+			fseek(f, 0, SEEK_SET);
+			ok = LoadBMPHeightField(f, filename, hf);
+		}
+		else {
+			SYS_ERROR("unknown height field format %s\n", filename);
+		}
+	}
+
+	fclose(f);
+	return ok;
+}
+
+bool File_SaveHeightField(const char * filename, const height_field_s &hf, height_format_t format) {
+	hf_header_s header;
+	header.mMagic = HF_MAGIC;
+	header.mWidth = hf.mWidth;
+	header.mHeight = hf.mHeight;
+	header.mFormat = format;
+	header.mScale = 1.0f;
+	header.mOffset = 0.0f;
+
+	float * heights = (float*)malloc(sizeof(float) * hf.mWidth);
+
+	if (format == HF_UNORM16) {
+		if (hf.mFormat == HF_FLOAT32) { // quantize the range
+			float lo = FLT_MAX;
+			float hi = -FLT_MAX;
+			for (int h = 0; h < hf.mHeight; ++h) {
+				hf.GetRow(h, heights);
+				for (int w = 0; w < hf.mWidth; ++w) {
+					lo = glm::min(lo, heights[w]);
+					hi = glm::max(hi, heights[w]);
 				}
 			}
+
+			header.mScale = glm::max(hi - lo, 1e-6f) / 65535.0f;
+			header.mOffset = lo;
+		}
+		else { // widen the integer samples, exact
+			header.mScale = hf.mFormat == HF_UNORM8 ? hf.mScale / 256.0f : hf.mScale;
+			header.mOffset = hf.mOffset;
 		}
 	}
-	else {
-		error = true;
+
+	FILE * f = File_Open(filename, "wb");
+	if (!f) {
+		free(heights);
+		return false;
 	}
 
-	free(buf);
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
 
-	return !error;
+	int sample_size = format == HF_UNORM16 ? (int)sizeof(uint16_t) : (int)sizeof(float);
+	void * dst_line = malloc(sample_size * hf.mWidth);
+
+	for (int h = 0; ok && h < hf.mHeight; ++h) {
+		if (format == HF_UNORM16) {
+			uint16_t * dst = (uint16_t*)dst_line;
+			if (hf.mFormat == HF_UNORM8) {
+				const byte * src = (const byte*)hf.mSamples + (size_t)hf.mWidth * h;
+				for (int w = 0; w < hf.mWidth; ++w) {
+					dst[w] = (uint16_t)(src[w] << 8);
+				}
+			}
+			else if (hf.mFormat == HF_UNORM16) {
+				memcpy(dst, (const uint16_t*)hf.mSamples + (size_t)hf.mWidth * h, sizeof(uint16_t) * hf.mWidth);
+			}
+			else {
+				hf.GetRow(h, heights);
+				for (int w = 0; w < hf.mWidth; ++w) {
+					dst[w] = (uint16_t)glm::clamp((heights[w] - header.mOffset) / header.mScale + 0.5f, 0.0f, 65535.0f);
+				}
+			}
+		}
+		else {
+			hf.GetRow(h, (float*)dst_line);
+		}
+
+		ok = fwrite(dst_line, sample_size * hf.mWidth, 1, f) == 1;
+	}
+
+	free(dst_line);
+	free(heights);
+	ok = fclose(f) == 0 && ok;
+
+	if (!ok) {
+		SYS_ERROR("could not write %s\n", filename); // disk full
+	}
+
+	return ok;
 }
 
-bool File_LoadRawHeightFieldFrom8BitBMP(const char * filename, height_field_s &hf) {
-	image32_s temp_image;
-	if (!File_LoadBMP(filename, temp_image)) {
+bool File_SaveBMP(const char * filename, const image32_s &image) {
+	FILE * f = File_Open(filename, "wb");
+	if (!f) {
 		return false;
 	}
 
-	hf.mWidth = temp_image.mWidth;
-	hf.mHeight = temp_image.mHeight;
-	hf.AllocDataSpace(hf.mWidth * hf.mHeight);
+	// 24 bits, bottom-up rows like glReadPixels
+	int dst_line_len = (image.mWidth * 3 + 3) & ~3;
+
+	bmpfilehead_s filehead;
+	bmpinfohead_s infohead;
+	memset(&filehead, 0, sizeof(filehead));
+	memset(&infohead, 0, sizeof(infohead));
 
-	int src_line_len = temp_image.mWidth * 4;
-	int dst_line_len = hf.mWidth;
+	filehead.bfType = 0x4d42; // "BM"
+	filehead.bfOffBits = sizeof(bmpfilehead_s) + sizeof(bmpinfohead_s);
+	filehead.bfSize = filehead.bfOffBits + dst_line_len * image.mHeight;
 
-	for (int h = 0; h < hf.mHeight; ++h) {
-		byte * src_line = temp_image.mData + src_line_len * h;
-		byte * dst_line = hf.mData + dst_line_len * h;
+	infohead.biSize = sizeof(bmpinfohead_s);
+	infohead.biWidth = image.mWidth;
+	infohead.biHeight = image.mHeight;
+	infohead.biPlanes = 1;
+	infohead.biBitCount = 24;
+	infohead.biCompression = 0; // BI_RGB
+	infohead.biSizeImage = dst_line_len * image.mHeight;
 
-		for (int w = 0; w < hf.mWidth; ++w) {
-			byte * src_clr = src_line + w * 4;
-			byte * dst_z = dst_line + w;
+	fwrite(&filehead, sizeof(filehead), 1, f);
+	fwrite(&infohead, sizeof(infohead), 1, f);
 
-			*dst_z = src_clr[0];
+	byte * dst_line = (byte*)malloc(dst_line_len);
+	memset(dst_line, 0, dst_line_len);
+
+	for (int h = 0; h < image.mHeight; ++h) {
+		const byte * src_line = image.mData + image.mWidth * 4 * h;
+
+		for (int w = 0; w < image.mWidth; ++w) {
+			dst_line[w * 3 + 0] = src_line[w * 4 + 2]; // blue
+			dst_line[w * 3 + 1] = src_line[w * 4 + 1]; // green
+			dst_line[w * 3 + 2] = src_line[w * 4 + 0]; // red
 		}
+
+		fwrite(dst_line, dst_line_len, 1, f);
 	}
 
+	free(dst_line);
+	fclose(f);
+
 	return true;
 }
 
@@ -676,6 +1292,10 @@ static sys_timer_t::time_point gBaseTime;
 
 void Sys_InitTimer() {
 	gBaseTime = sys_timer_t::now();
+
+#if defined(_WIN32)
+	timeBeginPeriod(1); // 1 ms sleep granularity for the frame scheduler
+#endif
 }
 
 double Sys_GetRelativeTime() {
@@ -685,13 +1305,240 @@ double Sys_GetRelativeTime() {
 	return delta.count() * 1E-9;
 }
 
+double Sys_GetProcessTime() {
+#if defined(_WIN32)
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+		return 0.0;
+	}
+
+	uint64_t kernel = ((uint64_t)kernel_time.dwHighDateTime << 32) | kernel_time.dwLowDateTime;
+	uint64_t user = ((uint64_t)user_time.dwHighDateTime << 32) | user_time.dwLowDateTime;
+	return (kernel + user) * 1E-7; // 100 ns units
+#endif
+
+#if defined(__linux__)
+	timespec ts;
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts)) {
+		return 0.0;
+	}
+	return ts.tv_sec + ts.tv_nsec * 1E-9;
+#endif
+}
+
+size_t Sys_GetPeakMemoryUsage() {
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+		return 0;
+	}
+	return pmc.PeakWorkingSetSize;
+#endif
+
+#if defined(__linux__)
+	rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru)) {
+		return 0;
+	}
+	return (size_t)ru.ru_maxrss * 1024; // KB
+#endif
+}
+
+int Sys_GetProcessId() {
+#if defined(_WIN32)
+	return (int)GetCurrentProcessId();
+#endif
+
+#if defined(__linux__)
+	return (int)getpid();
+#endif
+}
+
+// OS sleep may wake this late
+static const double SLEEP_SPIN_TIME = 0.002;
+
+void Sys_SleepUntil(double t) {
+	double remaining = t - Sys_GetRelativeTime();
+	if (remaining > SLEEP_SPIN_TIME) {
+		std::this_thread::sleep_for(std::chrono::duration<double>(remaining - SLEEP_SPIN_TIME));
+	}
+
+	while (Sys_GetRelativeTime() < t) {
+		std::this_thread::yield();
+	}
+}
+
+/*
+================================================================================
+threads
+================================================================================
+*/
+static std::thread *			gWorkers = nullptr;
+static int						gNumWorkers = 0;
+static std::mutex				gJobMutex;
+static std::mutex				gJobOwner;		// held by the thread running a job on the workers
+static std::condition_variable	gJobStart;
+static std::condition_variable	gJobDone;
+static uint32_t					gJobGeneration = 0;
+static int						gJobBusyWorkers = 0;
+static bool						gJobQuit = false;
+static sys_parallel_proc_t		gJobProc = nullptr;
+static void *					gJobContext = nullptr;
+static int						gJobCount = 0;
+static std::atomic<int>			gJobNext(0);
+
+static void RunJobItems() {
+	for (;;) {
+		int index = gJobNext.fetch_add(1);
+		if (index >= gJobCount) {
+			break;
+		}
+		gJobProc(gJobContext, index);
+	}
+}
+
+static void WorkerMain() {
+	uint32_t generation = 0;
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(gJobMutex);
+			while (!gJobQuit && gJobGeneration == generation) {
+				gJobStart.wait(lock);
+			}
+
+			if (gJobQuit) {
+				return;
+			}
+
+			generation = gJobGeneration;
+		}
+
+		RunJobItems();
+
+		std::lock_guard<std::mutex> lock(gJobMutex);
+		if (--gJobBusyWorkers == 0) {
+			gJobDone.notify_one();
+		}
+	}
+}
+
+void Sys_InitThreads(int num_threads) {
+	Sys_ShutdownThreads();
+
+	if (num_threads <= 0) {
+		num_threads = (int)std::thread::hardware_concurrency();
+	}
+
+	gJobQuit = false;
+	gNumWorkers = glm::max(num_threads - 1, 0);
+
+	if (gNumWorkers) {
+		gWorkers = NEW__ std::thread[gNumWorkers];
+		for (int i = 0; i < gNumWorkers; ++i) {
+			gWorkers[i] = std::thread(WorkerMain);
+		}
+	}
+}
+
+void Sys_ShutdownThreads() {
+	if (!gWorkers) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(gJobMutex);
+		gJobQuit = true;
+	}
+	gJobStart.notify_all();
+
+	for (int i = 0; i < gNumWorkers; ++i) {
+		gWorkers[i].join();
+	}
+
+	delete[] gWorkers;
+	gWorkers = nullptr;
+	gNumWorkers = 0;
+}
+
+int Sys_GetThreadCount() {
+	return gNumWorkers + 1;
+}
+
+void Sys_ParallelFor(int count, sys_parallel_proc_t proc, void *context) {
+	// a task thread does not wait for the job of another thread, it goes on by itself
+	std::unique_lock<std::mutex> owner(gJobOwner, std::defer_lock);
+	if (!gNumWorkers || count <= 1 || !owner.try_lock()) {
+		for (int i = 0; i < count; ++i) {
+			proc(context, i);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(gJobMutex);
+		gJobProc = proc;
+		gJobContext = context;
+		gJobCount = count;
+		gJobNext = 0;
+		gJobBusyWorkers = gNumWorkers;
+		gJobGeneration++;
+	}
+	gJobStart.notify_all();
+
+	RunJobItems();
+
+	// every worker leaves the job before the next one may start
+	std::unique_lock<std::mutex> lock(gJobMutex);
+	while (gJobBusyWorkers) {
+		gJobDone.wait(lock);
+	}
+}
+
+static void TaskMain(sys_task_s *task, sys_task_proc_t proc, void *context) {
+	proc(context);
+	task->mEndTime = Sys_GetRelativeTime();
+}
+
+void Sys_StartTask(sys_task_s &task, sys_task_proc_t proc, void *context) {
+	Sys_WaitTask(task);
+
+	task.mStartTime = Sys_GetRelativeTime();
+	task.mEndTime = 0.0;
+	task.mThread = NEW__ std::thread(TaskMain, &task, proc, context);
+}
+
+double Sys_WaitTask(sys_task_s &task) {
+	if (!task.mThread) {
+		return 0.0;
+	}
+
+	double t1 = Sys_GetRelativeTime();
+
+	std::thread *thread = (std::thread*)task.mThread;
+	thread->join();
+	delete thread;
+	task.mThread = nullptr;
+
+	return Sys_GetRelativeTime() - t1;
+}
+
 /*
 ================================================================================
 GL Helper
 ================================================================================
 */
 bool GL_Init() {
-	if (GLEW_OK != glewInit()) {
+	GLenum err = glewInit();
+
+#if defined(__linux__)
+	// an EGL context has no GLX display, the GL entry points are loaded anyway
+	if (err == GLEW_ERROR_NO_GLX_DISPLAY) {
+		err = GLEW_OK;
+	}
+#endif
+
+	if (GLEW_OK != err) {
 		SYS_ERROR("glewInit error\n");
 		return false;
 	}
@@ -766,7 +1613,8 @@ static const GLenum TO_GL_SHADER[] = {
 	GL_TESS_CONTROL_SHADER,
 	GL_TESS_EVALUATION_SHADER,
 	GL_GEOMETRY_SHADER,
-	GL_FRAGMENT_SHADER
+	GL_FRAGMENT_SHADER,
+	GL_COMPUTE_SHADER
 };
 
 bool GL_CreateProgram(const gl_shader_desc_s &desc, gl_program_s &program) {
@@ -833,6 +1681,39 @@ bool GL_CreateProgram(const char *res_dir, const char * vs, const char *fs, gl_p
 	return GL_CreateProgram(shader_desc, prog);
 }
 
+bool GL_CreateProgram(const char *res_dir, const char * vs, const char *tcs, const char *tes, const char *fs, gl_program_s &prog) {
+	char vsfilename[MAX_PATH];
+	char tcsfilename[MAX_PATH];
+	char tesfilename[MAX_PATH];
+	char fsfilename[MAX_PATH];
+
+	sprintf_(vsfilename, "%s%sshaders%s%s", res_dir, PATH_SEPERATOR, PATH_SEPERATOR, vs);
+	sprintf_(tcsfilename, "%s%sshaders%s%s", res_dir, PATH_SEPERATOR, PATH_SEPERATOR, tcs);
+	sprintf_(tesfilename, "%s%sshaders%s%s", res_dir, PATH_SEPERATOR, PATH_SEPERATOR, tes);
+	sprintf_(fsfilename, "%s%sshaders%s%s", res_dir, PATH_SEPERATOR, PATH_SEPERATOR, fs);
+
+	gl_shader_desc_s shader_desc;
+
+	shader_desc.mFiles[VERTEX_SHADER] = vsfilename;
+	shader_desc.mFiles[TESSELLATION_CONTROL_SHADER] = tcsfilename;
+	shader_desc.mFiles[TESSELLATION_EVALUATION_SHADER] = tesfilename;
+	shader_desc.mFiles[FRAGMENT_SHADER] = fsfilename;
+
+	return GL_CreateProgram(shader_desc, prog);
+}
+
+bool GL_CreateComputeProgram(const char *res_dir, const char * cs, gl_program_s &prog) {
+	char csfilename[MAX_PATH];
+
+	sprintf_(csfilename, "%s%sshaders%s%s", res_dir, PATH_SEPERATOR, PATH_SEPERATOR, cs);
+
+	gl_shader_desc_s shader_desc;
+
+	shader_desc.mFiles[COMPUTE_SHADER] = csfilename;
+
+	return GL_CreateProgram(shader_desc, prog);
+}
+
 void GL_DeleteProgram(gl_program_s &program) {
 	if (program.mProgram) {
 		for (int s = VERTEX_SHADER; s < SUPPORT_SHADER_COUNT; ++s) {
@@ -848,9 +1729,38 @@ void GL_DeleteProgram(gl_program_s &program) {
 	}
 }
 
+static const TextureCache *		gTextureCache = nullptr;
+
+void GL_SetTextureCache(const TextureCache *cache) {
+	gTextureCache = cache;
+}
+
+static void UploadTextureMips(const texture_mips_s &mips, bool mipmap) {
+	int num_levels = mipmap ? mips.mNumLevels : 1;
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, mipmap && mips.mNumLevels == 1 ? 1000 : num_levels - 1);
+
+	for (int l = 0; l < num_levels; ++l) {
+		const texture_level_s &level = mips.mLevels[l];
+
+		if (mips.mFormat == TF_RGBA8) {
+			glTexImage2D(GL_TEXTURE_2D, l, GL_RGBA8, level.mWidth, level.mHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, level.mData);
+		}
+		else {
+			GLenum format = mips.mFormat == TF_BC1 ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+			glCompressedTexImage2D(GL_TEXTURE_2D, l, format, level.mWidth, level.mHeight, 0, level.mSize, level.mData);
+		}
+	}
+
+	if (mipmap && mips.mNumLevels == 1) {
+		glGenerateMipmap(GL_TEXTURE_2D);
+	}
+}
+
 GLuint GL_CreateTexture2D(const gl_texture2d_desc_s &desc) {
+	const texture_mips_s * mips = gTextureCache ? gTextureCache->Find(desc.mFileName) : nullptr;
+
 	image32_s image;
-	if (!File_LoadBMP(desc.mFileName, image)) {
+	if (!mips && !File_LoadBMP(desc.mFileName, image)) {
 		return 0;
 	}
 
@@ -867,6 +1777,11 @@ GLuint GL_CreateTexture2D(const gl_texture2d_desc_s &desc) {
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, min_filter);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, mag_filter);
 
+	if (mips) {
+		UploadTextureMips(*mips, desc.mMipMap);
+		return t;
+	}
+
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, image.mWidth, image.mHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.mData);
 	if (desc.mMipMap) {
 		glGenerateMipmap(GL_TEXTURE_2D);
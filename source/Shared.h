@@ -8,6 +8,7 @@ shared data type & function
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <float.h>
 
 #if defined(_WIN32)
 
@@ -68,6 +69,8 @@ macros
 #define		Z_FAR				4096.0f
 #define		FOVY				70.0f
 #define		PI					3.14159265358979323846f
+#define		MAX_FRAMES_IN_FLIGHT	3
+#define		MAX_CHUNK_LEVEL		6		// 4096 terrain chunks
 
 #ifndef		MAX_PATH 
 # define	MAX_PATH			260
@@ -81,10 +84,20 @@ macros
 
 #define		arraysize(A)		(sizeof(A) / sizeof(A[0]))
 
+#if defined(_MSC_VER)
+# include <xmmintrin.h>
+# define	PREFETCH(P)			_mm_prefetch((const char *)(P), _MM_HINT_T0)
+#endif
+
+#if defined(__GNUC__)
+# define	PREFETCH(P)			__builtin_prefetch(P)
+#endif
+
 enum draw_flag_s {
 	DF_SKYBOX = 1,
 	DF_SOLID_TERRAIN = 2,
-	DF_WIREFRAME_TERRAIN = 4
+	DF_WIREFRAME_TERRAIN = 4,
+	DF_PERF_HUD = 8
 };
 
 /*
@@ -96,6 +109,23 @@ typedef		uint8_t				byte;
 typedef		uint16_t			word;
 typedef		uint32_t			dword;
 
+enum terrain_backend_t {
+	TB_QUAD_COLLAPSE,	// CPU level of detail, mesh uploaded every frame
+	TB_TESSELLATION		// static patch grid, refined by tessellation shaders
+};
+
+enum vertex_format_t {
+	VF_FLOAT3,			// vec3 position, 12 bytes
+	VF_PACKED_GRID,		// grid x:13, y:13, parent direction:4, 4 bytes, see PackGridVertex
+	VF_QUANTIZED		// unorm16 x, y, z over the terrain bounds and a pad, 8 bytes
+};
+
+enum frame_pacing_t {
+	FP_VSYNC,			// swap interval 1, the swap blocks
+	FP_FIXED,			// sleep until the next frame deadline
+	FP_UNCAPPED			// as fast as possible, for benchmarking
+};
+
 // demo configuration
 struct config_s {
 	int							mViewWidth;
@@ -112,11 +142,33 @@ struct config_s {
 	float						mTerrainZScale;
 	const char *				mTerrainBase;
 	const char *				mTerrainDetail;
+	const char *				mTerrainPvs;			// baked visibility set, empty: none
+	const char *				mTextureCache;			// prepared mip chains, relative to res, empty: none
+	bool						mTextureCompression;	// BC1 / BC3 levels in the cache
 	vec3						mBackgroundColor;
 	vec3						mWireframeColor;
 	vec3						mFogColor;
 	float						mFogDensity;
 	vec3						mFontColor;
+	bool						mPersistentMeshBuffer;	// assemble mesh directly into mapped GL memory
+	int							mMaxFramesInFlight;		// 0: glFinish every frame
+	bool						mPersistentUniformBuffer;	// one mapped uniform ring instead of per block buffers
+	terrain_backend_t			mTerrainBackend;
+	float						mTessPixelsPerEdge;		// target triangle edge length on screen
+	vertex_format_t				mTerrainVertexFormat;
+	int							mTerrainChunkLevel;		// 0: upload the whole mesh, otherwise 4^level chunks
+	bool						mTerrainGpuCulling;		// frustum cull chunks in a compute shader
+	int							mTerrainRefineChanges;	// splits and merges per frame, 0: no limit
+	float						mTerrainRefineTime;		// refinement deadline, ms, 0: none
+	float						mTerrainPredictHorizon;	// refine ahead along the camera velocity, seconds, 0: off
+	float						mTerrainMaxError;		// object space, flatter vert nodes are never split
+	int							mTerrainOcclusionWidth;	// software occlusion buffer width, 0: off
+	int							mWorkerThreads;			// including the main thread, 0: one per core
+	bool						mSkipIdleFrames;		// no LOD update and upload while nothing changed
+	bool						mRedrawIdleFrames;		// keep redrawing at the frame rate while idle
+	frame_pacing_t				mFramePacing;
+	float						mFrameRate;				// target of fixed pacing, Hz
+	float						mTickRate;				// simulation ticks per second
 
 	config_s() {
 		mViewWidth = VIEW_WIDTH;
@@ -133,11 +185,33 @@ struct config_s {
 		mTerrainZScale = 1.0f;
 		mTerrainBase = nullptr;
 		mTerrainDetail = nullptr;
+		mTerrainPvs = "";
+		mTextureCache = "";
+		mTextureCompression = false;
 		mBackgroundColor = vec3(0.0f);
 		mWireframeColor = vec3(0.0f);
 		mFogColor = vec3(0.0f);
 		mFogDensity = 0.005f;
 		mFogColor = vec3(0.0f);
+		mPersistentMeshBuffer = true;
+		mMaxFramesInFlight = 2;
+		mPersistentUniformBuffer = true;
+		mTerrainBackend = TB_QUAD_COLLAPSE;
+		mTessPixelsPerEdge = 8.0f;
+		mTerrainVertexFormat = VF_FLOAT3;
+		mTerrainChunkLevel = 0;
+		mTerrainGpuCulling = false;
+		mTerrainRefineChanges = 0;
+		mTerrainRefineTime = 0.0f;
+		mTerrainPredictHorizon = 0.0f;
+		mTerrainMaxError = 0.0f;
+		mTerrainOcclusionWidth = 0;
+		mWorkerThreads = 0;
+		mSkipIdleFrames = true;
+		mRedrawIdleFrames = false;
+		mFramePacing = FP_FIXED;
+		mFrameRate = 60.0f;
+		mTickRate = 60.0f;
 	}
 };
 
@@ -148,6 +222,7 @@ struct vertex_s {
 
 struct camera_s {
 	vec3						mPos;
+	vec3						mVelocity;	// units per second, predictive refinement
 	vec3						mTarget;
 	vec3						mUp;
 	float						mZNear;
@@ -156,6 +231,7 @@ struct camera_s {
 
 	camera_s() {
 		mPos = vec3(0.0f);
+		mVelocity = vec3(0.0f);
 		mTarget = START_FORWARD;
 		mUp = START_UP;
 		mZNear = Z_NEAR;
@@ -167,6 +243,8 @@ struct camera_s {
 struct frustum_plane_s {
 	vec4						mLeftPlane;
 	vec4						mRightPlane;
+	mat4						mViewProj;	// same as the renderer's
+	float						mAspect;	// viewport width / height
 
 	void						Setup(int viewport_width, int viewport_height, const camera_s &cam);
 	bool						CullHorizontalCircle(const vec3 &center, float radius) const;
@@ -210,34 +288,174 @@ struct image32_s {
 	void						AllocDataSpace(int pixels);
 };
 
+enum texture_format_t {
+	TF_RGBA8,
+	TF_BC1,		// DXT1, opaque
+	TF_BC3,		// DXT5
+};
+
+#define	MAX_TEXTURE_LEVELS		16
+
+struct texture_level_s {
+	int							mWidth;
+	int							mHeight;
+	int							mSize;		// bytes
+	const byte *				mData;
+};
+
+// mip levels of a texture, level 0 first. a single level of a mipmapped texture gets the rest from GL
+struct texture_mips_s {
+	texture_format_t			mFormat;
+	int							mNumLevels;
+	texture_level_s				mLevels[MAX_TEXTURE_LEVELS];
+};
+
+// read only view of a whole file
+struct mapped_file_s {
+	const byte *				mData;
+	size_t						mSize;
+	intptr_t					mFile;		// platform handles
+	intptr_t					mMapping;
+
+	mapped_file_s() :
+		mData(nullptr),
+		mSize(0),
+		mFile(0),
+		mMapping(0)
+	{
+	}
+};
+
+enum height_format_t {
+	HF_UNORM8,
+	HF_UNORM16,
+	HF_FLOAT32,
+};
+
+// rows from y = 0, height = sample * mScale + mOffset.
+// mSamples points into mData, or into mMapping for a raw height field file
 struct height_field_s {
 	int							mWidth;
 	int							mHeight;
+	height_format_t				mFormat;
+	float						mScale;
+	float						mOffset;
+	const void *				mSamples;
 	byte *						mData;
+	mapped_file_s				mMapping;
 
 	height_field_s() :
 		mWidth(0),
 		mHeight(0),
+		mFormat(HF_UNORM8),
+		mScale(1.0f),
+		mOffset(0.0f),
+		mSamples(nullptr),
 		mData(nullptr)
 	{
 	}
 
-	~height_field_s() {
-		if (mData) {
-			free(mData);
-		}
-	}
+	~height_field_s();
 
 	void						AllocDataSpace(int size);
+	int							GetSampleSize() const;	// bytes
+	void						GetRow(int y, float *heights) const;
+};
+
+// VF_QUANTIZED mapping, position = mOffset + mScale * unorm16 / 65535
+struct vertex_quantization_s {
+	vec3						mOffset;
+	vec3						mScale;
+
+	vertex_quantization_s():
+		mOffset(0.0f),
+		mScale(1.0f)
+	{
+	}
+
+	void						Setup(const vec3 *vertices, int count);	// bounds of all vertices
+	vec3						GetErrorBound() const;	// largest position error, half a step per axis
+
+	void						Quantize(const vec3 &pos, uint16_t *dest) const {
+		vec3 q = clamp((pos - mOffset) / mScale, 0.0f, 1.0f) * 65535.0f + 0.5f;
+		dest[0] = (uint16_t)q.x;
+		dest[1] = (uint16_t)q.y;
+		dest[2] = (uint16_t)q.z;
+		dest[3] = 0;
+	}
+};
+
+// vertices of the active quads under one quad tree node
+struct mesh_chunk_s {
+	int							mFirstVertex;
+	int							mNumVertices;
+	uint64_t					mHash;		// of the vertex data, 0 if written to a MeshSink
+	vec3						mMins;		// bounds of the morphed positions
+	vec3						mMaxs;
 };
 
 struct triangle_mesh_s {
-	const vec3 *				mVertices;
+	const void *				mVertices;
+	vertex_format_t				mVertexFormat;
 	int							mNumTriangles;
+	const mesh_chunk_s *		mChunks;	// nullptr if not chunked
+	int							mNumChunks;
 
 	triangle_mesh_s() {
 		mVertices = nullptr;
+		mVertexFormat = VF_FLOAT3;
 		mNumTriangles = 0;
+		mChunks = nullptr;
+		mNumChunks = 0;
+	}
+};
+
+// receives the active mesh while it is assembled, lets the LOD core write straight into GPU memory
+class MeshSink {
+public:
+	virtual						~MeshSink() {}
+
+	// return write position for up to max_vertices vertices, nullptr if out of space
+	virtual void *				BeginMesh(int max_vertices, int vertex_size) = 0;
+	virtual void				EndMesh(int num_vertices) = 0;
+};
+
+// level of detail statistics, reset every update
+struct lod_stats_s {
+	int							mEmittedVertices;
+	int							mResolvedVertices;	// emitted corners whose vert node is inactive
+	int							mParentWalkSteps;	// parent links followed to resolve them
+	int							mResolveCacheHits;
+	int							mDegenerateTriangles;	// dropped, two corners collapsed together
+	int							mIncompleteTriangles;	// dropped, a corner without active ancestor
+	int							mVisitedVertNodes;
+	int							mVisitedQuadNodes;
+	int							mReusedRefinement;	// 1 if the view position did not move
+	int							mRefineChanges;		// splits and merges applied, time-sliced refinement
+	int							mRefineDeferred;	// left for later frames
+	int							mPredictedSplits;	// vert nodes split ahead of the camera
+	int							mFlatVertNodes;		// in range but left unsplit, error below the max
+	int							mOccluderTriangles;	// rasterized into the occlusion buffer
+	int							mOccludedQuads;		// active quads dropped behind occluders
+	int							mPvsCulledQuads;	// quad nodes hidden from the view cell, with their subtrees
+
+	lod_stats_s() {
+		mEmittedVertices = 0;
+		mResolvedVertices = 0;
+		mParentWalkSteps = 0;
+		mResolveCacheHits = 0;
+		mDegenerateTriangles = 0;
+		mIncompleteTriangles = 0;
+		mVisitedVertNodes = 0;
+		mVisitedQuadNodes = 0;
+		mReusedRefinement = 0;
+		mRefineChanges = 0;
+		mRefineDeferred = 0;
+		mPredictedSplits = 0;
+		mFlatVertNodes = 0;
+		mOccluderTriangles = 0;
+		mOccludedQuads = 0;
+		mPvsCulledQuads = 0;
 	}
 };
 
@@ -249,9 +467,13 @@ public:
 	~ItemArray();
 
 	void						Reset();
+	void						Reserve(int capacity);
+	void						SetCount(int count);	// count <= capacity
 	void						Add(const T &item);
+	T							Pop();
 
 	int							GetCount() const;
+	int							GetCapacity() const;
 	T *							GetItems();
 	const T *					GetItems() const;
 
@@ -281,21 +503,46 @@ void ItemArray<T, INIT_CAPACITY>::Reset() {
 	mSize = 0;
 }
 
+template<class T, int INIT_CAPACITY>
+void ItemArray<T, INIT_CAPACITY>::Reserve(int capacity) {
+	if (capacity > mCapacity) {
+		mCapacity = max(capacity, mCapacity + (mCapacity >> 1));
+		mBuffer = (T*)realloc((void*)mBuffer, sizeof(T) * mCapacity);
+	}
+}
+
+template<class T, int INIT_CAPACITY>
+void ItemArray<T, INIT_CAPACITY>::SetCount(int count) {
+	assert(count <= mCapacity);
+	mSize = count;
+}
+
 template<class T, int INIT_CAPACITY>
 void ItemArray<T, INIT_CAPACITY>::Add(const T &item) {
 	if (mSize == mCapacity) {
 		mCapacity += (mCapacity >> 1);
-		mBuffer = (T*)realloc(mBuffer, sizeof(T) * mCapacity);
+		mBuffer = (T*)realloc((void*)mBuffer, sizeof(T) * mCapacity);
 	}
 
 	mBuffer[mSize++] = item;
 }
 
+template<class T, int INIT_CAPACITY>
+T ItemArray<T, INIT_CAPACITY>::Pop() {
+	assert(mSize > 0);
+	return mBuffer[--mSize];
+}
+
 template<class T, int INIT_CAPACITY>
 int ItemArray<T, INIT_CAPACITY>::GetCount() const {
 	return mSize;
 }
 
+template<class T, int INIT_CAPACITY>
+int ItemArray<T, INIT_CAPACITY>::GetCapacity() const {
+	return mCapacity;
+}
+
 template<class T, int INIT_CAPACITY>
 T * ItemArray<T, INIT_CAPACITY>::GetItems() {
 	return mBuffer;
@@ -312,6 +559,10 @@ helper
 ================================================================================
 */
 uint32_t	ToggleFlags(uint32_t flags, uint32_t bit);
+int			VertexFormat_GetSize(vertex_format_t format);
+const char *	HeightFormat_GetName(height_format_t format);
+height_format_t	HeightFormat_FromName(const char *name);	// "unorm16" or "float32"
+uint64_t	HashFNV1a(const void *data, size_t size);
 
 /*
 ================================================================================
@@ -360,8 +611,21 @@ FILE *	File_Open(const char * filename, const char * mod);
 int		File_GetSize(const char * filename);
 int		File_LoadText(const char * filename, char *buffer, int buffer_size);
 int		File_LoadBinary(const char * filename, char *buffer, int buffer_size);
-bool	File_LoadBMP(const char * filename, image32_s &image);
-bool	File_LoadRawHeightFieldFrom8BitBMP(const char * filename, height_field_s &hf);
+bool	File_LoadBMP(const char * filename, image32_s &image);	// rows on all threads
+bool	File_MakeDir(const char * dir);	// true if it exists
+bool	File_Replace(const char * src, const char * dst);	// renames src over dst, readers of the old dst keep it
+bool	File_Map(const char * filename, mapped_file_s &mf);
+void	File_Unmap(mapped_file_s &mf);
+// raw height field files are mapped, BMP is decoded row by row taking the red channel
+bool	File_LoadHeightField(const char * filename, height_field_s &hf);
+bool	File_SaveHeightField(const char * filename, const height_field_s &hf, height_format_t format);
+bool	File_SaveBMP(const char * filename, const image32_s &image);
+
+// decodes BMP files at once, files and rows on all threads, GL_CreateTexture2D takes them from here.
+// returns the decode time summed over the threads, seconds
+double	Image_Preload(const char * const *filenames, int count);
+bool	Image_TakePreloaded(const char * filename, image32_s &image);
+void	Image_FreePreloaded();
 
 /*
 ================================================================================
@@ -370,6 +634,43 @@ timer
 */
 void	Sys_InitTimer();
 double	Sys_GetRelativeTime();	// seconds
+double	Sys_GetProcessTime();	// CPU seconds of all threads
+size_t	Sys_GetPeakMemoryUsage();	// bytes, resident set of the process
+int		Sys_GetProcessId();
+void	Sys_SleepUntil(double t);	// relative time, sleeps then spins the last bit
+
+/*
+================================================================================
+threads
+================================================================================
+*/
+typedef void(*sys_parallel_proc_t)(void *context, int index);
+
+void	Sys_InitThreads(int num_threads);	// including the calling thread, 0: one per core
+void	Sys_ShutdownThreads();
+int		Sys_GetThreadCount();
+// runs proc for every index in [0, count) on the workers and the calling thread, returns when all are done.
+// serial before Sys_InitThreads, not reentrant. serial too while another thread has the workers
+void	Sys_ParallelFor(int count, sys_parallel_proc_t proc, void *context);
+
+// long work on a thread of its own, next to the main thread and the workers
+typedef void(*sys_task_proc_t)(void *context);
+
+struct sys_task_s {
+	void *						mThread;
+	double						mStartTime;		// relative time
+	double						mEndTime;
+
+	sys_task_s():
+		mThread(nullptr),
+		mStartTime(0.0),
+		mEndTime(0.0)
+	{
+	}
+};
+
+void	Sys_StartTask(sys_task_s &task, sys_task_proc_t proc, void *context);
+double	Sys_WaitTask(sys_task_s &task);	// returns the seconds waited, at once if the task is done or never started
 
 /*
 ================================================================================
@@ -384,6 +685,7 @@ enum gl_shader_t {
 	TESSELLATION_EVALUATION_SHADER,
 	GEOMETRY_SHADER,
 	FRAGMENT_SHADER,
+	COMPUTE_SHADER,
 
 	SUPPORT_SHADER_COUNT
 };
@@ -407,6 +709,8 @@ struct gl_shader_desc_s {
 
 bool	GL_CreateProgram(const gl_shader_desc_s &desc, gl_program_s &program);
 bool	GL_CreateProgram(const char *res_dir, const char * vs, const char *fs, gl_program_s &prog);
+bool	GL_CreateProgram(const char *res_dir, const char * vs, const char *tcs, const char *tes, const char *fs, gl_program_s &prog);
+bool	GL_CreateComputeProgram(const char *res_dir, const char * cs, gl_program_s &prog);
 void	GL_DeleteProgram(gl_program_s &program);
 
 // support BMP file for now
@@ -416,6 +720,9 @@ struct gl_texture2d_desc_s {
 	bool						mRepeat;
 };
 
+// GL_CreateTexture2D takes prepared mips from cache, nullptr: decode the file
+class TextureCache;
+void		GL_SetTextureCache(const TextureCache *cache);
 GLuint		GL_CreateTexture2D(const gl_texture2d_desc_s &desc);
 GLuint		GL_CreateTexture2D(const char *res_dir, const char * filename, bool mipmap, bool repeat);
 
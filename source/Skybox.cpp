@@ -109,12 +109,20 @@ bool Skybox::Init(const config_s &cfg) {
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindVertexArray(0);
 
-	// load textures
-	const char * FILES[] = { "lf.bmp", "ft.bmp", "rt.bmp", "bk.bmp", "tp.bmp", "bt.bmp" };
+	return true;
+}
+
+bool Skybox::CreateTextures(const config_s &cfg) {
+	char files[6][MAX_PATH];
+	GetTextureFiles(cfg, files);
+
 	for (int i = 0; i < 6; ++i) {
-		char filename[MAX_PATH];
-		sprintf_(filename, "%s%s%s", cfg.mSkyboxDir, PATH_SEPERATOR, FILES[i]);
-		mTextures[i] = GL_CreateTexture2D(cfg.mResDir, filename, true, false);
+		gl_texture2d_desc_s tex2d_desc;
+		tex2d_desc.mFileName = files[i];
+		tex2d_desc.mMipMap = true;
+		tex2d_desc.mRepeat = false;
+
+		mTextures[i] = GL_CreateTexture2D(tex2d_desc);
 		if (!mTextures[i]) {
 			return false;
 		}
@@ -123,13 +131,22 @@ bool Skybox::Init(const config_s &cfg) {
 	return true;
 }
 
+int Skybox::GetTextureFiles(const config_s &cfg, char (*files)[MAX_PATH]) {
+	const char * FILES[] = { "lf.bmp", "ft.bmp", "rt.bmp", "bk.bmp", "tp.bmp", "bt.bmp" };
+	for (int i = 0; i < 6; ++i) {
+		sprintf_(files[i], "%s%s%s%s%s", cfg.mResDir, PATH_SEPERATOR, cfg.mSkyboxDir, PATH_SEPERATOR, FILES[i]);
+	}
+
+	return 6;
+}
+
 void Skybox::Draw(UniformBuffers *ub) {
 	glDepthMask(GL_FALSE);
 	glDisable(GL_DEPTH_TEST);
 
 	glUseProgram(mProgram_SkyBox.mProgram);
 	{
-		glBindBufferBase(GL_UNIFORM_BUFFER, 0, ub->mUBO[UniformBuffers::UBO_MODEL_VIEW_PROJ_MATRIX_FOLLOW_CAMERA]);
+		ub->Bind(0, UniformBuffers::UBO_MODEL_VIEW_PROJ_MATRIX_FOLLOW_CAMERA);
 		glBindVertexArray(mVAO);
 
 		for (int i = 0; i < 6; ++i) {
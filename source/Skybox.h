@@ -10,8 +10,11 @@ public:
 	~Skybox();
 
 	bool						Init(const config_s &cfg);
+	bool						CreateTextures(const config_s &cfg);	// after Init, from the prepared texture cache
 	void						Draw(UniformBuffers *ub);
 
+	static int					GetTextureFiles(const config_s &cfg, char (*files)[MAX_PATH]);	// full paths, returns the count
+
 private:
 
 	uint32_t					mVAO;
@@ -5,7 +5,10 @@ terrain geometry
 #include "Precompiled.h"
 
 Terrain::Terrain():
-	mQuadCollapseMesh(nullptr)
+	mWidth(0),
+	mHeight(0),
+	mQuadCollapseMesh(nullptr),
+	mPvs(nullptr)
 {
 }
 
@@ -14,33 +17,69 @@ Terrain::~Terrain() {
 }
 
 bool Terrain::Init(const config_s &cfg) {
-	if (mQuadCollapseMesh) {
-		delete mQuadCollapseMesh;
-		mQuadCollapseMesh = nullptr;
-	}
+	Shutdown();
 
 	char fullfilename[MAX_PATH];
 	sprintf_(fullfilename, "%s%s%s", cfg.mResDir, PATH_SEPERATOR, cfg.mTerrainHeight);
 
+	double t1 = Sys_GetRelativeTime();
+
 	height_field_s hf;
-	if (!File_LoadRawHeightFieldFrom8BitBMP(fullfilename, hf)) {
+	if (!File_LoadHeightField(fullfilename, hf)) {
 		return false;
 	}
 
+	// one allocation, filled row by row from the samples
+	int num_vertices = hf.mWidth * hf.mHeight;
+	mVertices.Reserve(num_vertices);
+	mVertices.SetCount(num_vertices);
+
+	float * heights = (float*)malloc(sizeof(float) * hf.mWidth);
+
 	for (int h = 0; h < hf.mHeight; ++h) {
-		byte * line = hf.mData + hf.mWidth * h;
+		vec3 * line = mVertices.GetItems() + hf.mWidth * h;
+		hf.GetRow(h, heights);
+
 		for (int w = 0; w < hf.mWidth; ++w) {
+			line[w] = vec3((float)w, (float)h, heights[w] * cfg.mTerrainZScale);
+		}
+	}
+
+	free(heights);
+
+	mWidth = hf.mWidth;
+	mHeight = hf.mHeight;
 
-			float x = (float)w;
-			float y = (float)h;
-			float z = (float)line[w] * cfg.mTerrainZScale;
+	double t2 = Sys_GetRelativeTime();
 
-			mVertices.Add(vec3(x, y, z));
+	mQuadCollapseMesh = NEW__ QuadCollapseMesh();
+	mQuadCollapseMesh->SetVertexFormat(cfg.mTerrainVertexFormat);
+	mQuadCollapseMesh->SetChunkLevel(cfg.mTerrainBackend == TB_QUAD_COLLAPSE ? cfg.mTerrainChunkLevel : 0);
+	mQuadCollapseMesh->SetRefineBudget(cfg.mTerrainRefineChanges, cfg.mTerrainRefineTime);
+	mQuadCollapseMesh->SetPredictionHorizon(cfg.mTerrainPredictHorizon);
+	mQuadCollapseMesh->SetMaxError(cfg.mTerrainMaxError);
+	mQuadCollapseMesh->SetOcclusionCulling(cfg.mTerrainBackend == TB_QUAD_COLLAPSE ? cfg.mTerrainOcclusionWidth : 0);
+	if (!mQuadCollapseMesh->Build(mVertices.GetItems(), hf.mWidth, hf.mHeight)) {
+		return false;
+	}
+
+	double t3 = Sys_GetRelativeTime();
+	printf("terrain: %dx%d %s height field loaded in %.1f ms, LOD built in %.1f ms, peak RSS %.1f MB\n",
+		hf.mWidth, hf.mHeight, HeightFormat_GetName(hf.mFormat), (t2 - t1) * 1000.0, (t3 - t2) * 1000.0,
+		Sys_GetPeakMemoryUsage() / (1024.0 * 1024.0));
+
+	if (cfg.mTerrainPvs[0] && cfg.mTerrainBackend == TB_QUAD_COLLAPSE) {
+		sprintf_(fullfilename, "%s%s%s", cfg.mResDir, PATH_SEPERATOR, cfg.mTerrainPvs);
+
+		mPvs = NEW__ PotentiallyVisibleSet();
+		if (!mPvs->Load(fullfilename, *mQuadCollapseMesh, mVertices.GetItems())) {
+			return false;
 		}
+
+		mQuadCollapseMesh->SetVisibilitySet(mPvs);
 	}
 
-	mQuadCollapseMesh = NEW__ QuadCollapseMesh();
-	return mQuadCollapseMesh->Build(mVertices.GetItems(), hf.mWidth, hf.mHeight);
+	return true;
 }
 
 void Terrain::Shutdown() {
@@ -48,15 +87,56 @@ void Terrain::Shutdown() {
 		delete mQuadCollapseMesh;
 		mQuadCollapseMesh = nullptr;
 	}
+
+	if (mPvs) {
+		delete mPvs;
+		mPvs = nullptr;
+	}
 }
 
 int	Terrain::GetSize() const {
 	return mQuadCollapseMesh->GetMaxLevelVerticesLength() - 1;
 }
 
-void Terrain::Update(const camera_s &cam, const frustum_plane_s &fp) {
+int Terrain::GetWidth() const {
+	return mWidth;
+}
+
+int Terrain::GetHeight() const {
+	return mHeight;
+}
+
+const vec3 * Terrain::GetVertices() const {
+	return mVertices.GetItems();
+}
+
+int Terrain::GetMaxLevel() const {
+	return mQuadCollapseMesh->GetMaxLevel();
+}
+
+const float * Terrain::GetActiveDistances() const {
+	return mQuadCollapseMesh->GetActiveDistances();
+}
+
+const vertex_quantization_s & Terrain::GetQuantization() const {
+	return mQuadCollapseMesh->GetQuantization();
+}
+
+size_t Terrain::GetMemoryUsage() const {
+	return sizeof(vec3) * mVertices.GetCapacity() + mQuadCollapseMesh->GetMemoryUsage();
+}
+
+bool Terrain::IsRefinePending() const {
+	return mQuadCollapseMesh->IsRefinePending();
+}
+
+void Terrain::SetFrustumCulling(bool enable) {
+	mQuadCollapseMesh->SetFrustumCulling(enable);
+}
+
+void Terrain::Update(const camera_s &cam, const frustum_plane_s &fp, MeshSink *sink) {
 	//double t1 = Sys_GetRelativeTime();
-	mQuadCollapseMesh->Update(cam, fp);
+	mQuadCollapseMesh->Update(cam, fp, sink);
 	//double t2 = Sys_GetRelativeTime();
 
 	//int ms = (int)((t2 - t1) * 1000.0);
@@ -64,6 +144,25 @@ void Terrain::Update(const camera_s &cam, const frustum_plane_s &fp) {
 	//printf("update time elapsed: %d ms\n", ms);
 }
 
+bool Terrain::BakeVisibility(const char *filename, int level, float clearance) {
+	PotentiallyVisibleSet pvs;
+
+	double t1 = Sys_GetRelativeTime();
+	if (!pvs.Bake(*mQuadCollapseMesh, mVertices.GetItems(), level, clearance)) {
+		return false;
+	}
+	double t2 = Sys_GetRelativeTime();
+
+	printf("visibility: %d cells, level %d, baked in %.3f s on %d threads, %.1f%% of regions visible\n",
+		pvs.GetCellCount(), level, t2 - t1, Sys_GetThreadCount(), pvs.GetVisibleRatio() * 100.0f);
+
+	return pvs.Save(filename);
+}
+
 const triangle_mesh_s & Terrain::GetMesh() const {
 	return mQuadCollapseMesh->GetActiveMesh();
 }
+
+const lod_stats_s & Terrain::GetStats() const {
+	return mQuadCollapseMesh->GetStats();
+}
@@ -13,13 +13,28 @@ public:
 	void						Shutdown();
 
 	int							GetSize() const;
-	void						Update(const camera_s &cam, const frustum_plane_s &fp);
+	int							GetWidth() const;
+	int							GetHeight() const;
+	const vec3 *				GetVertices() const;
+	int							GetMaxLevel() const;
+	const float *				GetActiveDistances() const;	// per quad tree level
+	const vertex_quantization_s &	GetQuantization() const;
+	size_t						GetMemoryUsage() const;	// bytes
+	void						SetFrustumCulling(bool enable);
+	bool						IsRefinePending() const;	// time-sliced refinement not converged yet
+	void						Update(const camera_s &cam, const frustum_plane_s &fp, MeshSink *sink);
+	// bakes the potentially visible set of the loaded height field into filename, on all threads
+	bool						BakeVisibility(const char *filename, int level, float clearance);
 	const triangle_mesh_s &		GetMesh() const;
+	const lod_stats_s &			GetStats() const;
 
 
 private:
 
 	ItemArray<vec3, 1024 * 1024>	mVertices;
+	int							mWidth;
+	int							mHeight;
 
 	QuadCollapseMesh *			mQuadCollapseMesh;
+	PotentiallyVisibleSet *		mPvs;
 };
@@ -0,0 +1,545 @@
+/*
+prepared texture cache
+*/
+
+#include "Precompiled.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <utility>
+
+static const uint32_t	TEX_MAGIC = 0x31584554;	// "TEX1"
+static const int		MAX_TEX_SIZE = 1 << (MAX_TEXTURE_LEVELS - 2);	// level 0 of RGBA still fits an int
+
+TextureCache::TextureCache():
+	mCompress(false),
+	mEntries(nullptr),
+	mNumEntries(0),
+	mDecodeWork(0.0)
+{
+	mCacheDir[0] = 0;
+}
+
+TextureCache::~TextureCache() {
+	WaitPrepare();
+	Free();
+}
+
+void TextureCache::Init(const char *cache_dir, bool compress) {
+	WaitPrepare();
+	Free();
+
+	mCacheDir[0] = 0;
+	mCompress = compress;
+
+	if (cache_dir && cache_dir[0]) {
+		if (File_MakeDir(cache_dir)) {
+			strcpy_(mCacheDir, cache_dir);
+		}
+		else {
+			printf("could not create texture cache \"%s\"\n", cache_dir);
+		}
+	}
+}
+
+void TextureCache::StartPrepare(const char * const *filenames, int count) {
+	WaitPrepare();
+	Free();
+
+	mEntries = NEW__ entry_s[count];
+	mNumEntries = count;
+
+	for (int i = 0; i < count; ++i) {
+		entry_s &e = mEntries[i];
+		strcpy_(e.mFileName, filenames[i]);
+		e.mCacheFileName[0] = 0;
+		e.mSourceHash = 0;
+		e.mValid = false;
+		e.mCached = false;
+		e.mData = nullptr;
+	}
+
+	mDecodeWork = 0.0;
+	Sys_StartTask(mPrepareTask, PrepareProc, this);
+}
+
+double TextureCache::WaitPrepare() {
+	return Sys_WaitTask(mPrepareTask);
+}
+
+void TextureCache::PrepareProc(void *context) {
+	TextureCache * cache = (TextureCache*)context;
+	int count = cache->mNumEntries;
+
+	// hash the sources and map the cache files that match
+	if (cache->mCacheDir[0]) {
+		Sys_ParallelFor(count, HashProc, cache);
+	}
+
+	const char ** missing = (const char**)malloc(sizeof(const char*) * count);
+	int num_missing = 0;
+	for (int i = 0; i < count; ++i) {
+		if (!cache->mEntries[i].mCached) {
+			missing[num_missing++] = cache->mEntries[i].mFileName;
+		}
+	}
+
+	// decode the rest, then build and store their mips
+	if (num_missing) {
+		cache->mDecodeWork = Image_Preload(missing, num_missing);
+		Sys_ParallelFor(count, BuildProc, cache);
+		Image_FreePreloaded();
+	}
+
+	free(missing);
+}
+
+const texture_mips_s * TextureCache::Find(const char *filename) const {
+	for (int i = 0; i < mNumEntries; ++i) {
+		if (mEntries[i].mValid && !strcmp(mEntries[i].mFileName, filename)) {
+			return &mEntries[i].mMips;
+		}
+	}
+
+	return nullptr;
+}
+
+void TextureCache::Free() {
+	if (mEntries) {
+		for (int i = 0; i < mNumEntries; ++i) {
+			if (mEntries[i].mData) {
+				free(mEntries[i].mData);
+			}
+			File_Unmap(mEntries[i].mMapping);
+		}
+
+		delete[] mEntries;
+		mEntries = nullptr;
+	}
+
+	mNumEntries = 0;
+}
+
+int TextureCache::GetCount() const {
+	return mNumEntries;
+}
+
+int TextureCache::GetCachedCount() const {
+	int n = 0;
+	for (int i = 0; i < mNumEntries; ++i) {
+		n += mEntries[i].mCached ? 1 : 0;
+	}
+	return n;
+}
+
+size_t TextureCache::GetLevelBytes() const {
+	size_t bytes = 0;
+	for (int i = 0; i < mNumEntries; ++i) {
+		if (mEntries[i].mValid) {
+			for (int l = 0; l < mEntries[i].mMips.mNumLevels; ++l) {
+				bytes += mEntries[i].mMips.mLevels[l].mSize;
+			}
+		}
+	}
+	return bytes;
+}
+
+double TextureCache::GetPrepareTime() const {
+	return mPrepareTask.mEndTime - mPrepareTask.mStartTime;
+}
+
+double TextureCache::GetDecodeWork() const {
+	return mDecodeWork;
+}
+
+// FNV-1a over 8 byte words, a byte wise hash of the sources would cost more than decoding them
+static uint64_t HashSource(const byte *data, size_t size) {
+	uint64_t h = 14695981039346656037ULL;
+
+	size_t words = size / 8;
+	for (size_t i = 0; i < words; ++i) {
+		uint64_t w;
+		memcpy(&w, data + i * 8, 8);
+		h ^= w;
+		h *= 1099511628211ULL;
+	}
+
+	return h ^ HashFNV1a(data + words * 8, size - words * 8);
+}
+
+void TextureCache::HashProc(void *context, int index) {
+	TextureCache * cache = (TextureCache*)context;
+	entry_s &e = cache->mEntries[index];
+
+	mapped_file_s source;
+	if (!File_Map(e.mFileName, source)) {
+		return;
+	}
+
+	e.mSourceHash = HashSource(source.mData, source.mSize);
+	File_Unmap(source);
+
+	sprintf_(e.mCacheFileName, "%s%s%016llx.%s.tex", cache->mCacheDir, PATH_SEPERATOR,
+		(unsigned long long)e.mSourceHash, cache->mCompress ? "bc" : "rgba");
+
+	e.mCached = cache->MapCacheFile(e);
+	e.mValid = e.mCached;
+}
+
+void TextureCache::BuildProc(void *context, int index) {
+	TextureCache * cache = (TextureCache*)context;
+	entry_s &e = cache->mEntries[index];
+	if (e.mCached) {
+		return;
+	}
+
+	image32_s image;
+	if (!Image_TakePreloaded(e.mFileName, image)) {
+		return; // GL_CreateTexture2D reports it
+	}
+
+	cache->BuildMips(e, image);
+
+	if (e.mCacheFileName[0]) {
+		cache->WriteCacheFile(e);
+	}
+}
+
+bool TextureCache::MapCacheFile(entry_s &e) {
+	if (!File_Map(e.mCacheFileName, e.mMapping)) {
+		return false;
+	}
+
+	// a corrupt or foreign file must not move the levels outside the mapping
+	const tex_header_s * header = (const tex_header_s*)e.mMapping.mData;
+	if (e.mMapping.mSize < sizeof(tex_header_s) || header->mMagic != TEX_MAGIC || header->mSourceHash != e.mSourceHash
+		|| header->mNumLevels < 1 || header->mNumLevels > MAX_TEXTURE_LEVELS
+		|| (header->mFormat != TF_RGBA8 && header->mFormat != TF_BC1 && header->mFormat != TF_BC3)
+		|| header->mWidth < 1 || header->mWidth > MAX_TEX_SIZE || header->mHeight < 1 || header->mHeight > MAX_TEX_SIZE) {
+		File_Unmap(e.mMapping);
+		return false;
+	}
+
+	e.mMips.mFormat = (texture_format_t)header->mFormat;
+	e.mMips.mNumLevels = header->mNumLevels;
+
+	size_t offset = sizeof(tex_header_s);
+	int width = header->mWidth;
+	int height = header->mHeight;
+
+	for (int l = 0; l < header->mNumLevels; ++l) {
+		texture_level_s &level = e.mMips.mLevels[l];
+		level.mWidth = width;
+		level.mHeight = height;
+		level.mSize = GetLevelSize(e.mMips.mFormat, width, height);
+		level.mData = e.mMapping.mData + offset;
+
+		offset += (size_t)level.mSize;
+		if (offset > e.mMapping.mSize) {
+			File_Unmap(e.mMapping);
+			return false;
+		}
+
+		width = glm::max(width >> 1, 1);
+		height = glm::max(height >> 1, 1);
+	}
+
+	return true;
+}
+
+void TextureCache::WriteCacheFile(const entry_s &e) {
+	// other instances may have the cache file mapped, it is replaced by a complete file and never truncated
+	char temp_name[MAX_PATH];
+	sprintf_(temp_name, "%s.%d.%d.tmp", e.mCacheFileName, Sys_GetProcessId(), (int)(&e - mEntries));
+
+	FILE * f = File_Open(temp_name, "wb");
+	if (!f) {
+		return;
+	}
+
+	tex_header_s header;
+	header.mMagic = TEX_MAGIC;
+	header.mFormat = e.mMips.mFormat;
+	header.mWidth = e.mMips.mLevels[0].mWidth;
+	header.mHeight = e.mMips.mLevels[0].mHeight;
+	header.mNumLevels = e.mMips.mNumLevels;
+	header.mPad = 0;
+	header.mSourceHash = e.mSourceHash;
+
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	for (int l = 0; ok && l < e.mMips.mNumLevels; ++l) {
+		ok = fwrite(e.mMips.mLevels[l].mData, e.mMips.mLevels[l].mSize, 1, f) == 1;
+	}
+
+	ok = fclose(f) == 0 && ok;
+
+	if (!ok || !File_Replace(temp_name, e.mCacheFileName)) {
+		printf("could not write texture cache file \"%s\"\n", e.mCacheFileName);
+		remove(temp_name);
+	}
+}
+
+/*
+================================================================================
+mip chain and block compression
+================================================================================
+*/
+int TextureCache::GetLevelSize(texture_format_t format, int width, int height) {
+	int blocks = ((width + 3) >> 2) * ((height + 3) >> 2);
+
+	switch (format) {
+	case TF_BC1: return blocks * 8;
+	case TF_BC3: return blocks * 16;
+	default: return width * height * 4;
+	}
+}
+
+// 2x2 box filter, the last row or column of an odd level is used twice
+static void DownsampleLevel(const byte *src, int src_width, int src_height, byte *dst, int dst_width, int dst_height) {
+	for (int y = 0; y < dst_height; ++y) {
+		const byte * row0 = src + src_width * 4 * glm::min(y * 2, src_height - 1);
+		const byte * row1 = src + src_width * 4 * glm::min(y * 2 + 1, src_height - 1);
+		byte * out = dst + dst_width * 4 * y;
+
+		for (int x = 0; x < dst_width; ++x) {
+			int x0 = glm::min(x * 2, src_width - 1) * 4;
+			int x1 = glm::min(x * 2 + 1, src_width - 1) * 4;
+
+			for (int c = 0; c < 4; ++c) {
+				out[x * 4 + c] = (byte)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+			}
+		}
+	}
+}
+
+static uint16_t ToRGB565(int r, int g, int b) {
+	return (uint16_t)(((r * 31 + 127) / 255) << 11 | ((g * 63 + 127) / 255) << 5 | ((b * 31 + 127) / 255));
+}
+
+static void FromRGB565(uint16_t c, int *rgb) {
+	int r = (c >> 11) & 31;
+	int g = (c >> 5) & 63;
+	int b = c & 31;
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+// end points on the bounding box diagonal that follows the sign of the red and blue correlation with green,
+// always the four color mode
+static void EncodeColorBlock(const byte *pixels, byte *out) {
+	int lo[3] = { 255, 255, 255 };
+	int hi[3] = { 0, 0, 0 };
+	int mean[3] = { 0, 0, 0 };
+
+	for (int i = 0; i < 16; ++i) {
+		for (int c = 0; c < 3; ++c) {
+			lo[c] = glm::min(lo[c], (int)pixels[i * 4 + c]);
+			hi[c] = glm::max(hi[c], (int)pixels[i * 4 + c]);
+			mean[c] += pixels[i * 4 + c];
+		}
+	}
+
+	int cov_rg = 0;
+	int cov_bg = 0;
+	for (int i = 0; i < 16; ++i) {
+		int g = pixels[i * 4 + 1] * 16 - mean[1];
+		cov_rg += (pixels[i * 4 + 0] * 16 - mean[0]) * g;
+		cov_bg += (pixels[i * 4 + 2] * 16 - mean[2]) * g;
+	}
+
+	if (cov_rg < 0) {
+		std::swap(lo[0], hi[0]);
+	}
+
+	if (cov_bg < 0) {
+		std::swap(lo[2], hi[2]);
+	}
+
+	// pull the end points in a little, the extremes are rarely worth a palette entry
+	for (int c = 0; c < 3; ++c) {
+		int inset = (hi[c] - lo[c]) / 16;
+		hi[c] -= inset;
+		lo[c] += inset;
+	}
+
+	uint16_t c0 = ToRGB565(hi[0], hi[1], hi[2]);
+	uint16_t c1 = ToRGB565(lo[0], lo[1], lo[2]);
+	if (c0 < c1) {
+		std::swap(c0, c1);
+	}
+
+	uint32_t indices = 0;
+	if (c0 != c1) {
+		int palette[4][3];
+		FromRGB565(c0, palette[0]);
+		FromRGB565(c1, palette[1]);
+		for (int c = 0; c < 3; ++c) {
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+
+		for (int i = 0; i < 16; ++i) {
+			int best = 0;
+			int best_dist = INT_MAX;
+			for (int p = 0; p < 4; ++p) {
+				int dr = pixels[i * 4 + 0] - palette[p][0];
+				int dg = pixels[i * 4 + 1] - palette[p][1];
+				int db = pixels[i * 4 + 2] - palette[p][2];
+				int dist = dr * dr + dg * dg + db * db;
+				if (dist < best_dist) {
+					best_dist = dist;
+					best = p;
+				}
+			}
+			indices |= (uint32_t)best << (i * 2);
+		}
+	}
+
+	memcpy(out + 0, &c0, 2);
+	memcpy(out + 2, &c1, 2);
+	memcpy(out + 4, &indices, 4);
+}
+
+// eight alpha mode between the block min and max
+static void EncodeAlphaBlock(const byte *pixels, byte *out) {
+	int a0 = 0;
+	int a1 = 255;
+	for (int i = 0; i < 16; ++i) {
+		a0 = glm::max(a0, (int)pixels[i * 4 + 3]);
+		a1 = glm::min(a1, (int)pixels[i * 4 + 3]);
+	}
+
+	uint64_t bits = 0;
+	if (a0 != a1) {
+		int palette[8];
+		palette[0] = a0;
+		palette[1] = a1;
+		for (int p = 1; p < 7; ++p) {
+			palette[p + 1] = ((7 - p) * a0 + p * a1) / 7;
+		}
+
+		for (int i = 0; i < 16; ++i) {
+			int a = pixels[i * 4 + 3];
+			int best = 0;
+			for (int p = 1; p < 8; ++p) {
+				if (abs(a - palette[p]) < abs(a - palette[best])) {
+					best = p;
+				}
+			}
+			bits |= (uint64_t)best << (i * 3);
+		}
+	}
+
+	out[0] = (byte)a0;
+	out[1] = (byte)a1;
+	for (int i = 0; i < 6; ++i) {
+		out[2 + i] = (byte)(bits >> (i * 8));
+	}
+}
+
+static void EncodeLevel(const byte *src, int width, int height, texture_format_t format, byte *dst) {
+	int block_size = format == TF_BC3 ? 16 : 8;
+	byte pixels[16 * 4];
+
+	for (int by = 0; by < height; by += 4) {
+		for (int bx = 0; bx < width; bx += 4) {
+			// edge blocks of small levels repeat their last row and column
+			for (int i = 0; i < 16; ++i) {
+				int x = glm::min(bx + (i & 3), width - 1);
+				int y = glm::min(by + (i >> 2), height - 1);
+				memcpy(pixels + i * 4, src + (y * width + x) * 4, 4);
+			}
+
+			if (format == TF_BC3) {
+				EncodeAlphaBlock(pixels, dst);
+				EncodeColorBlock(pixels, dst + 8);
+			}
+			else {
+				EncodeColorBlock(pixels, dst);
+			}
+
+			dst += block_size;
+		}
+	}
+}
+
+void TextureCache::BuildMips(entry_s &e, image32_s &image) {
+	texture_mips_s &mips = e.mMips;
+
+	if (!mCacheDir[0] && !mCompress) { // level 0 as decoded, GL builds the rest
+		mips.mFormat = TF_RGBA8;
+		mips.mNumLevels = 1;
+		mips.mLevels[0].mWidth = image.mWidth;
+		mips.mLevels[0].mHeight = image.mHeight;
+		mips.mLevels[0].mSize = image.mWidth * image.mHeight * 4;
+		mips.mLevels[0].mData = image.mData;
+
+		e.mData = image.mData;
+		image.mData = nullptr;
+		e.mValid = true;
+		return;
+	}
+
+	mips.mFormat = TF_RGBA8;
+	if (mCompress) {
+		bool opaque = true;
+		for (int i = 0; i < image.mWidth * image.mHeight && opaque; ++i) {
+			opaque = image.mData[i * 4 + 3] == 255;
+		}
+		mips.mFormat = opaque ? TF_BC1 : TF_BC3;
+	}
+
+	// level sizes, the RGBA chain and the encoded chain
+	int num_levels = 0;
+	size_t rgba_bytes = 0;
+	size_t out_bytes = 0;
+	for (int w = image.mWidth, h = image.mHeight; num_levels < MAX_TEXTURE_LEVELS; ++num_levels) {
+		mips.mLevels[num_levels].mWidth = w;
+		mips.mLevels[num_levels].mHeight = h;
+		mips.mLevels[num_levels].mSize = GetLevelSize(mips.mFormat, w, h);
+		rgba_bytes += (size_t)w * h * 4;
+		out_bytes += mips.mLevels[num_levels].mSize;
+
+		if (w == 1 && h == 1) {
+			num_levels++;
+			break;
+		}
+		w = glm::max(w >> 1, 1);
+		h = glm::max(h >> 1, 1);
+	}
+	mips.mNumLevels = num_levels;
+
+	byte * rgba = mCompress ? (byte*)malloc(rgba_bytes) : nullptr;
+	e.mData = (byte*)malloc(out_bytes);
+
+	byte * level_rgba = mCompress ? rgba : e.mData;
+	byte * level_out = e.mData;
+	const byte * prior = image.mData;
+
+	for (int l = 0; l < num_levels; ++l) {
+		texture_level_s &level = mips.mLevels[l];
+
+		if (l == 0) {
+			memcpy(level_rgba, image.mData, (size_t)level.mWidth * level.mHeight * 4);
+		}
+		else {
+			const texture_level_s &up = mips.mLevels[l - 1];
+			DownsampleLevel(prior, up.mWidth, up.mHeight, level_rgba, level.mWidth, level.mHeight);
+		}
+
+		if (mCompress) {
+			EncodeLevel(level_rgba, level.mWidth, level.mHeight, mips.mFormat, level_out);
+		}
+
+		level.mData = level_out;
+		prior = level_rgba;
+		level_rgba += (size_t)level.mWidth * level.mHeight * 4;
+		level_out += level.mSize;
+	}
+
+	if (rgba) {
+		free(rgba);
+	}
+
+	e.mValid = true;
+}
@@ -0,0 +1,69 @@
+/*
+prepared texture cache
+*/
+
+#pragma once
+
+// mip chains of the textures a renderer is about to create. with a cache directory the chains are built once,
+// optionally block compressed, and stored in a file named by the hash of the source file. later runs map that
+// file and upload its levels as they are
+class TextureCache {
+public:
+
+	TextureCache();
+	~TextureCache();
+
+	// cache_dir nullptr or empty: no files, textures are only decoded and GL builds the mips
+	void						Init(const char *cache_dir, bool compress);
+	// on a task thread that uses all workers, the GL context is not touched
+	void						StartPrepare(const char * const *filenames, int count);
+	double						WaitPrepare();	// returns the seconds waited
+	const texture_mips_s *		Find(const char *filename) const;	// after WaitPrepare
+	void						Free();
+
+	int							GetCount() const;
+	int							GetCachedCount() const;	// mapped from cache files by the last Prepare
+	size_t						GetLevelBytes() const;	// of all prepared levels
+	double						GetPrepareTime() const;	// seconds on the task thread
+	double						GetDecodeWork() const;	// seconds summed over the threads
+
+private:
+
+	struct tex_header_s {
+		uint32_t				mMagic;
+		int32_t					mFormat;		// texture_format_t
+		int32_t					mWidth;
+		int32_t					mHeight;
+		int32_t					mNumLevels;
+		int32_t					mPad;
+		uint64_t				mSourceHash;
+	};
+
+	struct entry_s {
+		char					mFileName[MAX_PATH];
+		char					mCacheFileName[MAX_PATH];
+		uint64_t				mSourceHash;
+		bool					mValid;
+		bool					mCached;
+		texture_mips_s			mMips;
+		byte *					mData;			// built this run
+		mapped_file_s			mMapping;		// or the cache file
+	};
+
+	char						mCacheDir[MAX_PATH];
+	bool						mCompress;
+	entry_s *					mEntries;
+	int							mNumEntries;
+	sys_task_s					mPrepareTask;
+	double						mDecodeWork;
+
+	static void					PrepareProc(void *context);
+	static void					HashProc(void *context, int index);
+	static void					BuildProc(void *context, int index);
+
+	static int					GetLevelSize(texture_format_t format, int width, int height);	// bytes
+
+	bool						MapCacheFile(entry_s &entry);
+	void						BuildMips(entry_s &entry, image32_s &image);	// may take over the pixels
+	void						WriteCacheFile(const entry_s &entry);
+};
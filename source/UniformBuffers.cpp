@@ -4,24 +4,77 @@ shared uniform buffer
 
 #include "Precompiled.h"
 
-UniformBuffers::UniformBuffers() {
+static const GLbitfield UNIFORM_RING_FLAGS = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+UniformBuffers::UniformBuffers():
+	mRingBuffer(0),
+	mRingMapped(nullptr),
+	mRingFrameSize(0),
+	mRingFrame(0),
+	mCallCount(0)
+{
 	memset(mUBO, 0, sizeof(mUBO));
+	memset(mShadow, 0, sizeof(mShadow));
+	memset(mBlockSize, 0, sizeof(mBlockSize));
+	memset(mBlockOffset, 0, sizeof(mBlockOffset));
+	memset(mRingOffset, 0, sizeof(mRingOffset));
 }
 
 UniformBuffers::~UniformBuffers() {
+	if (mRingBuffer) {
+		glBindBuffer(GL_UNIFORM_BUFFER, mRingBuffer);
+		glUnmapBuffer(GL_UNIFORM_BUFFER);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glDeleteBuffers(1, &mRingBuffer);
+	}
+
 	glDeleteBuffers(UBO_COUNT, mUBO);
 }
 
-bool UniformBuffers::Init() {
-	mUBO[UBO_MODEL_VIEW_PROJ_MATRIX] = GL_CreateUniformBuffer(sizeof(mat4) * 2);
-	mUBO[UBO_MODEL_VIEW_PROJ_MATRIX_FOLLOW_CAMERA] = GL_CreateUniformBuffer(sizeof(mat4));
-	mUBO[UBO_ORTHO_MODEL_VIEW_PROJ_MATRIX] = GL_CreateUniformBuffer(sizeof(mat4));
-	mUBO[UBO_WIREFRAME_COLOR] = GL_CreateUniformBuffer(sizeof(vec4));
-	mUBO[UBO_FOG] = GL_CreateUniformBuffer(sizeof(vec4));
-	mUBO[UBO_FONT_COLOR] = GL_CreateUniformBuffer(sizeof(vec4));
-	mUBO[UBO_HEIGHT_FIELD] = GL_CreateUniformBuffer(sizeof(vec4));
+bool UniformBuffers::Init(bool persistent_ring) {
+	mBlockSize[UBO_MODEL_VIEW_PROJ_MATRIX] = sizeof(mat4) * 2;
+	mBlockSize[UBO_MODEL_VIEW_PROJ_MATRIX_FOLLOW_CAMERA] = sizeof(mat4);
+	mBlockSize[UBO_ORTHO_MODEL_VIEW_PROJ_MATRIX] = sizeof(mat4);
+	mBlockSize[UBO_WIREFRAME_COLOR] = sizeof(vec4);
+	mBlockSize[UBO_FOG] = sizeof(vec4);
+	mBlockSize[UBO_FONT_COLOR] = sizeof(vec4);
+	mBlockSize[UBO_HEIGHT_FIELD] = sizeof(vec4);
+	mBlockSize[UBO_TESSELLATION] = sizeof(vec4) * 3;
+	mBlockSize[UBO_MORPH] = sizeof(vec4) * 6;
+	mBlockSize[UBO_QUANTIZATION] = sizeof(vec4) * 2;
+
+	if (persistent_ring && GLEW_ARB_buffer_storage) {
+		GLint alignment = 256;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		alignment = max(alignment, 16);
+
+		// block offsets inside one frame
+		int offset = 0;
+		for (int i = 0; i < UBO_COUNT; ++i) {
+			mBlockOffset[i] = offset;
+			offset += (mBlockSize[i] + alignment - 1) / alignment * alignment;
+		}
+		mRingFrameSize = offset;
+
+		GLsizeiptr size = (GLsizeiptr)mRingFrameSize * MAX_FRAMES_IN_FLIGHT;
+
+		glGenBuffers(1, &mRingBuffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, mRingBuffer);
+		glBufferStorage(GL_UNIFORM_BUFFER, size, nullptr, UNIFORM_RING_FLAGS);
+		mRingMapped = (byte*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, size, UNIFORM_RING_FLAGS);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+		if (mRingMapped) {
+			return true;
+		}
+
+		printf("could not map uniform ring, fall back to separate uniform buffers\n");
+		glDeleteBuffers(1, &mRingBuffer);
+		mRingBuffer = 0;
+	}
 
 	for (int i = 0; i < UBO_COUNT; ++i) {
+		mUBO[i] = GL_CreateUniformBuffer(mBlockSize[i]);
 		if (!mUBO[i]) {
 			return false;
 		}
@@ -31,54 +84,102 @@ bool UniformBuffers::Init() {
 }
 
 void UniformBuffers::SetModelViewProjMatrix(const mat4 &mvp, const mat4 &mv) {
-	glBindBuffer(GL_UNIFORM_BUFFER, mUBO[UBO_MODEL_VIEW_PROJ_MATRIX]);
-	GLubyte * buf = (GLubyte*)glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-	memcpy(buf, &mvp, sizeof(mvp));
-	buf += sizeof(mat4);
-	memcpy(buf, &mv, sizeof(mv));
-	glUnmapBuffer(GL_UNIFORM_BUFFER);
+	mat4 m[2] = { mvp, mv };
+	Write(UBO_MODEL_VIEW_PROJ_MATRIX, m, sizeof(m));
 }
 
 void UniformBuffers::SetModelViewProjMatrix_FollowCamera(const mat4 &mvp) {
-	glBindBuffer(GL_UNIFORM_BUFFER, mUBO[UBO_MODEL_VIEW_PROJ_MATRIX_FOLLOW_CAMERA]);
-	GLubyte * buf = (GLubyte*)glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-	memcpy(buf, &mvp, sizeof(mvp));
-	glUnmapBuffer(GL_UNIFORM_BUFFER);
+	Write(UBO_MODEL_VIEW_PROJ_MATRIX_FOLLOW_CAMERA, &mvp, sizeof(mvp));
 }
 
 void UniformBuffers::SetOrthoModelViewProjMatrix(const mat4 &mvp) {
-	glBindBuffer(GL_UNIFORM_BUFFER, mUBO[UBO_ORTHO_MODEL_VIEW_PROJ_MATRIX]);
-	GLubyte * buf = (GLubyte*)glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-	memcpy(buf, &mvp, sizeof(mvp));
-	glUnmapBuffer(GL_UNIFORM_BUFFER);
+	Write(UBO_ORTHO_MODEL_VIEW_PROJ_MATRIX, &mvp, sizeof(mvp));
 }
 
 void UniformBuffers::SetFog(const vec3 &fog_color, float density) {
-	glBindBuffer(GL_UNIFORM_BUFFER, mUBO[UBO_FOG]);
-	GLubyte * buf = (GLubyte*)glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-	memcpy(buf, &fog_color, sizeof(fog_color));
-	buf += sizeof(vec3);
-	memcpy(buf, &density, sizeof(density));
-	glUnmapBuffer(GL_UNIFORM_BUFFER);
+	vec4 v(fog_color, density);
+	Write(UBO_FOG, &v, sizeof(v));
 }
 
 void UniformBuffers::SetWireframeColor(const vec3 &wireframe_color) {
-	glBindBuffer(GL_UNIFORM_BUFFER, mUBO[UBO_WIREFRAME_COLOR]);
-	vec4 * buf = (vec4*)glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-	*buf = vec4(wireframe_color, 1.0f);
-	glUnmapBuffer(GL_UNIFORM_BUFFER);
+	vec4 v(wireframe_color, 1.0f);
+	Write(UBO_WIREFRAME_COLOR, &v, sizeof(v));
 }
 
 void UniformBuffers::SetFontColor(const vec3 &font_color) {
-	glBindBuffer(GL_UNIFORM_BUFFER, mUBO[UBO_FONT_COLOR]);
-	vec4 * buf = (vec4*)glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-	*buf = vec4(font_color, 1.0f);
-	glUnmapBuffer(GL_UNIFORM_BUFFER);
+	vec4 v(font_color, 1.0f);
+	Write(UBO_FONT_COLOR, &v, sizeof(v));
 }
 
 void UniformBuffers::SetHeightFieldSize(int size) {
-	glBindBuffer(GL_UNIFORM_BUFFER, mUBO[UBO_HEIGHT_FIELD]);
-	vec4 * buf = (vec4*)glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-	buf->x = (float)size;
-	glUnmapBuffer(GL_UNIFORM_BUFFER);
+	vec4 v((float)size, 0.0f, 0.0f, 0.0f);
+	Write(UBO_HEIGHT_FIELD, &v, sizeof(v));
+}
+
+void UniformBuffers::SetTessellation(const vec4 &camera_pos, const vec4 &params, const vec4 &height_field) {
+	vec4 v[3] = { camera_pos, params, height_field };
+	Write(UBO_TESSELLATION, v, sizeof(v));
+}
+
+void UniformBuffers::SetQuantization(const vec4 &offset, const vec4 &scale) {
+	vec4 v[2] = { offset, scale };
+	Write(UBO_QUANTIZATION, v, sizeof(v));
+}
+
+void UniformBuffers::SetMorph(const vec4 &camera_pos, const vec4 &params, const vec4 *active_distances) {
+	vec4 v[6] = { camera_pos, params, active_distances[0], active_distances[1], active_distances[2], active_distances[3] };
+	Write(UBO_MORPH, v, sizeof(v));
+}
+
+void UniformBuffers::Commit() {
+	if (!mRingBuffer) {
+		return;
+	}
+
+	// the renderer waits on the frame fence of this slot before a frame starts,
+	// so the GPU has finished reading it
+	mRingFrame = (mRingFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+
+	int base = mRingFrameSize * mRingFrame;
+	for (int i = 0; i < UBO_COUNT; ++i) {
+		mRingOffset[i] = base + mBlockOffset[i];
+		memcpy(mRingMapped + mRingOffset[i], mShadow[i], mBlockSize[i]);
+	}
+}
+
+void UniformBuffers::Bind(GLuint binding, int block) {
+	if (mRingBuffer) {
+		glBindBufferRange(GL_UNIFORM_BUFFER, binding, mRingBuffer, mRingOffset[block], mBlockSize[block]);
+	}
+	else {
+		glBindBufferBase(GL_UNIFORM_BUFFER, binding, mUBO[block]);
+	}
+
+	mCallCount++;
+}
+
+bool UniformBuffers::IsPersistentRing() const {
+	return mRingBuffer != 0;
+}
+
+void UniformBuffers::ResetCallCount() {
+	mCallCount = 0;
+}
+
+int UniformBuffers::GetCallCount() const {
+	return mCallCount;
+}
+
+void UniformBuffers::Write(int block, const void *data, int size) {
+	memcpy(mShadow[block], data, size);
+
+	if (!mRingBuffer) {
+		// bind, map, unmap: the unmap is a sync point for the driver
+		glBindBuffer(GL_UNIFORM_BUFFER, mUBO[block]);
+		GLubyte * buf = (GLubyte*)glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
+		memcpy(buf, data, size);
+		glUnmapBuffer(GL_UNIFORM_BUFFER);
+
+		mCallCount += 3;
+	}
 }
@@ -4,6 +4,8 @@ shared uniform buffer
 
 #pragma once
 
+#define	UBO_MAX_BLOCK_SIZE		128		// largest block, two matrices
+
 struct UniformBuffers {
 	enum {
 		UBO_MODEL_VIEW_PROJ_MATRIX,
@@ -13,16 +15,18 @@ struct UniformBuffers {
 		UBO_FOG,
 		UBO_FONT_COLOR,
 		UBO_HEIGHT_FIELD,
+		UBO_TESSELLATION,
+		UBO_MORPH,
+		UBO_QUANTIZATION,
 
 		UBO_COUNT
 	};
 
-	GLuint						mUBO[UBO_COUNT];
-
 	UniformBuffers();
 	~UniformBuffers();
 
-	bool						Init();
+	// persistent_ring: one mapped buffer, a frame's blocks are written once in Commit
+	bool						Init(bool persistent_ring);
 
 	void						SetModelViewProjMatrix(const mat4 &mvp, const mat4 &mv);
 	void						SetModelViewProjMatrix_FollowCamera(const mat4 &mvp);
@@ -31,4 +35,35 @@ struct UniformBuffers {
 	void						SetWireframeColor(const vec3 &wireframe_color);
 	void						SetFontColor(const vec3 &font_color);
 	void						SetHeightFieldSize(int size);
+	void						SetTessellation(const vec4 &camera_pos, const vec4 &params, const vec4 &height_field);
+	void						SetQuantization(const vec4 &offset, const vec4 &scale);
+	void						SetMorph(const vec4 &camera_pos, const vec4 &params, const vec4 *active_distances);	// active_distances: 4 vec4
+
+	void						Commit();	// once per frame, after the Set calls and before any Bind
+	void						Bind(GLuint binding, int block);
+
+	bool						IsPersistentRing() const;
+	void						ResetCallCount();
+	int							GetCallCount() const;	// GL calls since ResetCallCount
+
+private:
+
+	// legacy, one buffer per block updated with glMapBuffer
+	GLuint						mUBO[UBO_COUNT];
+
+	// CPU copy of every block, the ring is filled from here
+	byte						mShadow[UBO_COUNT][UBO_MAX_BLOCK_SIZE];
+	int							mBlockSize[UBO_COUNT];
+
+	// persistent ring, MAX_FRAMES_IN_FLIGHT frames of all blocks
+	GLuint						mRingBuffer;
+	byte *						mRingMapped;
+	int							mRingFrameSize;
+	int							mRingFrame;
+	int							mBlockOffset[UBO_COUNT];	// aligned, inside one frame
+	int							mRingOffset[UBO_COUNT];	// current frame, bytes from ring start
+
+	int							mCallCount;
+
+	void						Write(int block, const void *data, int size);
 };